@@ -18,6 +18,9 @@
 #endif
 #include <string.h>
 
+#include "picturestr.h"
+#include "damage.h"
+
 #include "compat-api.h"
 
 /* Supported chipsets */
@@ -25,16 +28,116 @@ typedef enum {
     VNC_CHIP
 } VNCType;
 
+#define VNC_MAX_OUTPUTS 32
+
 /* function prototypes */
 
 extern Bool VNCSwitchMode(SWITCH_MODE_ARGS_DECL);
 extern void VNCAdjustFrame(ADJUST_FRAME_ARGS_DECL);
+extern void VNCStartupMark(ScrnInfoPtr pScrn, const char *event);
+
+/* in vnc_capture.c */
+typedef struct _vncCaptureState *VNCCapturePtr;
+extern Bool VNCCaptureInit(ScrnInfoPtr pScrn);
+extern Bool VNCCapturePending(ScrnInfoPtr pScrn);
+extern void VNCCaptureUpdate(ScrnInfoPtr pScrn, RegionPtr region);
+extern void VNCCaptureWindowDestroyed(ScrnInfoPtr pScrn, WindowPtr pWin);
+extern void VNCCaptureClose(ScrnInfoPtr pScrn);
 
 /* in vnc_cursor.c */
 extern Bool VNCCursorInit(ScreenPtr pScrn);
 extern void VNCShowCursor(ScrnInfoPtr pScrn);
 extern void VNCHideCursor(ScrnInfoPtr pScrn);
 
+/* in vnc_damage.c */
+typedef struct _vncDirtyState *VNCDirtyPtr;
+extern Bool VNCDamageStart(ScreenPtr pScreen);
+extern void VNCDamageResize(ScrnInfoPtr pScrn);
+extern void VNCDamagePublish(ScreenPtr pScreen, pointer pTimeout);
+extern void VNCDamageClose(ScreenPtr pScreen);
+
+/* in vnc_export.c */
+typedef struct {
+    char *path;
+    int fd;
+    void *map;
+    size_t size;
+} VNCExportRec, *VNCExportPtr;
+
+extern Bool VNCExportMap(ScrnInfoPtr pScrn, VNCExportPtr ex,
+                         const char *name, size_t size);
+extern void VNCExportUnmap(VNCExportPtr ex);
+
+/* in vnc_fbfile.c */
+extern Bool VNCFbFileProbe(ScrnInfoPtr pScrn, int *width, int *height);
+extern void *VNCFbFileMap(ScrnInfoPtr pScrn, size_t bytes);
+extern void VNCFbFileFrame(ScrnInfoPtr pScrn);
+extern void VNCFbFileUnmap(ScrnInfoPtr pScrn);
+
+/* in vnc_latency.c */
+typedef struct _vncLatencyState *VNCLatencyPtr;
+extern Bool VNCLatencyInit(ScrnInfoPtr pScrn);
+extern void VNCLatencyUpdate(ScrnInfoPtr pScrn, RegionPtr region);
+extern void VNCLatencyClose(ScrnInfoPtr pScrn);
+
+/* in vnc_layout.c */
+typedef struct _vncLayoutState *VNCLayoutPtr;
+extern Bool VNCLayoutInit(ScrnInfoPtr pScrn);
+extern void VNCLayoutUpdate(ScrnInfoPtr pScrn);
+extern void VNCLayoutClose(ScrnInfoPtr pScrn);
+
+/* in vnc_profile.c */
+typedef struct _vncProfileState *VNCProfilePtr;
+extern Bool VNCProfileInit(ScreenPtr pScreen);
+extern void VNCProfileCheck(ScrnInfoPtr pScrn);
+extern void VNCProfileClose(ScreenPtr pScreen);
+
+/* in vnc_record.c */
+typedef struct _vncRecordState *VNCRecordPtr;
+extern Bool VNCRecordInit(ScrnInfoPtr pScrn);
+extern Bool VNCRecordPending(ScrnInfoPtr pScrn);
+extern void VNCRecordUpdate(ScrnInfoPtr pScrn, RegionPtr region);
+extern void VNCRecordCursor(ScrnInfoPtr pScrn);
+extern void VNCRecordCursorImage(ScrnInfoPtr pScrn,
+                                 const unsigned char *image);
+extern void VNCRecordClose(ScrnInfoPtr pScrn);
+
+/* in vnc_render.c */
+typedef struct _vncGlyphAtlas *VNCGlyphAtlasPtr;
+extern Bool VNCRenderInit(ScreenPtr pScreen);
+extern void VNCRenderClose(ScreenPtr pScreen);
+
+/* in vnc_scroll.c */
+typedef struct _vncScrollState *VNCScrollPtr;
+extern Bool VNCScrollInit(ScrnInfoPtr pScrn);
+extern void VNCScrollUpdate(ScrnInfoPtr pScrn, RegionPtr region);
+extern void VNCScrollClose(ScrnInfoPtr pScrn);
+
+/* in vnc_sparse.c */
+extern size_t VNCSparseCommitted(ScrnInfoPtr pScrn, int width, int height,
+                                 int replace, const BoxRec *box);
+extern void *VNCSparseMap(ScrnInfoPtr pScrn, size_t bytes);
+extern void VNCSparseCover(ScrnInfoPtr pScrn, const BoxRec *box);
+extern void VNCSparseTrim(ScrnInfoPtr pScrn);
+extern void VNCSparseUnmap(ScrnInfoPtr pScrn);
+
+/* in vnc_tilestats.c */
+typedef struct _vncTileStatsState *VNCTileStatsPtr;
+extern Bool VNCTileStatsInit(ScrnInfoPtr pScrn);
+extern void VNCTileStatsUpdate(ScrnInfoPtr pScrn, RegionPtr region);
+extern void VNCTileStatsClose(ScrnInfoPtr pScrn);
+
+/* in vnc_video.c */
+extern Bool VNCVideoInit(ScreenPtr pScreen);
+extern void VNCVideoClose(ScreenPtr pScreen);
+
+/* in vnc_video_detect.c */
+typedef struct _vncVideoDetectState *VNCVideoDetectPtr;
+extern Bool VNCVideoDetectInit(ScrnInfoPtr pScrn);
+extern void VNCVideoDetectUpdate(ScrnInfoPtr pScrn, RegionPtr damage,
+                                 pointer pTimeout);
+extern void VNCVideoDetectClose(ScrnInfoPtr pScrn);
+
 /* globals */
 typedef struct _color
 {
@@ -48,17 +151,87 @@ typedef struct vncRec
     /* options */
     OptionInfoPtr Options;
     Bool swCursor;
+    Bool glyphCache;
     int numOutputs;
+    int maxOutputs;
+    const char *fbFile;
+    Bool sparseFb;
+    int sparseMargin;
+    const char *exportDir;
+    Bool tileStats;
+    Bool windowCapture;
+    Bool scrollDetect;
+    Bool videoRegions;
+    Bool latencyStats;
+    Bool renderProfile;
+    const char *recordFile;
+    int recordKeyframe;         /* seconds */
+    Bool scanoutLayout;
+    int damageTileThreshold;    /* rectangles, 0 to always keep a region */
+    Bool dirtyTiles;
+    Bool xvAdaptor;
     /* proc pointer */
     CloseScreenProcPtr CloseScreen;
+    CreateScreenResourcesProcPtr CreateScreenResources;
+    ScreenBlockHandlerProcPtr BlockHandler;
     xf86CursorInfoPtr CursorInfo;
 
     Bool VncHWCursorShown;
     int cursorX, cursorY;
     int cursorFG, cursorBG;
 
+    /* desktop size last requested through VNC_DESKTOP_SIZE, 0 if none */
+    int outputWidth[VNC_MAX_OUTPUTS];
+    int outputHeight[VNC_MAX_OUTPUTS];
+    Bool outputConnected[VNC_MAX_OUTPUTS];
+    Bool hotplugPending;
+    /* start-up timing, CLOCK_MONOTONIC microseconds */
+    uint64_t startTime;
+    Bool started;               /* the first BlockHandler has run */
+    VNCLayoutPtr layout;
+    Bool layoutChanged;         /* since the layout was last exported */
+
+    /* file-backed framebuffer */
+    int fbFileFd;
+    void *fbFileMap;
+    size_t fbFileMapSize;
+
+    /* sparse framebuffer */
+    void *sparseMap;
+    size_t sparseMapSize;
+    Bool sparseTrim;            /* layout changed since pages were released */
+    RegionRec sparseReleased;   /* may read as zero since the last trim */
+    RegionRec sparseExpose;     /* released, now under a CRTC */
+
+    /* damage to the screen pixmap since the last published frame */
+    DamagePtr damage;
+    VNCDirtyPtr dirty;          /* or in a tile bitmap, once too fragmented */
+    uint64_t frame;
+
+    /* damage held back outside the VNC_VIEWPORT_HINT region */
+    int viewportDefer;          /* ms, 0 to ignore the hint */
+    Atom viewportProp;
+    Bool viewportChanged;
+    RegionPtr viewport;
+    RegionRec deferred;
+    CARD32 deferredSince;
+
+    VNCTileStatsPtr tileStatsState;
+    VNCCapturePtr capture;
+    VNCScrollPtr scroll;
+    VNCVideoDetectPtr videoDetect;
+    VNCLatencyPtr latency;
+    VNCProfilePtr profile;
+    VNCRecordPtr record;
+#ifdef XvExtension
+    XF86VideoAdaptorPtr videoAdaptor;
+#endif
+
     vnc_colors colors[1024];
     Bool        (*CreateWindow)() ;     /* wrapped CreateWindow */
+    DestroyWindowProcPtr DestroyWindow; /* wrapped DestroyWindow */
+    GlyphsProcPtr Glyphs;               /* wrapped Glyphs */
+    VNCGlyphAtlasPtr glyphAtlas;
     Bool prop;
 } VNCRec, *VNCPtr;
 
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Per-window capture for application sharing.
+ *
+ * With the WindowCapture option, the VNC server lists the windows it wants
+ * to share in the VNC_CAPTURE_WINDOWS root window property (type WINDOW
+ * or CARDINAL, format 32).  For each of them the driver exports its
+ * visible region, its place in the stacking order and the damage clipped
+ * to it (see vncWindowExport in vnc_export.h), so that the server can
+ * encode just those windows rather than scanning and masking the whole
+ * desktop.
+ *
+ * Windows are read from the screen pixmap, so this is meant for desktops
+ * without a compositing manager redirecting them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "xf86.h"
+#include "property.h"
+#include "propertyst.h"
+#include "windowstr.h"
+#include <X11/Xatom.h>
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+#define CAPTURE_PROP_NAME "VNC_CAPTURE_WINDOWS"
+#define CAPTURE_MAX_WINDOWS 8
+
+typedef struct {
+    XID id;
+    WindowPtr pWin;
+    Bool fresh;                 /* nothing exported yet */
+    VNCExportRec export;
+} vncCaptureWindow;
+
+typedef struct _vncCaptureState {
+    ScrnInfoPtr pScrn;
+    Atom prop;
+    Bool changed;               /* the property has changed */
+    vncCaptureWindow windows[CAPTURE_MAX_WINDOWS];
+} VNCCaptureRec;
+
+static void
+capture_property_callback(CallbackListPtr *list, pointer closure, pointer data)
+{
+    VNCCapturePtr cap = closure;
+    PropertyStateRec *rec = data;
+
+    if (rec->win == xf86ScrnToScreen(cap->pScrn)->root &&
+	rec->prop->propertyName == cap->prop)
+	cap->changed = TRUE;
+}
+
+static void
+capture_remove(vncCaptureWindow *cw)
+{
+    VNCExportUnmap(&cw->export);
+    cw->id = None;
+    cw->pWin = NULL;
+}
+
+static vncCaptureWindow *
+capture_find(VNCCapturePtr cap, XID id)
+{
+    int i;
+
+    for (i = 0; i < CAPTURE_MAX_WINDOWS; i++) {
+	if (cap->windows[i].id == id)
+	    return &cap->windows[i];
+    }
+    return NULL;
+}
+
+/* Bring the captured windows into line with the root window property */
+static void
+capture_read_property(VNCCapturePtr cap)
+{
+    ScreenPtr pScreen = xf86ScrnToScreen(cap->pScrn);
+    PropertyPtr pProp;
+    const CARD32 *ids = NULL;
+    int count = 0;
+    int i, j;
+
+    cap->changed = FALSE;
+
+    if (dixLookupProperty(&pProp, pScreen->root, cap->prop, serverClient,
+			  DixReadAccess) == Success &&
+	(pProp->type == XA_WINDOW || pProp->type == XA_CARDINAL) &&
+	pProp->format == 32) {
+	ids = pProp->data;
+	count = pProp->size;
+    }
+
+    /* Drop windows no longer listed */
+    for (i = 0; i < CAPTURE_MAX_WINDOWS; i++) {
+	vncCaptureWindow *cw = &cap->windows[i];
+
+	if (cw->id == None)
+	    continue;
+	for (j = 0; j < count; j++) {
+	    if (ids[j] == cw->id)
+		break;
+	}
+	if (j == count)
+	    capture_remove(cw);
+    }
+
+    /* Add new ones */
+    for (j = 0; j < count; j++) {
+	vncCaptureWindow *cw;
+	WindowPtr pWin;
+	char name[32];
+
+	if (ids[j] == None || capture_find(cap, ids[j]))
+	    continue;
+	if (dixLookupWindow(&pWin, ids[j], serverClient,
+			    DixGetAttrAccess) != Success ||
+	    pWin->drawable.pScreen != pScreen || !pWin->parent)
+	    continue;
+
+	cw = capture_find(cap, None);
+	if (!cw) {
+	    xf86DrvMsg(cap->pScrn->scrnIndex, X_WARNING,
+		       "Capturing at most %d windows\n", CAPTURE_MAX_WINDOWS);
+	    break;
+	}
+
+	snprintf(name, sizeof(name), "window-0x%08x", (unsigned int)ids[j]);
+	if (!VNCExportMap(cap->pScrn, &cw->export, name,
+			  sizeof(vncWindowExport))) {
+	    VNCExportUnmap(&cw->export);
+	    continue;
+	}
+	cw->id = ids[j];
+	cw->pWin = pWin;
+	cw->fresh = TRUE;
+    }
+}
+
+/* Position of the top-level ancestor of pWin among its siblings */
+static uint32_t
+capture_stack_index(WindowPtr pWin)
+{
+    WindowPtr pSib;
+    uint32_t index = 0;
+
+    while (pWin->parent && pWin->parent->parent)
+	pWin = pWin->parent;
+    for (pSib = pWin->prevSib; pSib; pSib = pSib->prevSib)
+	index++;
+    return index;
+}
+
+static uint32_t
+capture_export_region(vncExportBox *boxes, RegionPtr region)
+{
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    int i;
+
+    if (n > VNC_WINDOW_MAX_RECTS) {
+	box = RegionExtents(region);
+	n = 1;
+    }
+    for (i = 0; i < n; i++) {
+	boxes[i].x1 = box[i].x1;
+	boxes[i].y1 = box[i].y1;
+	boxes[i].x2 = box[i].x2;
+	boxes[i].y2 = box[i].y2;
+    }
+    return n;
+}
+
+static void
+capture_export_window(vncCaptureWindow *cw, RegionPtr damage, uint64_t frame)
+{
+    WindowPtr pWin = cw->pWin;
+    vncWindowExport *ex = cw->export.map;
+    int bw = wBorderWidth(pWin);
+    RegionRec clipped;
+
+    /*
+     * Rewritten every frame: covering a window changes its visible region
+     * without damaging it.
+     */
+    RegionNull(&clipped);
+    if (pWin->viewable)
+	RegionIntersect(&clipped, damage, &pWin->borderClip);
+
+    vncExportBeginWrite(&ex->sequence);
+    ex->magic = VNC_WINDOW_MAGIC;
+    ex->version = VNC_WINDOW_VERSION;
+    ex->window = cw->id;
+    ex->viewable = pWin->viewable;
+    ex->x = pWin->drawable.x - bw;
+    ex->y = pWin->drawable.y - bw;
+    ex->width = pWin->drawable.width + 2 * bw;
+    ex->height = pWin->drawable.height + 2 * bw;
+    ex->stackIndex = capture_stack_index(pWin);
+    if (pWin->viewable) {
+	ex->numVisible = capture_export_region(ex->visible, &pWin->borderClip);
+	ex->numDamage = capture_export_region(ex->damage,
+					      cw->fresh ? &pWin->borderClip
+							: &clipped);
+    } else {
+	ex->numVisible = 0;
+	ex->numDamage = 0;
+    }
+    ex->frame = frame;
+    vncExportEndWrite(&ex->sequence);
+
+    VNC_PROBE3(capture_window, cw->id, ex->numVisible, ex->numDamage);
+
+    cw->fresh = FALSE;
+    RegionUninit(&clipped);
+}
+
+Bool
+VNCCaptureInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCCapturePtr cap;
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+	return FALSE;
+    cap->pScrn = pScrn;
+    cap->prop = MakeAtom(CAPTURE_PROP_NAME, strlen(CAPTURE_PROP_NAME), TRUE);
+    cap->changed = TRUE;
+
+    if (!AddCallback(&PropertyStateCallback, capture_property_callback, cap)) {
+	free(cap);
+	return FALSE;
+    }
+
+    dPtr->capture = cap;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Capturing windows listed in %s to %s\n",
+	       CAPTURE_PROP_NAME, dPtr->exportDir);
+    return TRUE;
+}
+
+/* Whether the set of windows needs updating, even without damage */
+Bool
+VNCCapturePending(ScrnInfoPtr pScrn)
+{
+    VNCCapturePtr cap = VNCPTR(pScrn)->capture;
+
+    return cap && cap->changed;
+}
+
+/* Export the captured windows and the damage to them in this frame */
+void
+VNCCaptureUpdate(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCCapturePtr cap = dPtr->capture;
+    int i;
+
+    if (cap->changed)
+	capture_read_property(cap);
+
+    for (i = 0; i < CAPTURE_MAX_WINDOWS; i++) {
+	if (cap->windows[i].pWin)
+	    capture_export_window(&cap->windows[i], region, dPtr->frame);
+    }
+}
+
+/* Called as any window is destroyed */
+void
+VNCCaptureWindowDestroyed(ScrnInfoPtr pScrn, WindowPtr pWin)
+{
+    VNCCapturePtr cap = VNCPTR(pScrn)->capture;
+    vncCaptureWindow *cw;
+
+    if (!cap)
+	return;
+    cw = capture_find(cap, pWin->drawable.id);
+    if (cw && cw->pWin == pWin)
+	capture_remove(cw);
+}
+
+void
+VNCCaptureClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCCapturePtr cap = dPtr->capture;
+    int i;
+
+    if (!cap)
+	return;
+
+    DeleteCallback(&PropertyStateCallback, capture_property_callback, cap);
+    for (i = 0; i < CAPTURE_MAX_WINDOWS; i++) {
+	if (cap->windows[i].id != None)
+	    capture_remove(&cap->windows[i]);
+    }
+    free(cap);
+    dPtr->capture = NULL;
+}
@@ -18,6 +18,7 @@
 #include "cursorstr.h"
 /* Driver specific headers */
 #include "vnc.h"
+#include "vnc_trace.h"
 
 static void
 vncShowCursor(ScrnInfoPtr pScrn)
@@ -26,6 +27,8 @@ vncShowCursor(ScrnInfoPtr pScrn)
 
     /* turn cursor on */
     dPtr->VncHWCursorShown = TRUE;    
+    if (dPtr->record)
+	VNCRecordCursor(pScrn);
 }
 
 static void
@@ -38,6 +41,8 @@ vncHideCursor(ScrnInfoPtr pScrn)
      *
      */
     dPtr->VncHWCursorShown = FALSE;
+    if (dPtr->record)
+	VNCRecordCursor(pScrn);
 }
 
 #define MAX_CURS 64
@@ -47,8 +52,12 @@ vncSetCursorPosition(ScrnInfoPtr pScrn, int x, int y)
 {
     VNCPtr dPtr = VNCPTR(pScrn);
 
+    VNC_PROBE2(cursor_position, x, y);
+
     dPtr->cursorX = x;
     dPtr->cursorY = y;
+    if (dPtr->record)
+	VNCRecordCursor(pScrn);
 }
 
 static void
@@ -58,11 +67,19 @@ vncSetCursorColors(ScrnInfoPtr pScrn, int bg, int fg)
     
     dPtr->cursorFG = fg;
     dPtr->cursorBG = bg;
+    if (dPtr->record)
+	VNCRecordCursorImage(pScrn, NULL);
 }
 
 static void
 vncLoadCursorImage(ScrnInfoPtr pScrn, unsigned char *src)
 {
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    VNC_PROBE1(cursor_image, src);
+
+    if (dPtr->record)
+	VNCRecordCursorImage(pScrn, src);
 }
 
 static Bool
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Damage tracking for the VNC virtual framebuffer driver.
+ *
+ * Rendering to the screen pixmap is accumulated by a Damage object and
+ * published once per trip round the main loop, from the block handler,
+ * as a frame.  Everything the driver exports about the framebuffer is
+ * updated from the region damaged in that frame.
+ *
+ * The VNC server may list what its viewers are looking at in the
+ * VNC_VIEWPORT_HINT root window property (CARDINAL or INTEGER, format 32,
+ * as x, y, width, height for each rectangle).  Damage outside those
+ * rectangles is then held back until a trip round the main loop brings no
+ * new damage, or for at most ViewportDefer milliseconds, so that what the
+ * viewers can see is processed first.
+ *
+ * Text and terminal drawing can damage thousands of tiny rectangles in a
+ * frame, and adding each to the region costs more the more fragmented it
+ * is.  Once the region has more than DamageTileThreshold rectangles, the
+ * rest of the frame is accumulated instead in a bitmap of 16x16 tiles,
+ * which costs the same however fragmented the drawing, and the frame is
+ * published as the union of the two.  With the DirtyTiles option every
+ * published frame is also exported as such a bitmap.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "property.h"
+#include "propertyst.h"
+#include <X11/Xatom.h>
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+/* Whether anything consumes damage */
+static Bool
+vncDamageWanted(VNCPtr dPtr)
+{
+    return dPtr->tileStats || dPtr->windowCapture || dPtr->scrollDetect ||
+	   dPtr->videoRegions || dPtr->latencyStats || dPtr->recordFile ||
+	   dPtr->fbFile || dPtr->dirtyTiles;
+}
+
+#define DIRTY_TILE VNC_DIRTY_TILE_SIZE
+
+typedef struct _vncDirtyState {
+    int width, height;
+    int tilesX, tilesY;
+    int stride;                 /* 64-bit words per row */
+    uint64_t *bits;             /* damage not in the Damage region */
+    Bool active;                /* bits has something set */
+    xRectangle *rects;          /* scratch for turning bits into a region */
+    VNCExportRec export;
+} VNCDirtyRec;
+
+static Bool
+vncDirtyResize(ScrnInfoPtr pScrn, VNCDirtyPtr dirty)
+{
+    int tilesX = (pScrn->virtualX + DIRTY_TILE - 1) / DIRTY_TILE;
+    int tilesY = (pScrn->virtualY + DIRTY_TILE - 1) / DIRTY_TILE;
+    int stride = (tilesX + 63) / 64;
+    uint64_t *bits;
+    xRectangle *rects;
+
+    bits = calloc((size_t)stride * tilesY, sizeof(*bits));
+    rects = malloc((size_t)(tilesX + 1) / 2 * tilesY * sizeof(*rects));
+    if (!bits || !rects ||
+	(dirty->export.path &&
+	 !VNCExportMap(pScrn, &dirty->export, "dirty", VNC_DIRTY_HEADER_SIZE +
+			(size_t)stride * tilesY * sizeof(*bits)))) {
+	free(bits);
+	free(rects);
+	return FALSE;
+    }
+
+    free(dirty->bits);
+    free(dirty->rects);
+    dirty->bits = bits;
+    dirty->rects = rects;
+    dirty->width = pScrn->virtualX;
+    dirty->height = pScrn->virtualY;
+    dirty->tilesX = tilesX;
+    dirty->tilesY = tilesY;
+    dirty->stride = stride;
+
+    /* Whatever was held in the old bitmap, the whole screen covers it */
+    if (dirty->active) {
+	int ty;
+
+	for (ty = 0; ty < tilesY; ty++) {
+	    memset(bits + (size_t)ty * stride, 0xff, stride * sizeof(*bits));
+	    if (tilesX & 63)
+		bits[(size_t)ty * stride + stride - 1] = ~0ULL >> (64 - (tilesX & 63));
+	}
+    }
+    return TRUE;
+}
+
+/* Set the tiles under n boxes, clipped to the bitmap */
+static void
+vncDirtyMark(VNCDirtyPtr dirty, uint64_t *bits, const BoxRec *box, int n)
+{
+    int ty, w;
+
+    for (; n--; box++) {
+	int x1, y1, x2, y2;
+
+	if (box->x2 <= 0 || box->y2 <= 0)
+	    continue;
+	x1 = max(box->x1, 0) / DIRTY_TILE;
+	y1 = max(box->y1, 0) / DIRTY_TILE;
+	x2 = min((box->x2 - 1) / DIRTY_TILE, dirty->tilesX - 1);
+	y2 = min((box->y2 - 1) / DIRTY_TILE, dirty->tilesY - 1);
+	if (x1 > x2 || y1 > y2)
+	    continue;
+
+	for (ty = y1; ty <= y2; ty++) {
+	    uint64_t *row = bits + (size_t)ty * dirty->stride;
+
+	    for (w = x1 / 64; w <= x2 / 64; w++) {
+		uint64_t mask = ~0ULL;
+
+		if (w == x1 / 64)
+		    mask &= ~0ULL << (x1 & 63);
+		if (w == x2 / 64)
+		    mask &= ~0ULL >> (63 - (x2 & 63));
+		row[w] |= mask;
+	    }
+	}
+    }
+}
+
+/* The first tile from tx on whose bit is set, or clear, or end */
+static int
+vncDirtyFind(const uint64_t *row, int tx, int end, Bool set)
+{
+    while (tx < end) {
+	uint64_t word = set ? row[tx / 64] : ~row[tx / 64];
+
+	word >>= tx & 63;
+	if (word)
+	    return min(tx + __builtin_ctzll(word), end);
+	tx = (tx | 63) + 1;
+    }
+    return end;
+}
+
+/* Add the tiles in the bitmap to region and clear it */
+static void
+vncDirtyTake(VNCDirtyPtr dirty, RegionPtr region)
+{
+    RegionPtr tiles;
+    int n = 0;
+    int tx, ty;
+
+    for (ty = 0; ty < dirty->tilesY; ty++) {
+	const uint64_t *row = dirty->bits + (size_t)ty * dirty->stride;
+	int end;
+
+	/* Runs of tiles along each row, already in y-x banded order */
+	for (tx = vncDirtyFind(row, 0, dirty->tilesX, TRUE);
+	     tx < dirty->tilesX;
+	     tx = vncDirtyFind(row, end, dirty->tilesX, TRUE)) {
+	    xRectangle *r = &dirty->rects[n++];
+
+	    end = vncDirtyFind(row, tx, dirty->tilesX, FALSE);
+	    r->x = tx * DIRTY_TILE;
+	    r->y = ty * DIRTY_TILE;
+	    r->width = min(end * DIRTY_TILE, dirty->width) - r->x;
+	    r->height = min((ty + 1) * DIRTY_TILE, dirty->height) - r->y;
+	}
+    }
+
+    VNC_PROBE1(damage_tiles_take, n);
+    tiles = RegionFromRects(n, dirty->rects, CT_YXBANDED);
+    if (tiles) {
+	RegionUnion(region, region, tiles);
+	RegionDestroy(tiles);
+    }
+    memset(dirty->bits, 0,
+	   (size_t)dirty->stride * dirty->tilesY * sizeof(*dirty->bits));
+    dirty->active = FALSE;
+}
+
+/*
+ * Called by Damage for every drawing operation, after adding it to the
+ * accumulated region.  Past the threshold the region is moved into the
+ * bitmap, and from then on each operation too, until the frame is
+ * published.
+ */
+static void
+vncDamageReport(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn((ScreenPtr)closure);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCDirtyPtr dirty = dPtr->dirty;
+    RegionPtr accumulated = DamageRegion(pDamage);
+
+    /* After a failed resize, fall back on the region until it succeeds */
+    if (dirty->width != pScrn->virtualX || dirty->height != pScrn->virtualY)
+	return;
+
+    if (!dirty->active) {
+	if (RegionNumRects(accumulated) <= dPtr->damageTileThreshold)
+	    return;
+	VNC_PROBE1(damage_tiles_start, RegionNumRects(accumulated));
+	dirty->active = TRUE;
+    }
+    vncDirtyMark(dirty, dirty->bits, RegionRects(accumulated),
+		 RegionNumRects(accumulated));
+    DamageEmpty(pDamage);
+}
+
+/* Export the damage published in this frame as a tile bitmap */
+static void
+vncDirtyExport(ScrnInfoPtr pScrn, RegionPtr region, Bool tiled)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCDirtyPtr dirty = dPtr->dirty;
+    vncDirtyHeader *header = dirty->export.map;
+    uint64_t *bits = (uint64_t *)((char *)header + VNC_DIRTY_HEADER_SIZE);
+
+    vncExportBeginWrite(&header->sequence);
+    header->magic = VNC_DIRTY_MAGIC;
+    header->version = VNC_DIRTY_VERSION;
+    header->headerSize = VNC_DIRTY_HEADER_SIZE;
+    header->tileSize = DIRTY_TILE;
+    header->tilesX = dirty->tilesX;
+    header->tilesY = dirty->tilesY;
+    header->stride = dirty->stride;
+    header->width = dirty->width;
+    header->height = dirty->height;
+    header->numRects = tiled ? 0 : RegionNumRects(region);
+    header->frame = dPtr->frame;
+    memset(bits, 0,
+	   (size_t)dirty->stride * dirty->tilesY * sizeof(*bits));
+    vncDirtyMark(dirty, bits, RegionRects(region), RegionNumRects(region));
+    vncExportEndWrite(&header->sequence);
+}
+
+/* Follow the screen size; called once the screen pixmap has been resized */
+void
+VNCDamageResize(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    if (dPtr->dirty && !vncDirtyResize(pScrn, dPtr->dirty))
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to resize the damage tile bitmap\n");
+}
+
+#define VIEWPORT_PROP_NAME "VNC_VIEWPORT_HINT"
+
+static void
+vncViewportCallback(CallbackListPtr *list, pointer closure, pointer data)
+{
+    ScreenPtr pScreen = closure;
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+    PropertyStateRec *rec = data;
+
+    if (rec->win == pScreen->root &&
+	rec->prop->propertyName == dPtr->viewportProp)
+	dPtr->viewportChanged = TRUE;
+}
+
+/* Rebuild the viewport region from the root window property */
+static void
+vncViewportRead(ScreenPtr pScreen)
+{
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+    PropertyPtr pProp;
+    xRectangle *rects;
+    const INT32 *values;
+    int i, n;
+
+    dPtr->viewportChanged = FALSE;
+    if (dPtr->viewport) {
+	RegionDestroy(dPtr->viewport);
+	dPtr->viewport = NULL;
+    }
+
+    if (dixLookupProperty(&pProp, pScreen->root, dPtr->viewportProp,
+			  serverClient, DixReadAccess) != Success ||
+	(pProp->type != XA_CARDINAL && pProp->type != XA_INTEGER) ||
+	pProp->format != 32 || pProp->size < 4)
+	return;
+
+    n = pProp->size / 4;
+    rects = malloc(n * sizeof(xRectangle));
+    if (!rects)
+	return;
+    values = pProp->data;
+    for (i = 0; i < n; i++, values += 4) {
+	rects[i].x = max(min(values[0], MAXSHORT), MINSHORT);
+	rects[i].y = max(min(values[1], MAXSHORT), MINSHORT);
+	rects[i].width = max(min(values[2], MAXSHORT), 0);
+	rects[i].height = max(min(values[3], MAXSHORT), 0);
+    }
+    dPtr->viewport = RegionFromRects(n, rects, CT_UNSORTED);
+    free(rects);
+}
+
+/*
+ * Hold back the part of region outside the viewport, or release what was
+ * held back if the main loop has gone idle or the oldest of it is due.
+ */
+static void
+vncViewportSchedule(ScreenPtr pScreen, RegionPtr region, pointer pTimeout)
+{
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+    Bool pending = RegionNotEmpty(&dPtr->deferred);
+    CARD32 now = GetTimeInMillis();
+    RegionRec outside;
+
+    if (!dPtr->viewport || !RegionNotEmpty(region) ||
+	(pending && now - dPtr->deferredSince >= dPtr->viewportDefer)) {
+	VNC_PROBE1(viewport_release, RegionNumRects(&dPtr->deferred));
+	RegionUnion(region, region, &dPtr->deferred);
+	RegionEmpty(&dPtr->deferred);
+	return;
+    }
+
+    RegionNull(&outside);
+    RegionSubtract(&outside, region, dPtr->viewport);
+    if (RegionNotEmpty(&outside)) {
+	if (!pending)
+	    dPtr->deferredSince = now;
+	RegionUnion(&dPtr->deferred, &dPtr->deferred, &outside);
+	RegionSubtract(region, region, &outside);
+	pending = TRUE;
+    }
+    RegionUninit(&outside);
+
+    /* Come back round when the deferred damage is due */
+    if (pending)
+	AdjustWaitForDelay(pTimeout, dPtr->deferredSince + dPtr->viewportDefer -
+				     now);
+}
+
+/* Called once the screen pixmap exists */
+Bool
+VNCDamageStart(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    PixmapPtr pPixmap = pScreen->GetScreenPixmap(pScreen);
+
+    if (!vncDamageWanted(dPtr))
+	return TRUE;
+
+    if (dPtr->damageTileThreshold > 0 || dPtr->dirtyTiles) {
+	dPtr->dirty = calloc(1, sizeof(VNCDirtyRec));
+	if (dPtr->dirty && dPtr->dirtyTiles &&
+	    !VNCExportMap(pScrn, &dPtr->dirty->export, "dirty",
+			  VNC_DIRTY_HEADER_SIZE)) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		       "Dirty tile export disabled\n");
+	    dPtr->dirtyTiles = FALSE;
+	}
+	if (!dPtr->dirty || !vncDirtyResize(pScrn, dPtr->dirty)) {
+	    if (dPtr->dirty)
+		VNCExportUnmap(&dPtr->dirty->export);
+	    free(dPtr->dirty);
+	    dPtr->dirty = NULL;
+	    dPtr->damageTileThreshold = 0;
+	    dPtr->dirtyTiles = FALSE;
+	}
+    }
+
+    /* Every operation is reported only when it may go to the bitmap */
+    if (dPtr->damageTileThreshold > 0)
+	dPtr->damage = DamageCreate(vncDamageReport, NULL,
+				    DamageReportRawRegion, TRUE,
+				    pScreen, pScreen);
+    else
+	dPtr->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
+				    pScreen, pScreen);
+    if (!dPtr->damage)
+	return FALSE;
+    DamageRegister(&pPixmap->drawable, dPtr->damage);
+
+    RegionNull(&dPtr->deferred);
+    if (dPtr->viewportDefer > 0) {
+	dPtr->viewportProp = MakeAtom(VIEWPORT_PROP_NAME,
+				      strlen(VIEWPORT_PROP_NAME), TRUE);
+	dPtr->viewportChanged = TRUE;
+	if (!AddCallback(&PropertyStateCallback, vncViewportCallback, pScreen))
+	    dPtr->viewportDefer = 0;
+    }
+
+    if (dPtr->tileStats && !VNCTileStatsInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Tile statistics disabled\n");
+	dPtr->tileStats = FALSE;
+    }
+
+    if (dPtr->windowCapture && !VNCCaptureInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Window capture disabled\n");
+	dPtr->windowCapture = FALSE;
+    }
+
+    if (dPtr->scrollDetect && !VNCScrollInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Scroll detection disabled\n");
+	dPtr->scrollDetect = FALSE;
+    }
+
+    if (dPtr->videoRegions && !VNCVideoDetectInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Video region detection disabled\n");
+	dPtr->videoRegions = FALSE;
+    }
+
+    if (dPtr->latencyStats && !VNCLatencyInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Damage latency statistics disabled\n");
+	dPtr->latencyStats = FALSE;
+    }
+
+    if (dPtr->recordFile && !VNCRecordInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "Recording disabled\n");
+	dPtr->recordFile = NULL;
+    }
+
+    return TRUE;
+}
+
+/* Publish the damage accumulated since the last frame */
+void
+VNCDamagePublish(ScreenPtr pScreen, pointer pTimeout)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    BoxRec box;
+    RegionRec region, screen;
+    Bool tiled;
+
+    if (!dPtr->damage)
+	return;
+
+    tiled = dPtr->dirty && dPtr->dirty->active;
+    if (!tiled && !RegionNotEmpty(DamageRegion(dPtr->damage)) &&
+	!RegionNotEmpty(&dPtr->deferred) && !VNCCapturePending(pScrn) &&
+	!VNCRecordPending(pScrn)) {
+	if (dPtr->videoDetect)
+	    VNCVideoDetectUpdate(pScrn, DamageRegion(dPtr->damage), pTimeout);
+	return;
+    }
+
+    RegionNull(&region);
+    RegionCopy(&region, DamageRegion(dPtr->damage));
+    DamageEmpty(dPtr->damage);
+    if (tiled)
+	vncDirtyTake(dPtr->dirty, &region);
+
+    /* Video detection wants damage as it happens, before any is deferred */
+    if (dPtr->videoDetect)
+	VNCVideoDetectUpdate(pScrn, &region, pTimeout);
+
+    if (dPtr->viewportChanged)
+	vncViewportRead(pScreen);
+    if (dPtr->viewport || RegionNotEmpty(&dPtr->deferred))
+	vncViewportSchedule(pScreen, &region, pTimeout);
+
+    box.x1 = 0;
+    box.y1 = 0;
+    box.x2 = pScrn->virtualX;
+    box.y2 = pScrn->virtualY;
+    RegionInit(&screen, &box, 1);
+    RegionIntersect(&region, &region, &screen);
+    RegionUninit(&screen);
+
+    if (!RegionNotEmpty(&region) && !VNCCapturePending(pScrn) &&
+	!VNCRecordPending(pScrn)) {
+	RegionUninit(&region);
+	return;
+    }
+
+    dPtr->frame++;
+    if (dPtr->frame == 1)
+	VNCStartupMark(pScrn, "first frame published");
+    VNC_PROBE2(damage_publish_entry, dPtr->frame, RegionNumRects(&region));
+
+    if (dPtr->dirtyTiles)
+	vncDirtyExport(pScrn, &region, tiled);
+    if (dPtr->capture)
+	VNCCaptureUpdate(pScrn, &region);
+    if (dPtr->record)
+	VNCRecordUpdate(pScrn, &region);
+    if (RegionNotEmpty(&region)) {
+	if (dPtr->scroll)
+	    VNCScrollUpdate(pScrn, &region);
+	if (dPtr->tileStatsState)
+	    VNCTileStatsUpdate(pScrn, &region);
+	if (dPtr->fbFile)
+	    VNCFbFileFrame(pScrn);
+	if (dPtr->latency)
+	    VNCLatencyUpdate(pScrn, &region);
+    }
+
+    VNC_PROBE1(damage_publish_return, dPtr->frame);
+    RegionUninit(&region);
+}
+
+void
+VNCDamageClose(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    VNCTileStatsClose(pScrn);
+    VNCCaptureClose(pScrn);
+    VNCScrollClose(pScrn);
+    VNCVideoDetectClose(pScrn);
+    VNCLatencyClose(pScrn);
+    VNCRecordClose(pScrn);
+
+    if (dPtr->damage) {
+	if (dPtr->viewportDefer > 0)
+	    DeleteCallback(&PropertyStateCallback, vncViewportCallback,
+			   pScreen);
+	if (dPtr->viewport) {
+	    RegionDestroy(dPtr->viewport);
+	    dPtr->viewport = NULL;
+	}
+	RegionUninit(&dPtr->deferred);
+
+	DamageUnregister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+			 dPtr->damage);
+	DamageDestroy(dPtr->damage);
+	dPtr->damage = NULL;
+    }
+
+    if (dPtr->dirty) {
+	VNCExportUnmap(&dPtr->dirty->export);
+	free(dPtr->dirty->bits);
+	free(dPtr->dirty->rects);
+	free(dPtr->dirty);
+	dPtr->dirty = NULL;
+    }
+}
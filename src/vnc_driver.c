@@ -25,8 +25,11 @@
 /* All drivers using the mi colormap manipulation need this */
 #include "micmap.h"
 
+#include <time.h>
+
 #include <X11/Xatom.h>
 #include "property.h"
+#include "opaque.h"
 #include "xf86cmap.h"
 #include "xf86fbman.h"
 #include "fb.h"
@@ -37,6 +40,7 @@
  * Driver data structures.
  */
 #include "vnc.h"
+#include "vnc_trace.h"
 
 /* These need to be checked */
 #include <X11/X.h>
@@ -53,6 +57,9 @@ static Bool     VNCScreenInit(SCREEN_INIT_ARGS_DECL);
 static Bool     VNCEnterVT(VT_FUNC_ARGS_DECL);
 static void     VNCLeaveVT(VT_FUNC_ARGS_DECL);
 static Bool     VNCCloseScreen(CLOSE_SCREEN_ARGS_DECL);
+static Bool     VNCCreateScreenResources(ScreenPtr pScreen);
+static Bool     VNCDestroyWindow(WindowPtr pWin);
+static void     VNCBlockHandler(BLOCKHANDLER_ARGS_DECL);
 static Bool     VNCCreateWindow(WindowPtr pWin);
 static void     VNCFreeScreen(FREE_SCREEN_ARGS_DECL);
 static ModeStatus VNCValidMode(SCRN_ARG_TYPE arg, DisplayModePtr mode,
@@ -73,7 +80,6 @@ static Bool	vncDriverFunc(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
 
 #define VNC_MAX_WIDTH 32767
 #define VNC_MAX_HEIGHT 32767
-#define VNC_MAX_OUTPUTS 10
 
 /*
  * This contains the functions needed by the server after loading the driver
@@ -101,15 +107,83 @@ static SymTabRec VNCChipsets[] = {
 
 typedef enum {
     OPTION_SW_CURSOR,
-    OPTION_NUM_OUTPUTS
+    OPTION_NUM_OUTPUTS,
+    OPTION_MAX_OUTPUTS,
+    OPTION_GLYPH_CACHE,
+    OPTION_PIXEL_FORMAT,
+    OPTION_FRAMEBUFFER_FILE,
+    OPTION_SPARSE_FRAMEBUFFER,
+    OPTION_SPARSE_MARGIN,
+    OPTION_EXPORT_DIR,
+    OPTION_TILE_STATS,
+    OPTION_WINDOW_CAPTURE,
+    OPTION_VIEWPORT_DEFER,
+    OPTION_SCROLL_DETECT,
+    OPTION_VIDEO_DETECT,
+    OPTION_LATENCY_STATS,
+    OPTION_PROFILE,
+    OPTION_RECORD_FILE,
+    OPTION_RECORD_KEYFRAME,
+    OPTION_SCANOUT_LAYOUT,
+    OPTION_DESKTOP_SIZE,
+    OPTION_DAMAGE_TILE_THRESHOLD,
+    OPTION_DIRTY_TILES,
+    OPTION_XV_ADAPTOR
 } VNCOpts;
 
 static const OptionInfoRec VNCOptions[] = {
     { OPTION_SW_CURSOR,	  "SWcursor",	OPTV_BOOLEAN,	{0}, FALSE },
     { OPTION_NUM_OUTPUTS, "NumOutputs",	OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_MAX_OUTPUTS, "MaxOutputs",	OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_GLYPH_CACHE, "GlyphCache",	OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_PIXEL_FORMAT, "PixelFormat", OPTV_STRING,	{0}, FALSE },
+    { OPTION_FRAMEBUFFER_FILE, "FramebufferFile", OPTV_STRING, {0}, FALSE },
+    { OPTION_SPARSE_FRAMEBUFFER, "SparseFramebuffer", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_SPARSE_MARGIN, "SparseMargin", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_EXPORT_DIR,  "ExportDir",	OPTV_STRING,	{0}, FALSE },
+    { OPTION_TILE_STATS,  "TileStats",	OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_WINDOW_CAPTURE, "WindowCapture", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_VIEWPORT_DEFER, "ViewportDefer", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_SCROLL_DETECT, "ScrollDetect", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_VIDEO_DETECT, "VideoDetect", OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_LATENCY_STATS, "LatencyStats", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_PROFILE,	  "Profile",	OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_RECORD_FILE, "RecordFile",	OPTV_STRING,	{0}, FALSE },
+    { OPTION_RECORD_KEYFRAME, "RecordKeyframe", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_SCANOUT_LAYOUT, "ScanoutLayout", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_DESKTOP_SIZE, "DesktopSize", OPTV_STRING,	{0}, FALSE },
+    { OPTION_DAMAGE_TILE_THRESHOLD, "DamageTileThreshold", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_DIRTY_TILES, "DirtyTiles", OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_XV_ADAPTOR, "XvAdaptor",	OPTV_BOOLEAN,	{0}, FALSE },
     { -1,                  NULL,           OPTV_NONE,	{0}, FALSE }
 };
 
+/*
+ * Framebuffer layouts selectable with the PixelFormat option.  The 32bpp
+ * formats are named by the order of the channels in memory, so that the
+ * framebuffer can be laid out exactly as the encoder wants it.
+ */
+typedef struct {
+    const char *name;
+    int depth;
+    int bpp;
+    CARD32 red, green, blue;
+} VNCPixelFormatRec;
+
+#if X_BYTE_ORDER == X_LITTLE_ENDIAN
+#define BYTE_MASK(i) (0xffU << (8 * (i)))
+#else
+#define BYTE_MASK(i) (0xffU << (8 * (3 - (i))))
+#endif
+
+static const VNCPixelFormatRec VNCPixelFormats[] = {
+    { "BGRX",   24, 32, BYTE_MASK(2), BYTE_MASK(1), BYTE_MASK(0) },
+    { "RGBX",   24, 32, BYTE_MASK(0), BYTE_MASK(1), BYTE_MASK(2) },
+    { "RGB565", 16, 16, 0xf800, 0x07e0, 0x001f },
+    { "BGR565", 16, 16, 0x001f, 0x07e0, 0xf800 },
+    { NULL,      0,  0, 0, 0, 0 }
+};
+
 #ifdef XFree86LOADER
 
 static MODULESETUPPROTO(vncSetup);
@@ -161,6 +235,17 @@ vncSetup(pointer module, pointer opts, int *errmaj, int *errmin)
 
 #endif /* XFree86LOADER */
 
+/*
+ * Bytes per framebuffer row.  The screen pixmap is given devKind -1, so
+ * the server pads rows to 32 bits (PixmapBytePad), which at 16bpp adds two
+ * bytes to every row of an odd width.
+ */
+static long int
+fb_stride(ScrnInfoPtr pScrn, int width)
+{
+    return (((long int)width * pScrn->bitsPerPixel + 31) / 32) * 4;
+}
+
 static Bool
 size_valid(ScrnInfoPtr pScrn, int width, int height)
 {
@@ -169,33 +254,115 @@ size_valid(ScrnInfoPtr pScrn, int width, int height)
         width > VNC_MAX_WIDTH || height > VNC_MAX_HEIGHT)
         return FALSE;
 
-    /* videoRam is in kb, divide first to avoid 32-bit int overflow */
-    if ((width*height+1023)/1024*pScrn->bitsPerPixel/8 > pScrn->videoRam)
+    /* Only the pages under the CRTCs count towards a sparse framebuffer */
+    if (VNCPTR(pScrn)->sparseFb)
+        return VNCSparseCommitted(pScrn, width, height, -1, NULL) / 1024 <=
+               pScrn->videoRam;
+
+    /* videoRam is in kb; rows are padded as realloc_fb allocates them */
+    if ((fb_stride(pScrn, width) * height + 1023) / 1024 >
+        pScrn->videoRam)
         return FALSE;
 
     return TRUE;
 }
 
+/*
+ * Start-up timing.  Each phase of PreInit and ScreenInit is logged with
+ * how long it took, and the first frame with the time since PreInit
+ * began, so that slow session starts can be tracked down from the log.
+ */
+static uint64_t
+startup_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+startup_phase(ScrnInfoPtr pScrn, const char *phase, uint64_t *since)
+{
+    uint64_t now = startup_usec();
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Startup: %s took %.3f ms\n",
+	       phase, (now - *since) / 1000.0);
+    *since = now;
+}
+
+/* Log when something first happened, for the first server generation */
+void
+VNCStartupMark(ScrnInfoPtr pScrn, const char *event)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    if (serverGeneration != 1)
+	return;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Startup: %s %.3f ms after PreInit\n",
+	       event, (startup_usec() - dPtr->startTime) / 1000.0);
+}
+
+/*
+ * Whether a sparse framebuffer of width x height has the memory for the
+ * current layout with crtc moved to box.
+ */
+static Bool
+sparse_layout_valid(ScrnInfoPtr pScrn, int width, int height,
+                    xf86CrtcPtr crtc, const BoxRec *box)
+{
+    return !VNCPTR(pScrn)->sparseFb ||
+           VNCSparseCommitted(pScrn, width, height,
+                              (uintptr_t)crtc->driver_private, box) / 1024 <=
+           pScrn->videoRam;
+}
+
 static void*
 realloc_fb(ScrnInfoPtr pScrn, void* current)
 {
-    long int fbBytes = (long int)pScrn->virtualX * (long int)pScrn->virtualY * 
-        (long int)pScrn->bitsPerPixel / 8;
+    long int fbBytes = (long int)fb_stride(pScrn, pScrn->virtualX) *
+        (long int)pScrn->virtualY;
     xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Setting fb to %d x %d (%ld B)\n",
 	       pScrn->virtualX, pScrn->virtualY, fbBytes);
-    void* pixels = current ? realloc(current, fbBytes) : malloc(fbBytes);
+    VNC_PROBE3(realloc_fb_entry, pScrn->virtualX, pScrn->virtualY, fbBytes);
+    void* pixels;
+    if (VNCPTR(pScrn)->fbFile)
+	pixels = VNCFbFileMap(pScrn, fbBytes);
+    else if (VNCPTR(pScrn)->sparseFb)
+	pixels = VNCSparseMap(pScrn, fbBytes);
+    else if (current)
+	pixels = realloc(current, fbBytes);
+    else
+	/* Fresh zero pages, filled by the kernel only as they are touched,
+	 * so the screen starts black without start-up paying for it */
+	pixels = calloc(1, fbBytes);
     if (!pixels)
 	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Failed to (re)alloc fb\n");
+    VNC_PROBE2(realloc_fb_return, fbBytes, pixels);
     return pixels;
 }
 
+static void
+free_fb(ScrnInfoPtr pScrn, void* pixels)
+{
+    if (VNCPTR(pScrn)->fbFile)
+	VNCFbFileUnmap(pScrn);
+    else if (VNCPTR(pScrn)->sparseFb)
+	VNCSparseUnmap(pScrn);
+    else
+	free(pixels);
+}
+
 static Bool
 vnc_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
 {
     int old_width, old_height;
+    Bool ret = FALSE;
     old_width = pScrn->virtualX;
     old_height = pScrn->virtualY;
 
+    VNC_PROBE4(resize_entry, old_width, old_height, width, height);
+
     if (size_valid(pScrn, width, height)) {
         PixmapPtr rootPixmap;
         ScreenPtr pScreen = pScrn->pScreen;
@@ -205,20 +372,20 @@ vnc_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
 
         rootPixmap = pScreen->GetScreenPixmap(pScreen);
 	void* pixels = realloc_fb(pScrn, rootPixmap->devPrivate.ptr);
-	if (!pixels)
-	  return FALSE;
-	if (!pScreen->ModifyPixmapHeader(rootPixmap, width, height,
-                                         -1, -1, -1, pixels)) {
+	if (pixels && pScreen->ModifyPixmapHeader(rootPixmap, width, height,
+	                                          -1, -1, -1, pixels)) {
+            pScrn->displayWidth = pScrn->virtualX * (pScrn->bitsPerPixel / 8);
+            VNCPTR(pScrn)->layoutChanged = TRUE;
+            VNCDamageResize(pScrn);
+            ret = TRUE;
+        } else {
             pScrn->virtualX = old_width;
             pScrn->virtualY = old_height;
-            return FALSE;
         }
-        pScrn->displayWidth = pScrn->virtualX * (pScrn->bitsPerPixel / 8);
-
-        return TRUE;
-    } else {
-        return FALSE;
     }
+
+    VNC_PROBE3(resize_return, width, height, ret);
+    return ret;
 }
 
 static const xf86CrtcConfigFuncsRec vnc_xf86crtc_config_funcs = {
@@ -228,7 +395,12 @@ static const xf86CrtcConfigFuncsRec vnc_xf86crtc_config_funcs = {
 static xf86OutputStatus
 vnc_output_detect(xf86OutputPtr output)
 {
-    return XF86OutputStatusConnected;
+    VNCPtr dPtr = VNCPTR(output->scrn);
+    int index = (uintptr_t)output->driver_private;
+
+    if (dPtr->outputConnected[index])
+	return XF86OutputStatusConnected;
+    return XF86OutputStatusDisconnected;
 }
 
 static int
@@ -237,15 +409,9 @@ vnc_output_mode_valid(xf86OutputPtr output, DisplayModePtr pMode)
     return MODE_OK;
 }
 
-static DisplayModePtr add_mode(DisplayModePtr modes, int cx, int cy)
+static void
+init_mode(DisplayModePtr m, int cx, int cy)
 {
-    DisplayModePtr m = xnfcalloc(sizeof(DisplayModeRec), 1);
-    DisplayModePtr last;
-    
-    char modeName[256];
-    sprintf(modeName, "%ux%u", cx, cy);
-    m->name = xnfstrdup(modeName);      
-  
     m->status = MODE_OK;
     m->type = M_T_BUILTIN;
     m->HDisplay  = cx;
@@ -257,6 +423,18 @@ static DisplayModePtr add_mode(DisplayModePtr modes, int cx, int cy)
     m->VSyncEnd = m->VDisplay + 4;
     m->VTotal = m->VDisplay + 6;
     m->Clock = m->HTotal * m->VTotal * 60 / 1000; /* kHz */ 
+}
+
+static DisplayModePtr add_mode(DisplayModePtr modes, int cx, int cy)
+{
+    DisplayModePtr m = xnfcalloc(sizeof(DisplayModeRec), 1);
+    DisplayModePtr last;
+    
+    char modeName[256];
+    sprintf(modeName, "%ux%u", cx, cy);
+    m->name = xnfstrdup(modeName);      
+  
+    init_mode(m, cx, cy);
     
     m->next = 0;
     m->prev = 0;
@@ -272,40 +450,440 @@ static DisplayModePtr add_mode(DisplayModePtr modes, int cx, int cy)
 static DisplayModePtr
 vnc_output_get_modes(xf86OutputPtr output)
 {
+    VNCPtr dPtr = VNCPTR(output->scrn);
+    int index = (uintptr_t)output->driver_private;
+    int width = dPtr->outputWidth[index];
+    int height = dPtr->outputHeight[index];
     DisplayModePtr m = 0;
+
     m = add_mode(m, 1024, 768);
+
+    /* Only the most recently requested size is offered, so the list
+     * stays bounded however often the viewer is resized */
+    if (width && height && !(width == 1024 && height == 768)) {
+	m = add_mode(m, width, height);
+	m->next->type |= M_T_PREFERRED;
+    }
     return m;
 }
 
 static void
 vnc_output_dpms(xf86OutputPtr output, int dpms)
 {
-    return;
+    /* Called as outputs are moved between CRTCs or switched off */
+    VNCPTR(output->scrn)->layoutChanged = TRUE;
+}
+
+/*
+ * VNC_DESKTOP_SIZE output property.  Writing a size to it switches the
+ * output to that size straight away, growing or shrinking the screen as
+ * needed, e.g.
+ *
+ *   xrandr --output vnc-0 --set VNC_DESKTOP_SIZE 1920x1080
+ *
+ * The value may be an INTEGER[2] (width, height), or an ATOM or STRING
+ * naming the size as "WxH".  0x0 means no size has been requested.
+ */
+#define VNC_DESKTOP_SIZE_PROP_NAME "VNC_DESKTOP_SIZE"
+
+static Atom vnc_desktop_size_atom;
+
+/*
+ * VNC_CONNECTED output property.  Outputs up to MaxOutputs exist from
+ * startup but only the first NumOutputs are connected; writing 1 or 0
+ * here plugs or unplugs an output at runtime, e.g.
+ *
+ *   xrandr --output vnc-1 --set VNC_CONNECTED 1
+ */
+#define VNC_CONNECTED_PROP_NAME "VNC_CONNECTED"
+
+static Atom vnc_connected_atom;
+
+static void
+vnc_output_create_resources(xf86OutputPtr output)
+{
+    VNCPtr dPtr = VNCPTR(output->scrn);
+    int index = (uintptr_t)output->driver_private;
+    INT32 size[2] = { 0, 0 };
+    INT32 connectedRange[2] = { 0, 1 };
+    INT32 connected = dPtr->outputConnected[index];
+    int err;
+
+    vnc_desktop_size_atom = MakeAtom(VNC_DESKTOP_SIZE_PROP_NAME,
+                                     strlen(VNC_DESKTOP_SIZE_PROP_NAME), TRUE);
+    vnc_connected_atom = MakeAtom(VNC_CONNECTED_PROP_NAME,
+                                  strlen(VNC_CONNECTED_PROP_NAME), TRUE);
+
+    err = RRConfigureOutputProperty(output->randr_output, vnc_connected_atom,
+                                    FALSE, TRUE, FALSE, 2, connectedRange);
+    if (err == Success)
+	err = RRChangeOutputProperty(output->randr_output, vnc_connected_atom,
+	                             XA_INTEGER, 32, PropModeReplace, 1,
+	                             &connected, FALSE, FALSE);
+    if (err != Success)
+	xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+		   "Failed to set up %s property: %d\n",
+		   VNC_CONNECTED_PROP_NAME, err);
+
+    err = RRConfigureOutputProperty(output->randr_output,
+                                    vnc_desktop_size_atom,
+                                    FALSE, FALSE, FALSE, 0, NULL);
+    if (err != Success) {
+	xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+		   "Failed to configure %s property: %d\n",
+		   VNC_DESKTOP_SIZE_PROP_NAME, err);
+	return;
+    }
+
+    err = RRChangeOutputProperty(output->randr_output, vnc_desktop_size_atom,
+                                 XA_INTEGER, 32, PropModeReplace, 2, size,
+                                 FALSE, FALSE);
+    if (err != Success)
+	xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+		   "Failed to set %s property: %d\n",
+		   VNC_DESKTOP_SIZE_PROP_NAME, err);
+}
+
+static Bool
+vnc_screen_set_size(ScreenPtr pScreen, int width, int height)
+{
+    CARD32 mmWidth, mmHeight;
+
+    if (width == pScreen->width && height == pScreen->height)
+	return TRUE;
+
+    /* Keep the current DPI */
+    mmWidth = (CARD32)((double)width * pScreen->mmWidth / pScreen->width + 0.5);
+    mmHeight = (CARD32)((double)height * pScreen->mmHeight / pScreen->height + 0.5);
+
+    return RRScreenSizeSet(pScreen, width, height, mmWidth, mmHeight);
+}
+
+/*
+ * The CRTC an output switched on by the driver should use: its own, unless
+ * another output has since been moved or cloned onto that, in which case
+ * the first free one.
+ */
+static xf86CrtcPtr
+vnc_output_pick_crtc(xf86OutputPtr output)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(output->scrn);
+    int index = (uintptr_t)output->driver_private;
+    int i;
+
+    if (!xf86CrtcInUse(config->crtc[index]))
+	return config->crtc[index];
+    for (i = 0; i < config->num_crtc; i++) {
+	if ((output->possible_crtcs & (1U << i)) &&
+	    !xf86CrtcInUse(config->crtc[i]))
+	    return config->crtc[i];
+    }
+    return NULL;
+}
+
+/*
+ * Switch an output to a width x height mode in one step: the mode is
+ * looked up in (or added to) the RandR mode cache, the screen is resized
+ * to fit every enabled CRTC and the CRTC driving the output is set.
+ */
+static Bool
+vnc_output_set_desktop_size(xf86OutputPtr output, int width, int height)
+{
+    ScrnInfoPtr pScrn = output->scrn;
+    ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+    int index = (uintptr_t)output->driver_private;
+    xf86CrtcPtr crtc = output->crtc ? output->crtc
+                                    : vnc_output_pick_crtc(output);
+    RROutputPtr outputs[VNC_MAX_OUTPUTS];
+    int numOutputs = 0;
+    DisplayModeRec mode;
+    xRRModeInfo modeInfo;
+    RRModePtr randrMode;
+    BoxRec crtcBox;
+    char modeName[256];
+    int screenWidth, screenHeight, otherWidth, otherHeight;
+    int areaWidth, areaHeight;
+    int x, y;
+    Bool ret;
+    int i;
+
+    if (width == 0 && height == 0)
+	return TRUE;
+
+    /* RRScreenSizeSet does not check the range the driver advertised */
+    if (width < config->minWidth || height < config->minHeight ||
+	!size_valid(pScrn, width, height))
+	return FALSE;
+
+    dPtr->outputWidth[index] = width;
+    dPtr->outputHeight[index] = height;
+
+    /* Disconnected outputs pick the size up when they are plugged in */
+    if (!dPtr->outputConnected[index])
+	return TRUE;
+    if (!crtc) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "No free CRTC for %s\n", output->name);
+	return FALSE;
+    }
+    if (!crtc->randr_crtc)
+	return TRUE;
+
+    /* A CRTC being switched on goes to the right of the others */
+    x = crtc->enabled ? crtc->x : 0;
+    y = crtc->enabled ? crtc->y : 0;
+    otherWidth = otherHeight = 0;
+    for (i = 0; i < config->num_crtc; i++) {
+	xf86CrtcPtr other = config->crtc[i];
+
+	if (other == crtc || !other->enabled)
+	    continue;
+	if (other->rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+	    otherWidth = max(otherWidth, other->x + other->mode.VDisplay);
+	    otherHeight = max(otherHeight, other->y + other->mode.HDisplay);
+	} else {
+	    otherWidth = max(otherWidth, other->x + other->mode.HDisplay);
+	    otherHeight = max(otherHeight, other->y + other->mode.VDisplay);
+	}
+    }
+    if (!crtc->enabled)
+	x = otherWidth;
+
+    /* The area the CRTC covers on the screen, after its rotation */
+    if (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+	areaWidth = height;
+	areaHeight = width;
+    } else {
+	areaWidth = width;
+	areaHeight = height;
+    }
+
+    /* The new screen is the bounding box of every enabled CRTC */
+    screenWidth = max(otherWidth, x + areaWidth);
+    screenHeight = max(otherHeight, y + areaHeight);
+
+    if (!size_valid(pScrn, screenWidth, screenHeight))
+	return FALSE;
+
+    crtcBox.x1 = x;
+    crtcBox.y1 = y;
+    crtcBox.x2 = x + areaWidth;
+    crtcBox.y2 = y + areaHeight;
+    if (!sparse_layout_valid(pScrn, screenWidth, screenHeight, crtc, &crtcBox))
+	return FALSE;
+
+    /* Keep any other outputs already on this CRTC: a clone group is
+     * resized as a whole */
+    for (i = 0; i < config->num_output; i++) {
+	if (config->output[i] == output || config->output[i]->crtc == crtc)
+	    outputs[numOutputs++] = config->output[i]->randr_output;
+    }
+
+    memset(&mode, 0, sizeof(mode));
+    init_mode(&mode, width, height);
+    snprintf(modeName, sizeof(modeName), "%ux%u", width, height);
+
+    memset(&modeInfo, 0, sizeof(modeInfo));
+    modeInfo.width = mode.HDisplay;
+    modeInfo.height = mode.VDisplay;
+    modeInfo.dotClock = mode.Clock * 1000;
+    modeInfo.hSyncStart = mode.HSyncStart;
+    modeInfo.hSyncEnd = mode.HSyncEnd;
+    modeInfo.hTotal = mode.HTotal;
+    modeInfo.vSyncStart = mode.VSyncStart;
+    modeInfo.vSyncEnd = mode.VSyncEnd;
+    modeInfo.vTotal = mode.VTotal;
+    modeInfo.nameLength = strlen(modeName);
+
+    randrMode = RRModeGet(&modeInfo, modeName);
+    if (!randrMode)
+	return FALSE;
+
+    /* Grow first so the CRTC always fits, then trim to the final size */
+    ret = vnc_screen_set_size(pScreen,
+                              max(screenWidth, pScreen->width),
+                              max(screenHeight, pScreen->height));
+    if (ret)
+	ret = RRCrtcSet(crtc->randr_crtc, randrMode, x, y,
+	                crtc->rotation, numOutputs, outputs);
+    if (ret)
+	ret = vnc_screen_set_size(pScreen, screenWidth, screenHeight);
+
+    RRModeDestroy(randrMode);
+    RRTellChanged(pScreen);
+
+    if (!ret)
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to set %s to %d x %d\n", output->name, width, height);
+    return ret;
+}
+
+/*
+ * Deferred from the property change so that RandR is re-probed and the
+ * hotplug events sent once the request that caused them has finished.
+ */
+static Bool
+vnc_hotplug_work(ClientPtr client, void *closure)
+{
+    ScreenPtr pScreen = closure;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+    int i, j;
+
+    dPtr->hotplugPending = FALSE;
+
+    /* Switch off CRTCs left driving only unplugged outputs */
+    for (i = 0; i < config->num_crtc; i++) {
+	xf86CrtcPtr crtc = config->crtc[i];
+	Bool inUse = FALSE;
+
+	if (!crtc->enabled)
+	    continue;
+	for (j = 0; j < config->num_output; j++) {
+	    xf86OutputPtr output = config->output[j];
+
+	    if (output->crtc == crtc &&
+	        dPtr->outputConnected[(uintptr_t)output->driver_private])
+		inUse = TRUE;
+	}
+	if (!inUse) {
+	    RRCrtcSet(crtc->randr_crtc, NULL, 0, 0, RR_Rotate_0, 0, NULL);
+	    dPtr->sparseTrim = dPtr->sparseFb;
+	}
+    }
+
+    dPtr->layoutChanged = TRUE;
+    RRGetInfo(pScreen, TRUE);
+    RRTellChanged(pScreen);
+    return TRUE;
+}
+
+static Bool
+vnc_output_set_connected(xf86OutputPtr output, Bool connected)
+{
+    ScrnInfoPtr pScrn = output->scrn;
+    VNCPtr dPtr = VNCPTR(pScrn);
+    int index = (uintptr_t)output->driver_private;
+
+    if (dPtr->outputConnected[index] == connected)
+	return TRUE;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Output %s %s\n", output->name,
+	       connected ? "connected" : "disconnected");
+    dPtr->outputConnected[index] = connected;
+
+    if (!dPtr->hotplugPending) {
+	dPtr->hotplugPending = TRUE;
+	QueueWorkProc(vnc_hotplug_work, NULL, xf86ScrnToScreen(pScrn));
+    }
+    return TRUE;
+}
+
+static Bool
+vnc_output_set_property(xf86OutputPtr output, Atom property,
+                        RRPropertyValuePtr value)
+{
+    int width, height;
+
+    if (property == vnc_connected_atom) {
+	if (value->type != XA_INTEGER || value->format != 32 ||
+	    value->size != 1)
+	    return FALSE;
+	return vnc_output_set_connected(output, *(INT32 *)value->data != 0);
+    }
+
+    if (property != vnc_desktop_size_atom)
+	return TRUE;
+
+    if (value->type == XA_INTEGER && value->format == 32 && value->size == 2) {
+	INT32 *size = value->data;
+
+	width = size[0];
+	height = size[1];
+    } else if (value->type == XA_ATOM && value->format == 32 &&
+               value->size == 1) {
+	const char *name = NameForAtom(*(CARD32 *)value->data);
+
+	if (!name || sscanf(name, "%dx%d", &width, &height) != 2)
+	    return FALSE;
+    } else if (value->type == XA_STRING && value->format == 8) {
+	char name[32];
+
+	if (value->size <= 0 || value->size >= sizeof(name))
+	    return FALSE;
+	memcpy(name, value->data, value->size);
+	name[value->size] = '\0';
+	if (sscanf(name, "%dx%d", &width, &height) != 2)
+	    return FALSE;
+    } else {
+	return FALSE;
+    }
+
+    if (width < 0 || height < 0)
+	return FALSE;
+
+    return vnc_output_set_desktop_size(output, width, height);
 }
 
 static const xf86OutputFuncsRec vnc_output_funcs = {
+    .create_resources = vnc_output_create_resources,
     .detect = vnc_output_detect,
     .mode_valid = vnc_output_mode_valid,
     .get_modes = vnc_output_get_modes,
     .dpms = vnc_output_dpms,
+    .set_property = vnc_output_set_property,
 };
 
 static Bool
 vnc_crtc_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 			  Rotation rotation, int x, int y)
 {
+    ScrnInfoPtr pScrn = crtc->scrn;
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    VNC_PROBE5(set_mode_major, (int)(uintptr_t)crtc->driver_private,
+               mode->HDisplay, mode->VDisplay, x, y);
+
+    /* With a sparse framebuffer the committed memory follows the CRTCs */
+    if (dPtr->sparseFb) {
+	BoxRec box;
+
+	box.x1 = x;
+	box.y1 = y;
+	if (rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+	    box.x2 = x + mode->VDisplay;
+	    box.y2 = y + mode->HDisplay;
+	} else {
+	    box.x2 = x + mode->HDisplay;
+	    box.y2 = y + mode->VDisplay;
+	}
+	if (!sparse_layout_valid(pScrn, pScrn->virtualX, pScrn->virtualY,
+	                         crtc, &box)) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		       "Not enough VideoRam for %d x %d at %d,%d\n",
+		       mode->HDisplay, mode->VDisplay, x, y);
+	    return FALSE;
+	}
+	VNCSparseCover(pScrn, &box);
+	dPtr->sparseTrim = TRUE;
+    }
+
     crtc->mode = *mode;
     crtc->x = x;
     crtc->y = y;
     crtc->rotation = rotation;
+    dPtr->layoutChanged = TRUE;
 
     return TRUE;
 }
 
 static void
-vnc_crtc_dpms(xf86CrtcPtr output, int dpms)
+vnc_crtc_dpms(xf86CrtcPtr crtc, int dpms)
 {
-    return;
+    VNCPTR(crtc->scrn)->layoutChanged = TRUE;
 }
 
 static const xf86CrtcFuncsRec vnc_crtc_funcs = {
@@ -424,6 +1002,12 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
     GDevPtr device = xf86GetEntityInfo(pScrn->entityList[0])->device;
     xf86OutputPtr output[VNC_MAX_OUTPUTS];
     xf86CrtcPtr crtc[VNC_MAX_OUTPUTS];
+    uint32_t allOutputs;
+    const VNCPixelFormatRec *format = NULL;
+    const char *formatName;
+    const char *desktopSize;
+    int fileWidth, fileHeight;
+    uint64_t phase = startup_usec();
 
     if (flags & PROBE_DETECT) 
 	return TRUE;
@@ -434,6 +1018,7 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
     }
     
     dPtr = VNCPTR(pScrn);
+    dPtr->startTime = phase;
 
     pScrn->chipset = (char *)xf86TokenToString(VNCChipsets,
 					       VNC_CHIP);
@@ -443,7 +1028,25 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
     
     pScrn->monitor = pScrn->confScreen->monitor;
 
-    if (!xf86SetDepthBpp(pScrn, 0, 0, 0,  Support24bppFb | Support32bppFb))
+    /* The pixel format decides the depth, so look it up ahead of the
+     * other options, which can only be collected once the depth is set */
+    formatName = xf86FindOptionValue(device->options, "PixelFormat");
+    if (formatName) {
+	for (format = VNCPixelFormats; format->name; format++) {
+	    if (xf86NameCmp(format->name, formatName) == 0)
+		break;
+	}
+	if (!format->name) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		       "Unknown PixelFormat \"%s\" (expected BGRX, RGBX,"
+		       " RGB565 or BGR565)\n", formatName);
+	    return FALSE;
+	}
+    }
+
+    if (!xf86SetDepthBpp(pScrn, format ? format->depth : 0, 0,
+                         format ? format->bpp : 0,
+                         Support24bppFb | Support32bppFb))
 	return FALSE;
     else {
 	/* Check that the returned depth is one we support */
@@ -462,6 +1065,14 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 	}
     }
 
+    if (format && (pScrn->depth != format->depth ||
+                   pScrn->bitsPerPixel != format->bpp)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "PixelFormat %s needs depth %d at %d bpp\n",
+		   format->name, format->depth, format->bpp);
+	return FALSE;
+    }
+
     xf86PrintDepthBpp(pScrn);
     if (pScrn->depth == 8)
 	pScrn->rgbBits = 8;
@@ -471,10 +1082,21 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
      * xf86SetWeight references it.
      */
     if (pScrn->depth > 8) {
-	/* The defaults are OK for us */
+	/* The defaults are OK for us, unless a PixelFormat was given */
 	rgb zeros = {0, 0, 0};
+	rgb masks = {0, 0, 0};
+
+	if (format) {
+	    masks.red = format->red;
+	    masks.green = format->green;
+	    masks.blue = format->blue;
+	    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+		       "PixelFormat %s: red 0x%08x green 0x%08x blue 0x%08x\n",
+		       format->name, (unsigned int)format->red,
+		       (unsigned int)format->green, (unsigned int)format->blue);
+	}
 
-	if (!xf86SetWeight(pScrn, zeros, zeros)) {
+	if (!xf86SetWeight(pScrn, zeros, masks)) {
 	    return FALSE;
 	} else {
 	    /* XXX check that weight returned is supported */
@@ -503,14 +1125,91 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
     xf86ProcessOptions(pScrn->scrnIndex, pScrn->options, dPtr->Options);
 
     xf86GetOptValBool(dPtr->Options, OPTION_SW_CURSOR,&dPtr->swCursor);
+    xf86GetOptValBool(dPtr->Options, OPTION_GLYPH_CACHE, &dPtr->glyphCache);
     
     dPtr->numOutputs = 1;
     xf86GetOptValInteger(dPtr->Options, OPTION_NUM_OUTPUTS,&dPtr->numOutputs);
-    if (dPtr->numOutputs > VNC_MAX_OUTPUTS) {
+    /* Spare outputs for hotplugging are opt-in */
+    dPtr->maxOutputs = dPtr->numOutputs;
+    xf86GetOptValInteger(dPtr->Options, OPTION_MAX_OUTPUTS,&dPtr->maxOutputs);
+    if (dPtr->maxOutputs > VNC_MAX_OUTPUTS) {
 	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Too many outputs (maximum is %u)\n",
 		   VNC_MAX_OUTPUTS);
 	RETURN;
     }
+    if (dPtr->numOutputs < 1 || dPtr->numOutputs > dPtr->maxOutputs) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "NumOutputs must be between 1 and MaxOutputs (%d)\n",
+		   dPtr->maxOutputs);
+	RETURN;
+    }
+
+    dPtr->fbFileFd = -1;
+    dPtr->fbFile = xf86GetOptValString(dPtr->Options, OPTION_FRAMEBUFFER_FILE);
+    if (dPtr->fbFile) {
+	xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Framebuffer file: %s\n",
+		   dPtr->fbFile);
+    }
+
+    xf86GetOptValBool(dPtr->Options, OPTION_SPARSE_FRAMEBUFFER,
+		      &dPtr->sparseFb);
+    if (dPtr->sparseFb && dPtr->fbFile) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "SparseFramebuffer cannot be used with FramebufferFile\n");
+	dPtr->sparseFb = FALSE;
+    }
+    dPtr->sparseMargin = 64;
+    xf86GetOptValInteger(dPtr->Options, OPTION_SPARSE_MARGIN,
+			 &dPtr->sparseMargin);
+    dPtr->sparseMargin = max(dPtr->sparseMargin, 0);
+
+    dPtr->exportDir = xf86GetOptValString(dPtr->Options, OPTION_EXPORT_DIR);
+    if (!dPtr->exportDir)
+	dPtr->exportDir = XNFprintf("/dev/shm/vnc_drv.%s", display);
+    xf86GetOptValBool(dPtr->Options, OPTION_TILE_STATS, &dPtr->tileStats);
+    xf86GetOptValBool(dPtr->Options, OPTION_WINDOW_CAPTURE,
+		      &dPtr->windowCapture);
+    dPtr->viewportDefer = 100;
+    xf86GetOptValInteger(dPtr->Options, OPTION_VIEWPORT_DEFER,
+			 &dPtr->viewportDefer);
+    xf86GetOptValBool(dPtr->Options, OPTION_SCROLL_DETECT,
+		      &dPtr->scrollDetect);
+    xf86GetOptValBool(dPtr->Options, OPTION_VIDEO_DETECT,
+		      &dPtr->videoRegions);
+    xf86GetOptValBool(dPtr->Options, OPTION_LATENCY_STATS,
+		      &dPtr->latencyStats);
+    xf86GetOptValBool(dPtr->Options, OPTION_PROFILE, &dPtr->renderProfile);
+    dPtr->recordFile = xf86GetOptValString(dPtr->Options, OPTION_RECORD_FILE);
+    dPtr->recordKeyframe = 60;
+    xf86GetOptValInteger(dPtr->Options, OPTION_RECORD_KEYFRAME,
+			 &dPtr->recordKeyframe);
+    xf86GetOptValBool(dPtr->Options, OPTION_SCANOUT_LAYOUT,
+		      &dPtr->scanoutLayout);
+    dPtr->damageTileThreshold = 256;
+    xf86GetOptValInteger(dPtr->Options, OPTION_DAMAGE_TILE_THRESHOLD,
+			 &dPtr->damageTileThreshold);
+    dPtr->damageTileThreshold = max(dPtr->damageTileThreshold, 0);
+    xf86GetOptValBool(dPtr->Options, OPTION_DIRTY_TILES, &dPtr->dirtyTiles);
+    xf86GetOptValBool(dPtr->Options, OPTION_XV_ADAPTOR, &dPtr->xvAdaptor);
+
+    /* Starting at the size the viewer wants saves a resize, and a repaint
+     * of the whole desktop, straight after start-up */
+    desktopSize = xf86GetOptValString(dPtr->Options, OPTION_DESKTOP_SIZE);
+    if (desktopSize) {
+	int width, height;
+
+	if (sscanf(desktopSize, "%dx%d", &width, &height) != 2 ||
+	    width <= 0 || height <= 0 ||
+	    width > VNC_MAX_WIDTH || height > VNC_MAX_HEIGHT) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		       "Ignoring invalid DesktopSize \"%s\"\n", desktopSize);
+	} else {
+	    for (i = 0; i < dPtr->numOutputs; i++) {
+		dPtr->outputWidth[i] = width;
+		dPtr->outputHeight[i] = height;
+	    }
+	}
+    }
 
     if (device->videoRam != 0) {
 	pScrn->videoRam = device->videoRam;
@@ -522,6 +1221,23 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 		   pScrn->videoRam);
     }
 
+    /*
+     * Start at the size a previous server left in the framebuffer file,
+     * taking precedence over DesktopSize.  The file only has the size of
+     * the whole screen, which is that of an output only if there is one.
+     */
+    if (dPtr->fbFile && dPtr->numOutputs == 1 &&
+	VNCFbFileProbe(pScrn, &fileWidth, &fileHeight)) {
+	if (size_valid(pScrn, fileWidth, fileHeight)) {
+	    dPtr->outputWidth[0] = fileWidth;
+	    dPtr->outputHeight[0] = fileHeight;
+	} else {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		       "Ignoring invalid size %dx%d in %s\n",
+		       fileWidth, fileHeight, dPtr->fbFile);
+	}
+    }
+
     if (device->dacSpeeds[0] != 0) {
 	maxClock = device->dacSpeeds[0];
 	xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Max Clock: %d kHz\n",
@@ -531,9 +1247,15 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 		   maxClock);
     }
 
+    startup_phase(pScrn, "PreInit options", &phase);
+
     xf86CrtcConfigInit(pScrn, &vnc_xf86crtc_config_funcs);
 
-    for (i=0; i<dPtr->numOutputs; ++i) {
+    /* Every output that may be plugged in later is created now, with the
+     * ones beyond NumOutputs left disconnected */
+    for (i=0; i<dPtr->maxOutputs; ++i) {
+	dPtr->outputConnected[i] = i < dPtr->numOutputs;
+
 	crtc[i] = xf86CrtcCreate(pScrn, &vnc_crtc_funcs);
 	crtc[i]->driver_private = (void *)(uintptr_t)i;
 	
@@ -543,7 +1265,7 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 	
 	xf86OutputUseScreenMonitor(output[i], TRUE);
 	
-	output[i]->possible_crtcs = 1 << i;
+	output[i]->possible_crtcs = 1U << i;
 	output[i]->possible_clones = 0;
 	output[i]->driver_private = (void *)(uintptr_t)i;
     }
@@ -552,6 +1274,17 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 
     xf86InitialConfiguration(pScrn, TRUE);
 
+    /*
+     * Each output starts on its own CRTC, but any may then be moved onto
+     * any CRTC and cloned with any other (xrandr --same-as), so that a
+     * mirrored group shares one scanout and is encoded once.
+     */
+    allOutputs = dPtr->maxOutputs < 32 ? (1U << dPtr->maxOutputs) - 1 : ~0U;
+    for (i=0; i<dPtr->maxOutputs; ++i) {
+	output[i]->possible_crtcs = allOutputs;
+	output[i]->possible_clones = allOutputs & ~(1U << i);
+    }
+
     if (pScrn->modes == NULL) {
 	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "No valid modes found\n");
 	return FALSE;
@@ -565,6 +1298,8 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 	crtc[i]->funcs->set_mode_major(crtc[i], pScrn->currentMode, RR_Rotate_0, 0, 0);
     }
 
+    startup_phase(pScrn, "PreInit initial configuration", &phase);
+
     /* We have no contiguous physical fb in physical memory */
     pScrn->memPhysBase = 0;
     pScrn->fbOffset = 0;
@@ -573,11 +1308,14 @@ VNCPreInit(ScrnInfoPtr pScrn, int flags)
 	return FALSE;
     }
 
+    /* The software cursor needs nothing from ramdac */
     if (!dPtr->swCursor) {
 	if (!xf86LoadSubModule(pScrn, "ramdac"))
 	    return FALSE;
     }
-    
+
+    startup_phase(pScrn, "PreInit modules", &phase);
+    VNCStartupMark(pScrn, "PreInit done");
     return TRUE;
 }
 #undef RETURN
@@ -610,6 +1348,8 @@ VNCLoadPalette(
    int i, index, shift, Gshift;
    VNCPtr dPtr = VNCPTR(pScrn);
 
+   VNC_PROBE1(load_palette, numColors);
+
    switch(pScrn->depth) {
    case 15:	
 	shift = Gshift = 1;
@@ -643,6 +1383,7 @@ VNCScreenInit(SCREEN_INIT_ARGS_DECL)
     int ret;
     VisualPtr visual;
     void *pixels;
+    uint64_t phase = startup_usec();
 
     /*
      * we need to get the ScrnInfoRec for this screen, so let's allocate
@@ -672,6 +1413,8 @@ VNCScreenInit(SCREEN_INIT_ARGS_DECL)
     if (!pixels)
       return FALSE;
 
+    startup_phase(pScrn, "ScreenInit framebuffer", &phase);
+
     /*
      * Call the framebuffer layer's ScreenInit function, and fill in other
      * pScreen fields.
@@ -701,6 +1444,13 @@ VNCScreenInit(SCREEN_INIT_ARGS_DECL)
     /* must be after RGB ordering fixed */
     fbPictureInit(pScreen, 0, 0);
 
+    startup_phase(pScrn, "ScreenInit fb", &phase);
+
+    /* must be before the cursor sets up Damage */
+    if (dPtr->glyphCache && !VNCRenderInit(pScreen))
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Glyph atlas initialization failed\n");
+
     xf86SetBlackWhitePixels(pScreen);
 
     if (dPtr->swCursor)
@@ -722,6 +1472,12 @@ VNCScreenInit(SCREEN_INIT_ARGS_DECL)
       }
     }
     
+    if (dPtr->xvAdaptor && !VNCVideoInit(pScreen))
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Xv initialization failed\n");
+
+    startup_phase(pScrn, "ScreenInit cursor and Xv", &phase);
+
     /* Initialise default colourmap */
     if(!miCreateDefColormap(pScreen))
 	return FALSE;
@@ -739,6 +1495,14 @@ VNCScreenInit(SCREEN_INIT_ARGS_DECL)
         return FALSE;
     }
 
+    startup_phase(pScrn, "ScreenInit colormap and CRTCs", &phase);
+
+    if (dPtr->scanoutLayout && !VNCLayoutInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Scanout layout export disabled\n");
+	dPtr->scanoutLayout = FALSE;
+    }
+
     pScreen->SaveScreen = VNCSaveScreen;
 
     
@@ -746,15 +1510,32 @@ VNCScreenInit(SCREEN_INIT_ARGS_DECL)
     dPtr->CloseScreen = pScreen->CloseScreen;
     pScreen->CloseScreen = VNCCloseScreen;
 
+    dPtr->CreateScreenResources = pScreen->CreateScreenResources;
+    pScreen->CreateScreenResources = VNCCreateScreenResources;
+
+    dPtr->BlockHandler = pScreen->BlockHandler;
+    pScreen->BlockHandler = VNCBlockHandler;
+
     /* Wrap the current CreateWindow function */
     dPtr->CreateWindow = pScreen->CreateWindow;
     pScreen->CreateWindow = VNCCreateWindow;
 
+    /* Wrap the current DestroyWindow function */
+    dPtr->DestroyWindow = pScreen->DestroyWindow;
+    pScreen->DestroyWindow = VNCDestroyWindow;
+
+    /* Last, so that the profiler times everything below it */
+    if (dPtr->renderProfile && !VNCProfileInit(pScreen))
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Render profiling initialization failed\n");
+
     /* Report any unused options (only for the first generation) */
     if (serverGeneration == 1) {
 	xf86ShowUnusedOptions(pScrn->scrnIndex, pScrn->options);
     }
 
+    startup_phase(pScrn, "ScreenInit wrapping", &phase);
+    VNCStartupMark(pScrn, "ScreenInit done");
     return TRUE;
 }
 
@@ -778,16 +1559,75 @@ VNCCloseScreen(CLOSE_SCREEN_ARGS_DECL)
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     VNCPtr dPtr = VNCPTR(pScrn);
 
-    free(pScreen->GetScreenPixmap(pScreen)->devPrivate.ptr);
+    VNCProfileClose(pScreen);
+    VNCDamageClose(pScreen);
+    VNCRenderClose(pScreen);
+    VNCVideoClose(pScreen);
+    VNCLayoutClose(pScrn);
+
+    free_fb(pScrn, pScreen->GetScreenPixmap(pScreen)->devPrivate.ptr);
 
     if (dPtr->CursorInfo)
 	xf86DestroyCursorInfoRec(dPtr->CursorInfo);
 
     pScrn->vtSema = FALSE;
+    pScreen->BlockHandler = dPtr->BlockHandler;
     pScreen->CloseScreen = dPtr->CloseScreen;
     return (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
 }
 
+static Bool
+VNCCreateScreenResources(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    Bool ret;
+
+    pScreen->CreateScreenResources = dPtr->CreateScreenResources;
+    ret = (*pScreen->CreateScreenResources)(pScreen);
+    pScreen->CreateScreenResources = VNCCreateScreenResources;
+    if (!ret)
+	return FALSE;
+
+    /* The screen pixmap only exists from here on */
+    if (!VNCDamageStart(pScreen)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Damage tracking initialization failed\n");
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/* Publish a frame each time the server goes idle */
+static void
+VNCBlockHandler(BLOCKHANDLER_ARGS_DECL)
+{
+    SCREEN_PTR(arg);
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+
+    pScreen->BlockHandler = dPtr->BlockHandler;
+    (*pScreen->BlockHandler)(BLOCKHANDLER_ARGS);
+    dPtr->BlockHandler = pScreen->BlockHandler;
+    pScreen->BlockHandler = VNCBlockHandler;
+
+    if (!dPtr->started) {
+	dPtr->started = TRUE;
+	VNCStartupMark(xf86ScreenToScrn(pScreen), "ready for clients");
+    }
+
+    VNCDamagePublish(pScreen, pTimeout);
+
+    if (dPtr->layout && dPtr->layoutChanged)
+	VNCLayoutUpdate(xf86ScreenToScrn(pScreen));
+
+    /* After the screen has been repainted for the new layout */
+    if (dPtr->sparseTrim)
+	VNCSparseTrim(xf86ScreenToScrn(pScreen));
+
+    if (dPtr->profile)
+	VNCProfileCheck(xf86ScreenToScrn(pScreen));
+}
+
 /* Optional */
 static void
 VNCFreeScreen(FREE_SCREEN_ARGS_DECL)
@@ -820,6 +1660,8 @@ VNCCreateWindow(WindowPtr pWin)
     WindowPtr pWinRoot;
     int ret;
 
+    VNC_PROBE2(create_window, pWin->drawable.id, pWin->parent == NULL);
+
     pScreen->CreateWindow = dPtr->CreateWindow;
     ret = pScreen->CreateWindow(pWin);
     dPtr->CreateWindow = pScreen->CreateWindow;
@@ -867,3 +1709,20 @@ vncDriverFunc(ScrnInfoPtr pScrn, xorgDriverFuncOp op, pointer ptr)
 	    return FALSE;
     }
 }
+
+static Bool
+VNCDestroyWindow(WindowPtr pWin)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    VNCPtr dPtr = VNCPTR(VNCScrn);
+    Bool ret;
+
+    VNCCaptureWindowDestroyed(VNCScrn, pWin);
+
+    pScreen->DestroyWindow = dPtr->DestroyWindow;
+    ret = pScreen->DestroyWindow(pWin);
+    dPtr->DestroyWindow = pScreen->DestroyWindow;
+    pScreen->DestroyWindow = VNCDestroyWindow;
+
+    return ret;
+}
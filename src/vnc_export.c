@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Files shared with the VNC server.
+ *
+ * Data the driver computes for the encoder is published through shared
+ * mappings of files in the export directory (the ExportDir option, by
+ * default /dev/shm/vnc_drv.<display>).  Their layouts are in vnc_export.h.
+ * Unlike the framebuffer file they describe only the running server, so
+ * they are removed when it exits.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xf86.h"
+
+#include "vnc.h"
+
+/*
+ * Open the export directory, creating it if need be.  Its default name is
+ * predictable, so a directory that is already there is only used if it
+ * really is a directory, owned by the server's user and private to it;
+ * otherwise another local user could read the exports or plant symlinks.
+ */
+static int
+export_open_dir(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    struct stat st;
+    int fd;
+
+    if (mkdir(dPtr->exportDir, 0700) < 0 && errno != EEXIST) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to create export directory %s: %s\n",
+		   dPtr->exportDir, strerror(errno));
+	return -1;
+    }
+
+    fd = open(dPtr->exportDir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to open export directory %s: %s\n",
+		   dPtr->exportDir, strerror(errno));
+	return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISDIR(st.st_mode) ||
+	st.st_uid != geteuid() || (st.st_mode & 07777) != 0700) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Export directory %s must be a directory owned by uid %u"
+		   " with mode 0700\n", dPtr->exportDir, (unsigned)geteuid());
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Create or resize the export file called name to size bytes and map it.
+ * A new file reads as zeroes; an existing mapping keeps its contents up to
+ * the smaller of the two sizes but may move.
+ */
+Bool
+VNCExportMap(ScrnInfoPtr pScrn, VNCExportPtr ex, const char *name, size_t size)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    void *map;
+
+    if (!ex->path) {
+	int dirFd = export_open_dir(pScrn);
+
+	if (dirFd < 0)
+	    return FALSE;
+
+	XNFasprintf(&ex->path, "%s/%s", dPtr->exportDir, name);
+	ex->fd = openat(dirFd, name,
+			O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+			0600);
+	close(dirFd);
+	if (ex->fd < 0) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		       "Failed to create %s: %s\n", ex->path, strerror(errno));
+	    free(ex->path);
+	    ex->path = NULL;
+	    return FALSE;
+	}
+    }
+
+    if (ex->map && ex->size == size)
+	return TRUE;
+
+    if (ftruncate(ex->fd, size) < 0) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to resize %s: %s\n", ex->path, strerror(errno));
+	return FALSE;
+    }
+
+    if (ex->map)
+	map = mremap(ex->map, ex->size, size, MREMAP_MAYMOVE);
+    else
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ex->fd, 0);
+    if (map == MAP_FAILED) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to map %s: %s\n", ex->path, strerror(errno));
+	return FALSE;
+    }
+
+    ex->map = map;
+    ex->size = size;
+    return TRUE;
+}
+
+/* Unmap and remove an export file */
+void
+VNCExportUnmap(VNCExportPtr ex)
+{
+    if (ex->map) {
+	munmap(ex->map, ex->size);
+	ex->map = NULL;
+	ex->size = 0;
+    }
+    if (ex->path) {
+	close(ex->fd);
+	unlink(ex->path);
+	free(ex->path);
+	ex->path = NULL;
+    }
+}
@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Layouts of the files the VNC virtual framebuffer driver shares with the
+ * VNC server.  This header has no X server dependencies so that it can be
+ * used by consumers as well as the driver.
+ *
+ * All fields are in host byte order.  Where a header has a sequence
+ * number, it is odd while the driver is updating the file and even
+ * otherwise; readers should retry if it is odd or changes while reading.
+ */
+
+#ifndef VNC_EXPORT_H
+#define VNC_EXPORT_H
+
+#include <stdint.h>
+
+/*
+ * File-backed framebuffer (FramebufferFile option).  The pixels start
+ * headerSize bytes into the file, stride bytes per row.  The file is
+ * resized with the screen, so readers must check the geometry before
+ * touching pixels beyond the header.
+ */
+#define VNC_FB_FILE_MAGIC 0x56464256    /* "VBFV" */
+#define VNC_FB_FILE_VERSION 1
+#define VNC_FB_FILE_HEADER_SIZE 4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t bitsPerPixel;
+    uint32_t depth;
+    uint32_t redMask;
+    uint32_t greenMask;
+    uint32_t blueMask;
+    uint32_t reserved;
+    uint64_t sequence;      /* changes on every resize and published frame */
+} vncFbFileHeader;
+
+/*
+ * Per-tile content statistics (TileStats option), in the file "tilestats"
+ * in the export directory.  The framebuffer is divided into tileSize
+ * square tiles, tilesX by tilesY of them, with those on the right and
+ * bottom edges clipped to the screen.  The header is followed by one
+ * vncTileStats per tile in row-major order.  Tiles are recomputed only
+ * when damaged; frame records the frame in which each was last updated.
+ */
+#define VNC_TILE_STATS_MAGIC 0x53544e56  /* "VNTS" */
+#define VNC_TILE_STATS_VERSION 1
+#define VNC_TILE_SIZE 64
+#define VNC_TILE_MAX_COLOURS 16
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;    /* offset of the first vncTileStats */
+    uint32_t tileSize;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint32_t width;
+    uint32_t height;
+    uint64_t sequence;
+    uint64_t frame;         /* last frame published */
+} vncTileStatsHeader;
+
+typedef struct {
+    uint32_t colour;        /* the pixel value of a solid tile */
+    uint8_t colours;        /* distinct colours, VNC_TILE_MAX_COLOURS + 1 if more */
+    uint8_t solid;
+    uint16_t gradient;      /* 0-65535: share of neighbouring pixels in a smooth gradient */
+    uint64_t frame;
+} vncTileStats;
+
+typedef struct {
+    int32_t x1, y1, x2, y2;
+} vncExportBox;
+
+/*
+ * A captured window (WindowCapture option), in the file
+ * "window-0x<XID>" in the export directory while the window is listed in
+ * the VNC_CAPTURE_WINDOWS root window property.  Coordinates are screen
+ * coordinates and include the border.  visible and damage are bands of
+ * boxes; a region with more than VNC_WINDOW_MAX_RECTS boxes is given as
+ * its single bounding box instead.  damage is what changed in frame only,
+ * so a reader that missed a frame should treat all of visible as damaged.
+ * It is the whole visible region in the first frame a window is exported.
+ */
+#define VNC_WINDOW_MAGIC 0x4e574e56     /* "VNWN" */
+#define VNC_WINDOW_VERSION 1
+#define VNC_WINDOW_MAX_RECTS 256
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t window;        /* XID */
+    uint32_t viewable;
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stackIndex;    /* of its top-level window, 0 is the topmost */
+    uint32_t numVisible;
+    uint32_t numDamage;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t frame;
+    vncExportBox visible[VNC_WINDOW_MAX_RECTS];
+    vncExportBox damage[VNC_WINDOW_MAX_RECTS];
+} vncWindowExport;
+
+/*
+ * Copy hints (ScrollDetect option), in the file "scroll" in the export
+ * directory.  Each hint says that in frame, the width x height rectangle
+ * at dstX, dstY holds what was at srcX, srcY in the previous frame, even
+ * though it was redrawn rather than copied.  Hints are found by hashing
+ * rows and columns, so an encoder that keeps the previous frame may want
+ * to verify them.  Hints do not overlap each other.
+ */
+#define VNC_SCROLL_MAGIC 0x4c534e56     /* "VNSL" */
+#define VNC_SCROLL_VERSION 1
+#define VNC_SCROLL_MAX_HINTS 64
+
+typedef struct {
+    int32_t srcX;
+    int32_t srcY;
+    int32_t dstX;
+    int32_t dstY;
+    uint32_t width;
+    uint32_t height;
+} vncCopyHint;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numHints;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t frame;
+    vncCopyHint hints[VNC_SCROLL_MAX_HINTS];
+} vncScrollExport;
+
+/*
+ * Video regions (VideoDetect option), in the file "video" in the export
+ * directory: areas of the screen updating like video, found from a
+ * decaying per-tile heatmap of damage.  A region keeps its id while it is
+ * tracked; confidence grows with how long it has been stable and how much
+ * of its rectangle is updating.  The file is rewritten a few times a
+ * second while any region is present.
+ */
+#define VNC_VIDEO_MAGIC 0x44564e56      /* "VNVD" */
+#define VNC_VIDEO_VERSION 1
+#define VNC_VIDEO_MAX_REGIONS 16
+
+typedef struct {
+    uint32_t id;
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps;           /* update rate, 16.16 fixed point */
+    uint32_t confidence;    /* 0-65535 */
+    uint32_t age;           /* milliseconds since first seen */
+} vncVideoRegion;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numRegions;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t time;          /* server time in milliseconds of the update */
+    vncVideoRegion regions[VNC_VIDEO_MAX_REGIONS];
+} vncVideoExport;
+
+/*
+ * Xv frames, in the file "xv-<port>" in the export directory.  Each frame
+ * a client puts through the driver's Xv adaptor is kept here in its own
+ * YUV format, headerSize bytes into the file, with where it is shown:
+ * src is the part of the image scaled to dst on the screen, clipped to the
+ * boxes in clip (screen coordinates).  More than VNC_XV_MAX_CLIP boxes are
+ * given as their bounding box, and the frame is then always composited.
+ *
+ * A consumer that shows the frames itself writes the current time of
+ * CLOCK_MONOTONIC in milliseconds to consumerHeartbeat at least once a
+ * second.  The driver then skips converting and drawing the frames into
+ * the framebuffer (composited is 0); otherwise it draws them as usual.
+ */
+#define VNC_XV_MAGIC 0x56584e56         /* "VNXV" */
+#define VNC_XV_VERSION 1
+#define VNC_XV_HEADER_SIZE 4096
+#define VNC_XV_MAX_CLIP 128
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t active;        /* 0 once the client stops the video */
+    uint64_t sequence;
+    uint64_t frame;         /* frames put */
+    uint64_t consumerHeartbeat;     /* written by the consumer */
+    uint32_t fourcc;        /* FOURCC_I420, FOURCC_YV12, FOURCC_YUY2 or FOURCC_UYVY */
+    uint32_t width;         /* of the image */
+    uint32_t height;
+    uint32_t dataSize;
+    uint32_t pitches[3];
+    uint32_t offsets[3];
+    int32_t srcX;
+    int32_t srcY;
+    uint32_t srcWidth;
+    uint32_t srcHeight;
+    int32_t dstX;
+    int32_t dstY;
+    uint32_t dstWidth;
+    uint32_t dstHeight;
+    uint32_t composited;    /* the frame was drawn into the framebuffer */
+    uint32_t numClip;
+    vncExportBox clip[VNC_XV_MAX_CLIP];
+} vncXvExport;
+
+/*
+ * Damage latency (LatencyStats option), in the file "latency" in the
+ * export directory.  Times are CLOCK_MONOTONIC in microseconds.  For each
+ * VNC_TILE_SIZE tile the driver notes when drawing first damaged it, and
+ * once all of that damage is published counts the delay in the tiles
+ * histogram; the frames histogram counts, per frame with such tiles, the
+ * delay of its oldest damage.
+ * Bucket 0 counts delays under 2us and bucket i those from 2^i up to
+ * 2^(i+1)us, with the last bucket taking everything longer.  Histograms
+ * only ever grow, so readers wanting rates should diff two snapshots.
+ */
+#define VNC_LATENCY_MAGIC 0x544c4e56    /* "VNLT" */
+#define VNC_LATENCY_VERSION 1
+#define VNC_LATENCY_BUCKETS 32
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[VNC_LATENCY_BUCKETS];
+} vncLatencyHistogram;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tileSize;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t frame;         /* last frame published */
+    uint64_t firstDamage;   /* of the last frame counted, when the oldest */
+    uint64_t published;     /* drawing in it happened and was published */
+    vncLatencyHistogram tiles;
+    vncLatencyHistogram frames;
+} vncLatencyExport;
+
+/*
+ * Dirty tiles (DirtyTiles option), in the file "dirty" in the export
+ * directory: the damage published in frame as a bitmap of tileSize square
+ * tiles, tilesX by tilesY of them.  The bitmap starts headerSize bytes into
+ * the file, stride 64-bit words per row; tile (x, y) is bit x % 64 of word
+ * y * stride + x / 64.  Bits past tilesX in a row are zero, so a row can
+ * be scanned a word at a time.  numRects is the number of rectangles the
+ * damage had, or 0 if it was accumulated as tiles because it had too many.
+ */
+#define VNC_DIRTY_MAGIC 0x54444e56      /* "VNDT" */
+#define VNC_DIRTY_VERSION 1
+#define VNC_DIRTY_TILE_SIZE 16
+#define VNC_DIRTY_HEADER_SIZE 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t tileSize;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint32_t stride;
+    uint32_t numRects;
+    uint32_t width;
+    uint32_t height;
+    uint64_t sequence;
+    uint64_t frame;
+} vncDirtyHeader;
+
+/*
+ * Scanout layout (ScanoutLayout option), in the file "layout" in the
+ * export directory: the areas of the screen shown on connected outputs.
+ * Outputs cloned onto one CRTC, or on CRTCs showing the same area, share
+ * one scanout, so a mirrored group needs encoding only once.  Bit N of
+ * outputs is the output vnc-N, and bit N of crtcs the Nth CRTC.  width and
+ * height are the area on the screen, after rotation.  frame is the last
+ * frame published before the layout changed.
+ */
+#define VNC_LAYOUT_MAGIC 0x594c4e56     /* "VNLY" */
+#define VNC_LAYOUT_VERSION 1
+#define VNC_LAYOUT_MAX_SCANOUTS 32
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rotation;      /* RandR rotation and reflection bits */
+    uint32_t crtcs;
+    uint32_t outputs;
+    uint32_t numOutputs;
+} vncScanout;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numScanouts;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t frame;
+    uint32_t width;         /* of the screen */
+    uint32_t height;
+    vncScanout scanouts[VNC_LAYOUT_MAX_SCANOUTS];
+} vncLayoutExport;
+
+/*
+ * Session recording (RecordFile option).  Unlike the files above this is
+ * an append-only stream: a vncRecordFileHeader followed by records, each
+ * a vncRecordHeader and size bytes of payload.  Times are microseconds of
+ * CLOCK_MONOTONIC since startTime (CLOCK_REALTIME in microseconds).
+ * Readers can skip from header to header without touching the payloads.
+ * Every keyframe (a tiles record with VNC_RECORD_KEYFRAME set, covering
+ * the whole screen) comes straight after a VNC_RECORD_RESIZE record and
+ * the cursor records, and playing can start at any such resize record.
+ * A restarted server appends a new file header where the next record
+ * would be, followed by a keyframe.
+ *
+ * VNC_RECORD_TILES is a vncRecordTiles, then numTiles vncRecordTile, each
+ * followed by its pixels: one pixel for VNC_RECORD_SOLID, else width x
+ * height pixels in rows of width * bitsPerPixel / 8 bytes rounded up to a
+ * multiple of 4.  Pixel values are in the format of the file header.
+ *
+ * VNC_RECORD_CURSOR_IMAGE is a vncRecordCursorImage followed by the
+ * source and then the mask bitmap of the cursor, each width x height
+ * bits, least significant bit first, rows padded to 32 bits.  A pixel is
+ * fg where mask and source are set, bg where only mask is set, and
+ * transparent elsewhere.  Neither cursor record appears with the SWcursor
+ * option, as the cursor is then part of the tiles.
+ */
+#define VNC_RECORD_MAGIC 0x43524e56     /* "VNRC" */
+#define VNC_RECORD_VERSION 1
+#define VNC_RECORD_SYNC 0x52435256      /* "VRCR", starts every record */
+
+enum {
+    VNC_RECORD_RESIZE = 1,          /* vncRecordResize */
+    VNC_RECORD_TILES = 2,
+    VNC_RECORD_CURSOR = 3,          /* vncRecordCursor */
+    VNC_RECORD_CURSOR_IMAGE = 4
+};
+
+#define VNC_RECORD_KEYFRAME 1       /* vncRecordTiles flags */
+#define VNC_RECORD_SOLID 1          /* vncRecordTile encoding */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tileSize;
+    uint32_t bitsPerPixel;
+    uint32_t depth;
+    uint32_t redMask;
+    uint32_t greenMask;
+    uint32_t blueMask;
+    uint64_t startTime;
+} vncRecordFileHeader;
+
+typedef struct {
+    uint32_t sync;
+    uint32_t type;
+    uint32_t size;          /* of the payload that follows */
+    uint32_t reserved;
+    uint64_t time;
+} vncRecordHeader;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+} vncRecordResize;
+
+typedef struct {
+    uint64_t frame;
+    uint32_t flags;
+    uint32_t numTiles;
+} vncRecordTiles;
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint32_t encoding;
+} vncRecordTile;
+
+typedef struct {
+    int32_t x;              /* top left of the image, hotspot applied */
+    int32_t y;
+    uint32_t visible;
+} vncRecordCursor;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t fg;            /* 0xRRGGBB */
+    uint32_t bg;
+} vncRecordCursorImage;
+
+/* Sequence number updates around a change, for writers */
+static inline void
+vncExportBeginWrite(uint64_t *sequence)
+{
+    __atomic_store_n(sequence, *sequence | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+vncExportEndWrite(uint64_t *sequence)
+{
+    __atomic_store_n(sequence, (*sequence | 1) + 1, __ATOMIC_RELEASE);
+}
+
+#endif
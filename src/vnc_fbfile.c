@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * File-backed framebuffer for the VNC virtual framebuffer driver.
+ *
+ * With the FramebufferFile option the framebuffer is a shared mapping of
+ * a file, typically on tmpfs, behind a small header describing it (see
+ * vnc_export.h).  The VNC server can keep serving the last image from the
+ * file while Xorg restarts, and a restarted server maps the same file
+ * again, picking up where it left off if the geometry still matches.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+
+static uint32_t
+fbfile_stride(ScrnInfoPtr pScrn, int width)
+{
+    return ((width * pScrn->bitsPerPixel + 31) / 32) * 4;
+}
+
+/* Read the header of an existing file, returning FALSE if it is unusable */
+static Bool
+fbfile_read_header(int fd, vncFbFileHeader *header)
+{
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+	return FALSE;
+    return header->magic == VNC_FB_FILE_MAGIC &&
+           header->version == VNC_FB_FILE_VERSION &&
+           header->headerSize == VNC_FB_FILE_HEADER_SIZE;
+}
+
+/*
+ * Report the geometry left in the file by a previous server, so that the
+ * first mode can match it.
+ */
+Bool
+VNCFbFileProbe(ScrnInfoPtr pScrn, int *width, int *height)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    vncFbFileHeader header;
+    Bool ret;
+    int fd;
+
+    fd = open(dPtr->fbFile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return FALSE;
+
+    ret = fbfile_read_header(fd, &header) &&
+          header.bitsPerPixel == pScrn->bitsPerPixel &&
+          header.depth == pScrn->depth;
+    close(fd);
+
+    if (ret) {
+	*width = header.width;
+	*height = header.height;
+    }
+    return ret;
+}
+
+/*
+ * (Re)map the framebuffer file for the current virtual size.  Existing
+ * contents are kept when the geometry of a previous server matches, and
+ * cleared otherwise so that they are not shown reinterpreted.
+ *
+ * The file's blocks are allocated up front: writing to a hole in a file
+ * on a full tmpfs raises SIGBUS, which here would be inside the X server.
+ * A shrinking file is only truncated once nothing maps the part cut off,
+ * and on failure the file is left at its old size with the old mapping.
+ */
+void *
+VNCFbFileMap(ScrnInfoPtr pScrn, size_t bytes)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    size_t size = VNC_FB_FILE_HEADER_SIZE + bytes;
+    size_t oldSize = 0;
+    uint32_t stride = fbfile_stride(pScrn, pScrn->virtualX);
+    vncFbFileHeader *header;
+    vncFbFileHeader old;
+    uint64_t sequence = 0;
+    Bool resume = FALSE;
+    void *map;
+    int err;
+
+    if (dPtr->fbFileFd < 0) {
+	struct stat st;
+	Bool haveOld;
+
+	dPtr->fbFileFd = open(dPtr->fbFile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (dPtr->fbFileFd < 0) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		       "Failed to open framebuffer file %s: %s\n",
+		       dPtr->fbFile, strerror(errno));
+	    return NULL;
+	}
+
+	haveOld = fbfile_read_header(dPtr->fbFileFd, &old);
+	resume = haveOld && fstat(dPtr->fbFileFd, &st) == 0 &&
+	         st.st_size == (off_t)size &&
+	         old.width == pScrn->virtualX && old.height == pScrn->virtualY &&
+	         old.stride == stride &&
+	         old.bitsPerPixel == pScrn->bitsPerPixel &&
+	         old.depth == pScrn->depth;
+
+	if (!resume) {
+	    /* Readers must still see the sequence number change */
+	    if (haveOld)
+		sequence = old.sequence;
+	    if (ftruncate(dPtr->fbFileFd, 0) < 0) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+			   "Failed to clear framebuffer file %s: %s\n",
+			   dPtr->fbFile, strerror(errno));
+		return NULL;
+	    }
+	}
+    } else {
+	oldSize = dPtr->fbFileMapSize;
+	/* Mark the file as changing while it is resized */
+	vncExportBeginWrite(&((vncFbFileHeader *)dPtr->fbFileMap)->sequence);
+    }
+
+    if (size > oldSize) {
+	err = posix_fallocate(dPtr->fbFileFd, 0, size);
+	if (err) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		       "Failed to resize framebuffer file %s: %s\n",
+		       dPtr->fbFile, strerror(err));
+	    goto fail;
+	}
+    }
+
+    if (dPtr->fbFileMap)
+	map = mremap(dPtr->fbFileMap, dPtr->fbFileMapSize, size, MREMAP_MAYMOVE);
+    else
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           dPtr->fbFileFd, 0);
+    if (map == MAP_FAILED) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to map framebuffer file %s: %s\n",
+		   dPtr->fbFile, strerror(errno));
+	goto fail;
+    }
+    dPtr->fbFileMap = map;
+    dPtr->fbFileMapSize = size;
+
+    /* Past the new end of the mapping, the file can now shrink */
+    if (size < oldSize && ftruncate(dPtr->fbFileFd, size) < 0)
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Failed to shrink framebuffer file %s: %s\n",
+		   dPtr->fbFile, strerror(errno));
+
+    header = map;
+    if (oldSize) {
+	/* A resized screen has a new stride; what was grown into is
+	 * already zero */
+	memset((char *)map + VNC_FB_FILE_HEADER_SIZE, 0,
+	       min(size, oldSize) - VNC_FB_FILE_HEADER_SIZE);
+    } else if (!resume) {
+	header->sequence = sequence;
+	vncExportBeginWrite(&header->sequence);
+    }
+    header->magic = VNC_FB_FILE_MAGIC;
+    header->version = VNC_FB_FILE_VERSION;
+    header->headerSize = VNC_FB_FILE_HEADER_SIZE;
+    header->width = pScrn->virtualX;
+    header->height = pScrn->virtualY;
+    header->stride = stride;
+    header->bitsPerPixel = pScrn->bitsPerPixel;
+    header->depth = pScrn->depth;
+    header->redMask = pScrn->mask.red;
+    header->greenMask = pScrn->mask.green;
+    header->blueMask = pScrn->mask.blue;
+    vncExportEndWrite(&header->sequence);
+
+    if (resume)
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		   "Resuming framebuffer from %s\n", dPtr->fbFile);
+
+    return (char *)map + VNC_FB_FILE_HEADER_SIZE;
+
+fail:
+    /* Leave the file as the current mapping expects it */
+    if (oldSize) {
+	if (size > oldSize && ftruncate(dPtr->fbFileFd, oldSize) < 0)
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		       "Failed to restore framebuffer file %s: %s\n",
+		       dPtr->fbFile, strerror(errno));
+	vncExportEndWrite(&((vncFbFileHeader *)dPtr->fbFileMap)->sequence);
+    }
+    return NULL;
+}
+
+/* Bump the sequence number for a newly published frame */
+void
+VNCFbFileFrame(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    if (dPtr->fbFileMap)
+	vncExportEndWrite(&((vncFbFileHeader *)dPtr->fbFileMap)->sequence);
+}
+
+/* Unmap the framebuffer, leaving the file in place for a later server */
+void
+VNCFbFileUnmap(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    if (dPtr->fbFileMap) {
+	msync(dPtr->fbFileMap, VNC_FB_FILE_HEADER_SIZE, MS_ASYNC);
+	munmap(dPtr->fbFileMap, dPtr->fbFileMapSize);
+	dPtr->fbFileMap = NULL;
+	dPtr->fbFileMapSize = 0;
+    }
+    if (dPtr->fbFileFd >= 0) {
+	close(dPtr->fbFileFd);
+	dPtr->fbFileFd = -1;
+    }
+}
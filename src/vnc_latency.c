@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Damage latency stamping.
+ *
+ * With the LatencyStats option a second Damage object reports every
+ * drawing operation on the screen pixmap as it happens, and the driver
+ * stamps each 64x64 tile it touches with the CLOCK_MONOTONIC time, unless
+ * the tile is already waiting to be published.  When a frame is published
+ * the delay of each of its tiles, and of its oldest one, is added to
+ * histograms exported in the file "latency" (see vncLatencyExport in
+ * vnc_export.h), separating the time spent in the X server from the time
+ * spent encoding and sending.  tools/vnc-latency.c reads them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+#define LATENCY_TILE VNC_TILE_SIZE
+
+typedef struct _vncLatencyState {
+    ScrnInfoPtr pScrn;
+    DamagePtr damage;
+    VNCExportRec export;
+    int width, height;
+    int tilesX, tilesY;
+    uint64_t *stamps;           /* first damage of each tile, 0 if clean */
+} VNCLatencyRec;
+
+static uint64_t
+latency_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static Bool
+latency_resize(VNCLatencyPtr lat)
+{
+    ScrnInfoPtr pScrn = lat->pScrn;
+    int tilesX = (pScrn->virtualX + LATENCY_TILE - 1) / LATENCY_TILE;
+    int tilesY = (pScrn->virtualY + LATENCY_TILE - 1) / LATENCY_TILE;
+    uint64_t *stamps;
+
+    stamps = calloc((size_t)tilesX * tilesY, sizeof(*stamps));
+    if (!stamps)
+	return FALSE;
+
+    free(lat->stamps);
+    lat->stamps = stamps;
+    lat->width = pScrn->virtualX;
+    lat->height = pScrn->virtualY;
+    lat->tilesX = tilesX;
+    lat->tilesY = tilesY;
+    return TRUE;
+}
+
+/* Called by Damage for every drawing operation on the screen */
+static void
+latency_report(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+    VNCLatencyPtr lat = closure;
+    BoxPtr box = RegionRects(pRegion);
+    int n = RegionNumRects(pRegion);
+    uint64_t now = 0;
+    int tx, ty;
+
+    if (lat->width != lat->pScrn->virtualX ||
+	lat->height != lat->pScrn->virtualY) {
+	if (!latency_resize(lat))
+	    return;
+    }
+
+    for (; n--; box++) {
+	int x1 = max(box->x1, 0) / LATENCY_TILE;
+	int y1 = max(box->y1, 0) / LATENCY_TILE;
+	int x2 = min((box->x2 - 1) / LATENCY_TILE, lat->tilesX - 1);
+	int y2 = min((box->y2 - 1) / LATENCY_TILE, lat->tilesY - 1);
+
+	for (ty = y1; ty <= y2; ty++) {
+	    uint64_t *stamp = &lat->stamps[ty * lat->tilesX];
+
+	    for (tx = x1; tx <= x2; tx++) {
+		if (stamp[tx])
+		    continue;
+		if (!now)
+		    now = latency_now();
+		stamp[tx] = now;
+	    }
+	}
+    }
+}
+
+static void
+latency_add(vncLatencyHistogram *h, uint64_t delay)
+{
+    int bucket = delay < 2 ? 0 : 63 - __builtin_clzll(delay);
+
+    h->count++;
+    h->sum += delay;
+    h->max = max(h->max, delay);
+    h->buckets[min(bucket, VNC_LATENCY_BUCKETS - 1)]++;
+}
+
+Bool
+VNCLatencyInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+    VNCLatencyPtr lat;
+    vncLatencyExport *ex;
+
+    lat = calloc(1, sizeof(*lat));
+    if (!lat)
+	return FALSE;
+    lat->pScrn = pScrn;
+
+    if (!VNCExportMap(pScrn, &lat->export, "latency",
+		      sizeof(vncLatencyExport)) ||
+	!latency_resize(lat))
+	goto fail;
+
+    lat->damage = DamageCreate(latency_report, NULL, DamageReportRawRegion,
+			       TRUE, pScreen, lat);
+    if (!lat->damage)
+	goto fail;
+    DamageRegister(&pScreen->GetScreenPixmap(pScreen)->drawable, lat->damage);
+
+    ex = lat->export.map;
+    vncExportBeginWrite(&ex->sequence);
+    ex->magic = VNC_LATENCY_MAGIC;
+    ex->version = VNC_LATENCY_VERSION;
+    ex->tileSize = LATENCY_TILE;
+    vncExportEndWrite(&ex->sequence);
+
+    dPtr->latency = lat;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Exporting damage latency to %s\n", lat->export.path);
+    return TRUE;
+
+fail:
+    VNCExportUnmap(&lat->export);
+    free(lat->stamps);
+    free(lat);
+    return FALSE;
+}
+
+/*
+ * Count the delay of the tiles published in a frame.  A tile with damage
+ * still held back outside the viewport keeps its stamp until the rest of
+ * it is published, so that the delay of that part is counted.
+ */
+void
+VNCLatencyUpdate(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCLatencyPtr lat = dPtr->latency;
+    vncLatencyExport *ex = lat->export.map;
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    Bool deferred = RegionNotEmpty(&dPtr->deferred);
+    uint64_t now = latency_now();
+    uint64_t oldest = now;
+    Bool stamped = FALSE;
+    int tx, ty;
+
+    /* Only the reports are wanted, not the accumulated region */
+    DamageEmpty(lat->damage);
+
+    vncExportBeginWrite(&ex->sequence);
+    for (; n--; box++) {
+	int x1 = box->x1 / LATENCY_TILE;
+	int y1 = box->y1 / LATENCY_TILE;
+	int x2 = min((box->x2 - 1) / LATENCY_TILE, lat->tilesX - 1);
+	int y2 = min((box->y2 - 1) / LATENCY_TILE, lat->tilesY - 1);
+
+	for (ty = y1; ty <= y2; ty++) {
+	    uint64_t *stamp = &lat->stamps[ty * lat->tilesX];
+
+	    for (tx = x1; tx <= x2; tx++) {
+		if (!stamp[tx])
+		    continue;
+		if (deferred) {
+		    BoxRec tile;
+
+		    tile.x1 = tx * LATENCY_TILE;
+		    tile.y1 = ty * LATENCY_TILE;
+		    tile.x2 = tile.x1 + LATENCY_TILE;
+		    tile.y2 = tile.y1 + LATENCY_TILE;
+		    if (RegionContainsRect(&dPtr->deferred, &tile) != rgnOUT)
+			continue;
+		}
+		latency_add(&ex->tiles, now - stamp[tx]);
+		oldest = min(oldest, stamp[tx]);
+		stamped = TRUE;
+		stamp[tx] = 0;
+	    }
+	}
+    }
+    ex->frame = dPtr->frame;
+    if (stamped) {
+	latency_add(&ex->frames, now - oldest);
+	ex->firstDamage = oldest;
+	ex->published = now;
+    }
+    vncExportEndWrite(&ex->sequence);
+
+    if (stamped)
+	VNC_PROBE2(damage_latency, dPtr->frame, now - oldest);
+}
+
+void
+VNCLatencyClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCLatencyPtr lat = dPtr->latency;
+    ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+
+    if (!lat)
+	return;
+
+    DamageUnregister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+		     lat->damage);
+    DamageDestroy(lat->damage);
+    VNCExportUnmap(&lat->export);
+    free(lat->stamps);
+    free(lat);
+    dPtr->latency = NULL;
+}
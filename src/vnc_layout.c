@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Scanout layout export.
+ *
+ * With the ScanoutLayout option the driver exports, in the file "layout",
+ * which areas of the screen its outputs show (see vncLayoutExport in
+ * vnc_export.h).  Outputs cloned onto one CRTC, and CRTCs showing exactly
+ * the same area, are given as one scanout listing all of them, so that
+ * the encoder can produce a single stream for a mirrored group.  The file
+ * is rewritten after any RandR change that alters it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "xf86Crtc.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+typedef struct _vncLayoutState {
+    VNCExportRec export;
+} VNCLayoutRec;
+
+/* Find or add the scanout for a CRTC's area */
+static vncScanout *
+layout_scanout(vncLayoutExport *layout, xf86CrtcPtr crtc)
+{
+    vncScanout *s;
+    uint32_t width = crtc->mode.HDisplay, height = crtc->mode.VDisplay;
+    uint32_t i;
+
+    if (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+	width = crtc->mode.VDisplay;
+	height = crtc->mode.HDisplay;
+    }
+
+    for (i = 0; i < layout->numScanouts; i++) {
+	s = &layout->scanouts[i];
+	if (s->x == crtc->x && s->y == crtc->y && s->width == width &&
+	    s->height == height && s->rotation == crtc->rotation)
+	    return s;
+    }
+    if (layout->numScanouts == VNC_LAYOUT_MAX_SCANOUTS)
+	return NULL;
+
+    s = &layout->scanouts[layout->numScanouts++];
+    s->x = crtc->x;
+    s->y = crtc->y;
+    s->width = width;
+    s->height = height;
+    s->rotation = crtc->rotation;
+    return s;
+}
+
+static void
+layout_build(ScrnInfoPtr pScrn, vncLayoutExport *layout)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+    int i, j;
+
+    memset(layout, 0, sizeof(*layout));
+    layout->width = pScrn->virtualX;
+    layout->height = pScrn->virtualY;
+
+    for (i = 0; i < config->num_crtc; i++) {
+	xf86CrtcPtr crtc = config->crtc[i];
+	vncScanout *s = NULL;
+
+	if (!crtc->enabled)
+	    continue;
+
+	/* Only outputs someone is viewing count */
+	for (j = 0; j < config->num_output; j++) {
+	    xf86OutputPtr output = config->output[j];
+	    int index = (uintptr_t)output->driver_private;
+
+	    if (output->crtc != crtc || !dPtr->outputConnected[index])
+		continue;
+	    if (!s)
+		s = layout_scanout(layout, crtc);
+	    if (!s)
+		break;
+	    if (!(s->outputs & (1U << index)))
+		s->numOutputs++;
+	    s->outputs |= 1U << index;
+	    s->crtcs |= 1U << i;
+	}
+    }
+}
+
+Bool
+VNCLayoutInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCLayoutPtr lay;
+
+    lay = calloc(1, sizeof(*lay));
+    if (!lay)
+	return FALSE;
+
+    if (!VNCExportMap(pScrn, &lay->export, "layout",
+		      sizeof(vncLayoutExport))) {
+	free(lay);
+	return FALSE;
+    }
+
+    dPtr->layout = lay;
+    dPtr->layoutChanged = TRUE;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Exporting scanout layout to %s\n", lay->export.path);
+    return TRUE;
+}
+
+/* Rewrite the layout if the CRTCs or outputs changed it */
+void
+VNCLayoutUpdate(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    vncLayoutExport *ex = dPtr->layout->export.map;
+    vncLayoutExport layout;
+
+    dPtr->layoutChanged = FALSE;
+
+    layout_build(pScrn, &layout);
+    if (ex->magic == VNC_LAYOUT_MAGIC && ex->width == layout.width &&
+	ex->height == layout.height &&
+	ex->numScanouts == layout.numScanouts &&
+	!memcmp(ex->scanouts, layout.scanouts,
+		layout.numScanouts * sizeof(vncScanout)))
+	return;
+
+    vncExportBeginWrite(&ex->sequence);
+    ex->magic = VNC_LAYOUT_MAGIC;
+    ex->version = VNC_LAYOUT_VERSION;
+    ex->numScanouts = layout.numScanouts;
+    ex->width = layout.width;
+    ex->height = layout.height;
+    ex->frame = dPtr->frame;
+    memcpy(ex->scanouts, layout.scanouts, sizeof(ex->scanouts));
+    vncExportEndWrite(&ex->sequence);
+
+    VNC_PROBE1(layout_update, layout.numScanouts);
+}
+
+void
+VNCLayoutClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    if (!dPtr->layout)
+	return;
+
+    VNCExportUnmap(&dPtr->layout->export);
+    free(dPtr->layout);
+    dPtr->layout = NULL;
+}
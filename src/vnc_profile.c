@@ -0,0 +1,791 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Render cost profiler.
+ *
+ * With the Profile option the driver wraps, outermost, the GC ops of
+ * every GC, the screen's CopyWindow and GetImage, and the Render
+ * Composite, Glyphs, CompositeRects, Trapezoids and Triangles hooks.
+ * Each call is timed, including the layers below it such as Damage and
+ * fb, and counted by operation and by the pixel area it covers, in
+ * power-of-two buckets.  A summary goes to the log on SIGUSR2 and when the
+ * screen closes:
+ *
+ *   kill -USR2 $(pidof Xorg)
+ *
+ * Without the option nothing is wrapped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <time.h>
+
+#include "xf86.h"
+#include "gcstruct.h"
+#include "windowstr.h"
+#include "picturestr.h"
+#include "glyphstr.h"
+
+#include "vnc.h"
+
+enum {
+    PROFILE_FILL_SPANS,
+    PROFILE_SET_SPANS,
+    PROFILE_PUT_IMAGE,
+    PROFILE_COPY_AREA,
+    PROFILE_COPY_PLANE,
+    PROFILE_POLY_POINT,
+    PROFILE_POLYLINES,
+    PROFILE_POLY_SEGMENT,
+    PROFILE_POLY_RECTANGLE,
+    PROFILE_POLY_ARC,
+    PROFILE_FILL_POLYGON,
+    PROFILE_POLY_FILL_RECT,
+    PROFILE_POLY_FILL_ARC,
+    PROFILE_POLY_TEXT8,
+    PROFILE_POLY_TEXT16,
+    PROFILE_IMAGE_TEXT8,
+    PROFILE_IMAGE_TEXT16,
+    PROFILE_IMAGE_GLYPH_BLT,
+    PROFILE_POLY_GLYPH_BLT,
+    PROFILE_PUSH_PIXELS,
+    PROFILE_COPY_WINDOW,
+    PROFILE_GET_IMAGE,
+    PROFILE_COMPOSITE,
+    PROFILE_GLYPHS,
+    PROFILE_COMPOSITE_RECTS,
+    PROFILE_TRAPEZOIDS,
+    PROFILE_TRIANGLES,
+    PROFILE_NUM_OPS
+};
+
+static const char *const profile_op_names[PROFILE_NUM_OPS] = {
+    "FillSpans", "SetSpans", "PutImage", "CopyArea", "CopyPlane",
+    "PolyPoint", "Polylines", "PolySegment", "PolyRectangle", "PolyArc",
+    "FillPolygon", "PolyFillRect", "PolyFillArc", "PolyText8", "PolyText16",
+    "ImageText8", "ImageText16", "ImageGlyphBlt", "PolyGlyphBlt",
+    "PushPixels", "CopyWindow", "GetImage", "Composite", "Glyphs",
+    "CompositeRects", "Trapezoids", "Triangles"
+};
+
+/*
+ * Bucket 0 is for operations whose area is not worked out (lines, arcs,
+ * text, trapezoids); bucket i > 0 for areas under 2^i pixels.
+ */
+#define PROFILE_AREA_BUCKETS 26
+
+typedef struct {
+    uint64_t count;
+    uint64_t ns;
+    uint64_t maxNs;
+} vncProfileCell;
+
+typedef struct _vncProfileState {
+    vncProfileCell cells[PROFILE_NUM_OPS][PROFILE_AREA_BUCKETS];
+    uint64_t start;
+    struct sigaction oldAction;
+
+    CreateGCProcPtr CreateGC;
+    CopyWindowProcPtr CopyWindow;
+    GetImageProcPtr GetImage;
+    CompositeProcPtr Composite;
+    GlyphsProcPtr Glyphs;
+    CompositeRectsProcPtr CompositeRects;
+    TrapezoidsProcPtr Trapezoids;
+    TrianglesProcPtr Triangles;
+} VNCProfileRec;
+
+typedef struct {
+    const GCFuncs *funcs;
+    const GCOps *ops;           /* NULL until the GC is first validated */
+} vncProfileGCRec, *vncProfileGCPtr;
+
+static DevPrivateKeyRec vncProfileGCKeyRec;
+static volatile sig_atomic_t profile_dump_requested;
+
+static uint64_t
+profile_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static VNCProfilePtr
+profile_state(ScreenPtr pScreen)
+{
+    return VNCPTR(xf86ScreenToScrn(pScreen))->profile;
+}
+
+static void
+profile_add(VNCProfilePtr prof, int op, uint64_t area, uint64_t start)
+{
+    uint64_t ns = profile_ns() - start;
+    int bucket = area ? 64 - __builtin_clzll(area) : 0;
+    vncProfileCell *cell;
+
+    cell = &prof->cells[op][min(bucket, PROFILE_AREA_BUCKETS - 1)];
+    cell->count++;
+    cell->ns += ns;
+    cell->maxNs = max(cell->maxNs, ns);
+}
+
+static void
+profile_signal(int sig)
+{
+    profile_dump_requested = 1;
+}
+
+/* GC wrappers, as in the Damage layer */
+
+static vncProfileGCPtr
+profile_gc_priv(GCPtr pGC)
+{
+    return dixLookupPrivate(&pGC->devPrivates, &vncProfileGCKeyRec);
+}
+
+static const GCFuncs vncProfileGCFuncs;
+static const GCOps vncProfileGCOps;
+
+#define PROFILE_GC_FUNC_PROLOGUE(pGC) \
+    vncProfileGCPtr priv = profile_gc_priv(pGC); \
+    (pGC)->funcs = priv->funcs; \
+    if (priv->ops) \
+	(pGC)->ops = priv->ops
+
+#define PROFILE_GC_FUNC_EPILOGUE(pGC) \
+    priv->funcs = (pGC)->funcs; \
+    (pGC)->funcs = &vncProfileGCFuncs; \
+    if (priv->ops) { \
+	priv->ops = (pGC)->ops; \
+	(pGC)->ops = &vncProfileGCOps; \
+    }
+
+/* Time call as operation op covering area pixels */
+#define PROFILE_GC_OP(pGC, op, area, call) do { \
+    VNCProfilePtr prof = profile_state((pGC)->pScreen); \
+    vncProfileGCPtr priv = profile_gc_priv(pGC); \
+    uint64_t area_ = prof ? (area) : 0; \
+    uint64_t start_ = prof ? profile_ns() : 0; \
+    (pGC)->funcs = priv->funcs; \
+    (pGC)->ops = priv->ops; \
+    call; \
+    priv->funcs = (pGC)->funcs; \
+    priv->ops = (pGC)->ops; \
+    (pGC)->funcs = &vncProfileGCFuncs; \
+    (pGC)->ops = &vncProfileGCOps; \
+    if (prof) \
+	profile_add(prof, op, area_, start_); \
+} while (0)
+
+static void
+profile_validate_gc(GCPtr pGC, unsigned long changes, DrawablePtr pDrawable)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ValidateGC)(pGC, changes, pDrawable);
+    priv->ops = pGC->ops;
+    PROFILE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+profile_change_gc(GCPtr pGC, unsigned long mask)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ChangeGC)(pGC, mask);
+    PROFILE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+profile_copy_gc(GCPtr pGCSrc, unsigned long mask, GCPtr pGCDst)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pGCDst);
+    (*pGCDst->funcs->CopyGC)(pGCSrc, mask, pGCDst);
+    PROFILE_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static void
+profile_destroy_gc(GCPtr pGC)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->DestroyGC)(pGC);
+    PROFILE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+profile_change_clip(GCPtr pGC, int type, pointer pvalue, int nrects)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ChangeClip)(pGC, type, pvalue, nrects);
+    PROFILE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+profile_copy_clip(GCPtr pgcDst, GCPtr pgcSrc)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pgcDst);
+    (*pgcDst->funcs->CopyClip)(pgcDst, pgcSrc);
+    PROFILE_GC_FUNC_EPILOGUE(pgcDst);
+}
+
+static void
+profile_destroy_clip(GCPtr pGC)
+{
+    PROFILE_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->DestroyClip)(pGC);
+    PROFILE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static const GCFuncs vncProfileGCFuncs = {
+    profile_validate_gc,
+    profile_change_gc,
+    profile_copy_gc,
+    profile_destroy_gc,
+    profile_change_clip,
+    profile_destroy_clip,
+    profile_copy_clip
+};
+
+static uint64_t
+profile_spans_area(int n, const int *widths)
+{
+    uint64_t area = 0;
+
+    while (n--)
+	area += *widths++;
+    return area;
+}
+
+static uint64_t
+profile_rects_area(int n, const xRectangle *rects)
+{
+    uint64_t area = 0;
+
+    for (; n--; rects++)
+	area += (uint64_t)rects->width * rects->height;
+    return area;
+}
+
+static uint64_t
+profile_arcs_area(int n, const xArc *arcs)
+{
+    uint64_t area = 0;
+
+    for (; n--; arcs++)
+	area += (uint64_t)arcs->width * arcs->height;
+    return area;
+}
+
+static void
+profile_fill_spans(DrawablePtr pDrawable, GCPtr pGC, int nInit,
+                   DDXPointPtr pptInit, int *pwidthInit, int fSorted)
+{
+    PROFILE_GC_OP(pGC, PROFILE_FILL_SPANS,
+                  profile_spans_area(nInit, pwidthInit),
+                  (*pGC->ops->FillSpans)(pDrawable, pGC, nInit, pptInit,
+                                         pwidthInit, fSorted));
+}
+
+static void
+profile_set_spans(DrawablePtr pDrawable, GCPtr pGC, char *psrc,
+                  DDXPointPtr ppt, int *pwidth, int nspans, int fSorted)
+{
+    PROFILE_GC_OP(pGC, PROFILE_SET_SPANS, profile_spans_area(nspans, pwidth),
+                  (*pGC->ops->SetSpans)(pDrawable, pGC, psrc, ppt, pwidth,
+                                        nspans, fSorted));
+}
+
+static void
+profile_put_image(DrawablePtr pDrawable, GCPtr pGC, int depth, int x, int y,
+                  int w, int h, int leftPad, int format, char *pImage)
+{
+    PROFILE_GC_OP(pGC, PROFILE_PUT_IMAGE, (uint64_t)w * h,
+                  (*pGC->ops->PutImage)(pDrawable, pGC, depth, x, y, w, h,
+                                        leftPad, format, pImage));
+}
+
+static RegionPtr
+profile_copy_area(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                  int srcx, int srcy, int w, int h, int dstx, int dsty)
+{
+    RegionPtr ret;
+
+    PROFILE_GC_OP(pGC, PROFILE_COPY_AREA, (uint64_t)w * h,
+                  ret = (*pGC->ops->CopyArea)(pSrc, pDst, pGC, srcx, srcy,
+                                              w, h, dstx, dsty));
+    return ret;
+}
+
+static RegionPtr
+profile_copy_plane(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                   int srcx, int srcy, int w, int h, int dstx, int dsty,
+                   unsigned long bitPlane)
+{
+    RegionPtr ret;
+
+    PROFILE_GC_OP(pGC, PROFILE_COPY_PLANE, (uint64_t)w * h,
+                  ret = (*pGC->ops->CopyPlane)(pSrc, pDst, pGC, srcx, srcy,
+                                               w, h, dstx, dsty, bitPlane));
+    return ret;
+}
+
+static void
+profile_poly_point(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+                   DDXPointPtr pptInit)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_POINT, npt,
+                  (*pGC->ops->PolyPoint)(pDrawable, pGC, mode, npt, pptInit));
+}
+
+static void
+profile_polylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+                  DDXPointPtr pptInit)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLYLINES, 0,
+                  (*pGC->ops->Polylines)(pDrawable, pGC, mode, npt, pptInit));
+}
+
+static void
+profile_poly_segment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
+                     xSegment *pSegs)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_SEGMENT, 0,
+                  (*pGC->ops->PolySegment)(pDrawable, pGC, nseg, pSegs));
+}
+
+static void
+profile_poly_rectangle(DrawablePtr pDrawable, GCPtr pGC, int nrects,
+                       xRectangle *pRects)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_RECTANGLE, 0,
+                  (*pGC->ops->PolyRectangle)(pDrawable, pGC, nrects, pRects));
+}
+
+static void
+profile_poly_arc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_ARC, 0,
+                  (*pGC->ops->PolyArc)(pDrawable, pGC, narcs, parcs));
+}
+
+static void
+profile_fill_polygon(DrawablePtr pDrawable, GCPtr pGC, int shape, int mode,
+                     int count, DDXPointPtr pPts)
+{
+    PROFILE_GC_OP(pGC, PROFILE_FILL_POLYGON, 0,
+                  (*pGC->ops->FillPolygon)(pDrawable, pGC, shape, mode,
+                                           count, pPts));
+}
+
+static void
+profile_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC, int nrectFill,
+                       xRectangle *prectInit)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_FILL_RECT,
+                  profile_rects_area(nrectFill, prectInit),
+                  (*pGC->ops->PolyFillRect)(pDrawable, pGC, nrectFill,
+                                            prectInit));
+}
+
+static void
+profile_poly_fill_arc(DrawablePtr pDrawable, GCPtr pGC, int narcs,
+                      xArc *parcs)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_FILL_ARC, profile_arcs_area(narcs, parcs),
+                  (*pGC->ops->PolyFillArc)(pDrawable, pGC, narcs, parcs));
+}
+
+static int
+profile_poly_text8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                   int count, char *chars)
+{
+    int ret;
+
+    PROFILE_GC_OP(pGC, PROFILE_POLY_TEXT8, 0,
+                  ret = (*pGC->ops->PolyText8)(pDrawable, pGC, x, y,
+                                               count, chars));
+    return ret;
+}
+
+static int
+profile_poly_text16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                    int count, unsigned short *chars)
+{
+    int ret;
+
+    PROFILE_GC_OP(pGC, PROFILE_POLY_TEXT16, 0,
+                  ret = (*pGC->ops->PolyText16)(pDrawable, pGC, x, y,
+                                                count, chars));
+    return ret;
+}
+
+static void
+profile_image_text8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                    int count, char *chars)
+{
+    PROFILE_GC_OP(pGC, PROFILE_IMAGE_TEXT8, 0,
+                  (*pGC->ops->ImageText8)(pDrawable, pGC, x, y, count, chars));
+}
+
+static void
+profile_image_text16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                     int count, unsigned short *chars)
+{
+    PROFILE_GC_OP(pGC, PROFILE_IMAGE_TEXT16, 0,
+                  (*pGC->ops->ImageText16)(pDrawable, pGC, x, y, count, chars));
+}
+
+static void
+profile_image_glyph_blt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                        unsigned int nglyph, CharInfoPtr *ppci,
+                        pointer pglyphBase)
+{
+    PROFILE_GC_OP(pGC, PROFILE_IMAGE_GLYPH_BLT, 0,
+                  (*pGC->ops->ImageGlyphBlt)(pDrawable, pGC, x, y, nglyph,
+                                             ppci, pglyphBase));
+}
+
+static void
+profile_poly_glyph_blt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                       unsigned int nglyph, CharInfoPtr *ppci,
+                       pointer pglyphBase)
+{
+    PROFILE_GC_OP(pGC, PROFILE_POLY_GLYPH_BLT, 0,
+                  (*pGC->ops->PolyGlyphBlt)(pDrawable, pGC, x, y, nglyph,
+                                            ppci, pglyphBase));
+}
+
+static void
+profile_push_pixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDrawable,
+                    int w, int h, int x, int y)
+{
+    PROFILE_GC_OP(pGC, PROFILE_PUSH_PIXELS, (uint64_t)w * h,
+                  (*pGC->ops->PushPixels)(pGC, pBitMap, pDrawable,
+                                          w, h, x, y));
+}
+
+static const GCOps vncProfileGCOps = {
+    profile_fill_spans,
+    profile_set_spans,
+    profile_put_image,
+    profile_copy_area,
+    profile_copy_plane,
+    profile_poly_point,
+    profile_polylines,
+    profile_poly_segment,
+    profile_poly_rectangle,
+    profile_poly_arc,
+    profile_fill_polygon,
+    profile_poly_fill_rect,
+    profile_poly_fill_arc,
+    profile_poly_text8,
+    profile_poly_text16,
+    profile_image_text8,
+    profile_image_text16,
+    profile_image_glyph_blt,
+    profile_poly_glyph_blt,
+    profile_push_pixels
+};
+
+/* Screen wrappers */
+
+static Bool
+profile_create_gc(GCPtr pGC)
+{
+    ScreenPtr pScreen = pGC->pScreen;
+    VNCProfilePtr prof = profile_state(pScreen);
+    vncProfileGCPtr priv = profile_gc_priv(pGC);
+    Bool ret;
+
+    pScreen->CreateGC = prof->CreateGC;
+    ret = (*pScreen->CreateGC)(pGC);
+    prof->CreateGC = pScreen->CreateGC;
+    pScreen->CreateGC = profile_create_gc;
+
+    if (ret) {
+	priv->ops = NULL;
+	priv->funcs = pGC->funcs;
+	pGC->funcs = &vncProfileGCFuncs;
+    }
+    return ret;
+}
+
+static void
+profile_copy_window(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr prgnSrc)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    VNCProfilePtr prof = profile_state(pScreen);
+    BoxPtr box = RegionRects(prgnSrc);
+    int n = RegionNumRects(prgnSrc);
+    uint64_t area = 0;
+    uint64_t start;
+
+    for (; n--; box++)
+	area += (uint64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+
+    start = profile_ns();
+    pScreen->CopyWindow = prof->CopyWindow;
+    (*pScreen->CopyWindow)(pWin, ptOldOrg, prgnSrc);
+    prof->CopyWindow = pScreen->CopyWindow;
+    pScreen->CopyWindow = profile_copy_window;
+    profile_add(prof, PROFILE_COPY_WINDOW, area, start);
+}
+
+static void
+profile_get_image(DrawablePtr pDrawable, int sx, int sy, int w, int h,
+                  unsigned int format, unsigned long planeMask, char *pdstLine)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    VNCProfilePtr prof = profile_state(pScreen);
+    uint64_t start = profile_ns();
+
+    pScreen->GetImage = prof->GetImage;
+    (*pScreen->GetImage)(pDrawable, sx, sy, w, h, format, planeMask, pdstLine);
+    prof->GetImage = pScreen->GetImage;
+    pScreen->GetImage = profile_get_image;
+    profile_add(prof, PROFILE_GET_IMAGE, (uint64_t)w * h, start);
+}
+
+/* Picture wrappers */
+
+static void
+profile_composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
+                  PicturePtr pDst, INT16 xSrc, INT16 ySrc, INT16 xMask,
+                  INT16 yMask, INT16 xDst, INT16 yDst,
+                  CARD16 width, CARD16 height)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCProfilePtr prof = profile_state(pScreen);
+    uint64_t start = profile_ns();
+
+    ps->Composite = prof->Composite;
+    (*ps->Composite)(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                     xDst, yDst, width, height);
+    prof->Composite = ps->Composite;
+    ps->Composite = profile_composite;
+    profile_add(prof, PROFILE_COMPOSITE, (uint64_t)width * height, start);
+}
+
+static void
+profile_glyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+               PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+               int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCProfilePtr prof = profile_state(pScreen);
+    GlyphPtr *g = glyphs;
+    uint64_t area = 0;
+    uint64_t start;
+    int i, n;
+
+    for (i = 0; i < nlist; i++) {
+	for (n = list[i].len; n--; g++)
+	    area += (uint64_t)(*g)->info.width * (*g)->info.height;
+    }
+
+    start = profile_ns();
+    ps->Glyphs = prof->Glyphs;
+    (*ps->Glyphs)(op, pSrc, pDst, maskFormat, xSrc, ySrc, nlist, list, glyphs);
+    prof->Glyphs = ps->Glyphs;
+    ps->Glyphs = profile_glyphs;
+    profile_add(prof, PROFILE_GLYPHS, area, start);
+}
+
+static void
+profile_composite_rects(CARD8 op, PicturePtr pDst, xRenderColor *color,
+                        int nRect, xRectangle *rects)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCProfilePtr prof = profile_state(pScreen);
+    uint64_t area = profile_rects_area(nRect, rects);
+    uint64_t start = profile_ns();
+
+    ps->CompositeRects = prof->CompositeRects;
+    (*ps->CompositeRects)(op, pDst, color, nRect, rects);
+    prof->CompositeRects = ps->CompositeRects;
+    ps->CompositeRects = profile_composite_rects;
+    profile_add(prof, PROFILE_COMPOSITE_RECTS, area, start);
+}
+
+static void
+profile_trapezoids(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+                   PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+                   int ntrap, xTrapezoid *traps)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCProfilePtr prof = profile_state(pScreen);
+    uint64_t start = profile_ns();
+
+    ps->Trapezoids = prof->Trapezoids;
+    (*ps->Trapezoids)(op, pSrc, pDst, maskFormat, xSrc, ySrc, ntrap, traps);
+    prof->Trapezoids = ps->Trapezoids;
+    ps->Trapezoids = profile_trapezoids;
+    profile_add(prof, PROFILE_TRAPEZOIDS, 0, start);
+}
+
+static void
+profile_triangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+                  PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+                  int ntri, xTriangle *tris)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCProfilePtr prof = profile_state(pScreen);
+    uint64_t start = profile_ns();
+
+    ps->Triangles = prof->Triangles;
+    (*ps->Triangles)(op, pSrc, pDst, maskFormat, xSrc, ySrc, ntri, tris);
+    prof->Triangles = ps->Triangles;
+    ps->Triangles = profile_triangles;
+    profile_add(prof, PROFILE_TRIANGLES, 0, start);
+}
+
+static void
+profile_dump(ScrnInfoPtr pScrn, VNCProfilePtr prof)
+{
+    int op, bucket;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Render profile over the last %.1f s (calls, total ms, "
+	       "mean us, max us):\n",
+	       (profile_ns() - prof->start) / 1e9);
+
+    for (op = 0; op < PROFILE_NUM_OPS; op++) {
+	uint64_t count = 0, ns = 0;
+
+	for (bucket = 0; bucket < PROFILE_AREA_BUCKETS; bucket++) {
+	    count += prof->cells[op][bucket].count;
+	    ns += prof->cells[op][bucket].ns;
+	}
+	if (!count)
+	    continue;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "  %-14s %10llu %10.1f\n",
+		   profile_op_names[op], (unsigned long long)count, ns / 1e6);
+
+	for (bucket = 0; bucket < PROFILE_AREA_BUCKETS; bucket++) {
+	    vncProfileCell *cell = &prof->cells[op][bucket];
+	    char label[32];
+
+	    if (!cell->count)
+		continue;
+	    if (bucket == 0)
+		snprintf(label, sizeof(label), "any size");
+	    else if (bucket == PROFILE_AREA_BUCKETS - 1)
+		snprintf(label, sizeof(label), ">= %llu px",
+			 1ULL << (bucket - 1));
+	    else
+		snprintf(label, sizeof(label), "< %llu px", 1ULL << bucket);
+
+	    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		       "    %-12s %10llu %10.1f %10.1f %10.1f\n", label,
+		       (unsigned long long)cell->count, cell->ns / 1e6,
+		       cell->ns / 1e3 / cell->count, cell->maxNs / 1e3);
+	}
+    }
+}
+
+/* Must be called last in ScreenInit, so that the wrappers are outermost */
+Bool
+VNCProfileInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCProfilePtr prof;
+    struct sigaction action;
+
+    if (!dixRegisterPrivateKey(&vncProfileGCKeyRec, PRIVATE_GC,
+                               sizeof(vncProfileGCRec)))
+	return FALSE;
+
+    prof = calloc(1, sizeof(*prof));
+    if (!prof)
+	return FALSE;
+    prof->start = profile_ns();
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, &action, &prof->oldAction) < 0) {
+	free(prof);
+	return FALSE;
+    }
+
+    prof->CreateGC = pScreen->CreateGC;
+    pScreen->CreateGC = profile_create_gc;
+    prof->CopyWindow = pScreen->CopyWindow;
+    pScreen->CopyWindow = profile_copy_window;
+    prof->GetImage = pScreen->GetImage;
+    pScreen->GetImage = profile_get_image;
+    if (ps) {
+	prof->Composite = ps->Composite;
+	ps->Composite = profile_composite;
+	prof->Glyphs = ps->Glyphs;
+	ps->Glyphs = profile_glyphs;
+	prof->CompositeRects = ps->CompositeRects;
+	ps->CompositeRects = profile_composite_rects;
+	prof->Trapezoids = ps->Trapezoids;
+	ps->Trapezoids = profile_trapezoids;
+	prof->Triangles = ps->Triangles;
+	ps->Triangles = profile_triangles;
+    }
+
+    dPtr->profile = prof;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Render profiling enabled, send SIGUSR2 for a summary\n");
+    return TRUE;
+}
+
+/* Called from the block handler to act on SIGUSR2 */
+void
+VNCProfileCheck(ScrnInfoPtr pScrn)
+{
+    VNCProfilePtr prof = VNCPTR(pScrn)->profile;
+
+    if (!prof || !profile_dump_requested)
+	return;
+    profile_dump_requested = 0;
+    profile_dump(pScrn, prof);
+}
+
+/*
+ * GCs wrapped here may outlive the screen's wrappers; their ops find
+ * dPtr->profile NULL and just pass through.
+ */
+void
+VNCProfileClose(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCProfilePtr prof = dPtr->profile;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+
+    if (!prof)
+	return;
+
+    profile_dump(pScrn, prof);
+    sigaction(SIGUSR2, &prof->oldAction, NULL);
+
+    pScreen->CreateGC = prof->CreateGC;
+    pScreen->CopyWindow = prof->CopyWindow;
+    pScreen->GetImage = prof->GetImage;
+    if (ps) {
+	ps->Composite = prof->Composite;
+	ps->Glyphs = prof->Glyphs;
+	ps->CompositeRects = prof->CompositeRects;
+	ps->Trapezoids = prof->Trapezoids;
+	ps->Triangles = prof->Triangles;
+    }
+
+    free(prof);
+    dPtr->profile = NULL;
+}
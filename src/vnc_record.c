@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Damage-driven session recorder.
+ *
+ * With the RecordFile option every published frame appends the 64x64
+ * tiles it damaged to a recording, along with resizes and the hardware
+ * cursor's position and image (see vncRecordFileHeader in vnc_export.h).
+ * A full keyframe is written at the start, after a resize and every
+ * RecordKeyframe seconds of activity, so that playback can start part
+ * way through.  The cost therefore follows how much of the screen
+ * changes rather than its size.
+ *
+ * Records are built in the main thread, which only copies pixels, and
+ * written by a background thread so that dispatch never waits for the
+ * disk.  If the disk falls too far behind, records are dropped and the
+ * next frame is written as a keyframe instead.  tools/vnc-record-export.c
+ * turns a recording into video.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+#define RECORD_TILE VNC_TILE_SIZE
+#define RECORD_QUEUE_MAX (64 << 20)     /* bytes waiting for the writer */
+#define RECORD_CURSOR_SIZE 64           /* as given to VNCCursorInit */
+#define RECORD_CURSOR_BYTES (RECORD_CURSOR_SIZE * RECORD_CURSOR_SIZE / 4)
+
+typedef struct _vncRecordChunk {
+    struct _vncRecordChunk *next;
+    size_t size;
+    unsigned char data[];
+} vncRecordChunk;
+
+typedef struct _vncRecordState {
+    ScrnInfoPtr pScrn;
+    int fd;
+    uint64_t start;             /* CLOCK_MONOTONIC of startTime */
+
+    /* shared with the writer thread */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    vncRecordChunk *head, *tail;
+    size_t queued;
+    Bool stop;
+    int error;                  /* errno of a failed write */
+
+    int width, height;
+    int tilesX, tilesY;
+    unsigned char *dirty;       /* per tile, scratch for a frame */
+    Bool keyframe;              /* the next frame must be a keyframe */
+    CARD32 lastKeyframe;
+    uint64_t dropped;
+
+    Bool haveCursorImage;
+    unsigned char cursorImage[RECORD_CURSOR_BYTES];
+} VNCRecordRec;
+
+static uint64_t
+record_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static Bool
+record_write_all(int fd, const unsigned char *data, size_t size)
+{
+    while (size) {
+	ssize_t n = write(fd, data, size);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return FALSE;
+	}
+	data += n;
+	size -= n;
+    }
+    return TRUE;
+}
+
+static void *
+record_thread(void *closure)
+{
+    VNCRecordPtr rec = closure;
+
+    pthread_mutex_lock(&rec->lock);
+    for (;;) {
+	vncRecordChunk *chunk;
+
+	while (!rec->head && !rec->stop)
+	    pthread_cond_wait(&rec->cond, &rec->lock);
+	chunk = rec->head;
+	if (!chunk)
+	    break;
+	rec->head = chunk->next;
+	if (!rec->head)
+	    rec->tail = NULL;
+	pthread_mutex_unlock(&rec->lock);
+
+	if (!rec->error && !record_write_all(rec->fd, chunk->data, chunk->size))
+	    rec->error = errno;
+
+	pthread_mutex_lock(&rec->lock);
+	rec->queued -= chunk->size;
+	free(chunk);
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
+
+/* A chunk starting with a record header for size bytes of payload */
+static vncRecordChunk *
+record_chunk(VNCRecordPtr rec, uint32_t type, size_t size)
+{
+    vncRecordChunk *chunk;
+    vncRecordHeader *header;
+
+    chunk = malloc(sizeof(*chunk) + sizeof(*header) + size);
+    if (!chunk)
+	return NULL;
+    chunk->next = NULL;
+    chunk->size = sizeof(*header) + size;
+
+    header = (vncRecordHeader *)chunk->data;
+    header->sync = VNC_RECORD_SYNC;
+    header->type = type;
+    header->size = size;
+    header->reserved = 0;
+    header->time = record_monotonic() - rec->start;
+    return chunk;
+}
+
+static void *
+record_payload(vncRecordChunk *chunk)
+{
+    return chunk->data + sizeof(vncRecordHeader);
+}
+
+/*
+ * Hand chunks to the writer, or drop them all if too much is already
+ * waiting, so that a keyframe is never written without the records before
+ * it.  A NULL chunk is one that could not be allocated.  After a drop the
+ * next frame is a keyframe, so nothing is lost for good.
+ */
+static void
+record_queue(VNCRecordPtr rec, vncRecordChunk **chunks, int n)
+{
+    size_t size = 0;
+    Bool drop = FALSE;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (!chunks[i])
+	    drop = TRUE;
+	else
+	    size += chunks[i]->size;
+    }
+
+    if (!drop) {
+	pthread_mutex_lock(&rec->lock);
+	drop = rec->queued && rec->queued + size > RECORD_QUEUE_MAX;
+	if (!drop) {
+	    for (i = 0; i < n; i++) {
+		if (rec->tail)
+		    rec->tail->next = chunks[i];
+		else
+		    rec->head = chunks[i];
+		rec->tail = chunks[i];
+	    }
+	    rec->queued += size;
+	    pthread_cond_signal(&rec->cond);
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	if (drop) {
+	    rec->dropped++;
+	    VNC_PROBE1(record_drop, rec->dropped);
+	}
+    }
+
+    if (drop) {
+	for (i = 0; i < n; i++)
+	    free(chunks[i]);
+	rec->keyframe = TRUE;
+    }
+}
+
+static Bool
+record_resize(VNCRecordPtr rec)
+{
+    ScrnInfoPtr pScrn = rec->pScrn;
+    int tilesX = (pScrn->virtualX + RECORD_TILE - 1) / RECORD_TILE;
+    int tilesY = (pScrn->virtualY + RECORD_TILE - 1) / RECORD_TILE;
+    unsigned char *dirty;
+
+    dirty = calloc((size_t)tilesX * tilesY, 1);
+    if (!dirty)
+	return FALSE;
+
+    free(rec->dirty);
+    rec->dirty = dirty;
+    rec->width = pScrn->virtualX;
+    rec->height = pScrn->virtualY;
+    rec->tilesX = tilesX;
+    rec->tilesY = tilesY;
+    return TRUE;
+}
+
+static vncRecordChunk *
+record_cursor(VNCRecordPtr rec)
+{
+    VNCPtr dPtr = VNCPTR(rec->pScrn);
+    vncRecordChunk *chunk;
+    vncRecordCursor *cursor;
+
+    chunk = record_chunk(rec, VNC_RECORD_CURSOR, sizeof(*cursor));
+    if (chunk) {
+	cursor = record_payload(chunk);
+	cursor->x = dPtr->cursorX;
+	cursor->y = dPtr->cursorY;
+	cursor->visible = dPtr->VncHWCursorShown;
+    }
+    return chunk;
+}
+
+static vncRecordChunk *
+record_cursor_image(VNCRecordPtr rec)
+{
+    VNCPtr dPtr = VNCPTR(rec->pScrn);
+    vncRecordChunk *chunk;
+    vncRecordCursorImage *image;
+
+    chunk = record_chunk(rec, VNC_RECORD_CURSOR_IMAGE,
+                         sizeof(*image) + RECORD_CURSOR_BYTES);
+    if (chunk) {
+	image = record_payload(chunk);
+	image->width = RECORD_CURSOR_SIZE;
+	image->height = RECORD_CURSOR_SIZE;
+	image->fg = dPtr->cursorFG;
+	image->bg = dPtr->cursorBG;
+	memcpy(image + 1, rec->cursorImage, RECORD_CURSOR_BYTES);
+    }
+    return chunk;
+}
+
+/* Whether a 32bpp tile is a single colour */
+static Bool
+record_tile_solid(const unsigned char *src, int stride, int w, int h)
+{
+    uint32_t first = *(const uint32_t *)src;
+    int x, y;
+
+    for (y = 0; y < h; y++, src += stride) {
+	const uint32_t *row = (const uint32_t *)src;
+
+	for (x = 0; x < w; x++) {
+	    if (row[x] != first)
+		return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+/* A tiles record of the tiles marked in rec->dirty, clearing them */
+static vncRecordChunk *
+record_tiles(VNCRecordPtr rec, int numTiles, Bool keyframe)
+{
+    ScrnInfoPtr pScrn = rec->pScrn;
+    PixmapPtr pPixmap = pScrn->pScreen->GetScreenPixmap(pScrn->pScreen);
+    const unsigned char *pixels = pPixmap->devPrivate.ptr;
+    int stride = pPixmap->devKind;
+    int bpp = pScrn->bitsPerPixel;
+    size_t maxRow = ((RECORD_TILE * bpp + 31) / 32) * 4;
+    vncRecordChunk *chunk;
+    vncRecordTiles *tiles;
+    unsigned char *out;
+    int i, y;
+
+    /* Sized for every tile being raw, then trimmed */
+    chunk = record_chunk(rec, VNC_RECORD_TILES,
+                         sizeof(*tiles) + numTiles *
+                         (sizeof(vncRecordTile) + maxRow * RECORD_TILE));
+    if (!chunk) {
+	memset(rec->dirty, 0, (size_t)rec->tilesX * rec->tilesY);
+	return NULL;
+    }
+
+    tiles = record_payload(chunk);
+    tiles->frame = VNCPTR(pScrn)->frame;
+    tiles->flags = keyframe ? VNC_RECORD_KEYFRAME : 0;
+    tiles->numTiles = numTiles;
+    out = (unsigned char *)(tiles + 1);
+
+    for (i = 0; i < rec->tilesX * rec->tilesY; i++) {
+	vncRecordTile *tile = (vncRecordTile *)out;
+	const unsigned char *src;
+	size_t row;
+
+	if (!rec->dirty[i])
+	    continue;
+	rec->dirty[i] = 0;
+
+	tile->x = (i % rec->tilesX) * RECORD_TILE;
+	tile->y = (i / rec->tilesX) * RECORD_TILE;
+	tile->width = min(RECORD_TILE, rec->width - tile->x);
+	tile->height = min(RECORD_TILE, rec->height - tile->y);
+	out += sizeof(*tile);
+
+	src = pixels + tile->y * stride + tile->x * bpp / 8;
+	row = ((tile->width * bpp + 31) / 32) * 4;
+	if (bpp == 32 &&
+	    record_tile_solid(src, stride, tile->width, tile->height)) {
+	    tile->encoding = VNC_RECORD_SOLID;
+	    memcpy(out, src, 4);
+	    out += 4;
+	} else {
+	    tile->encoding = 0;
+	    for (y = 0; y < tile->height; y++, src += stride, out += row) {
+		memcpy(out, src, tile->width * bpp / 8);
+		memset(out + tile->width * bpp / 8, 0,
+		       row - tile->width * bpp / 8);
+	    }
+	}
+    }
+
+    chunk->size = out - chunk->data;
+    ((vncRecordHeader *)chunk->data)->size = chunk->size -
+                                             sizeof(vncRecordHeader);
+    VNC_PROBE3(record_tiles, tiles->frame, numTiles, chunk->size);
+    return chunk;
+}
+
+Bool
+VNCRecordInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCRecordPtr rec;
+    vncRecordFileHeader header;
+    struct timeval tv;
+
+    rec = calloc(1, sizeof(*rec));
+    if (!rec)
+	return FALSE;
+    rec->pScrn = pScrn;
+    rec->keyframe = TRUE;
+
+    rec->fd = open(dPtr->recordFile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0600);
+    if (rec->fd < 0) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to open recording %s: %s\n",
+		   dPtr->recordFile, strerror(errno));
+	free(rec);
+	return FALSE;
+    }
+
+    /* A restarted server appends to the recording, from a new header */
+    memset(&header, 0, sizeof(header));
+    header.magic = VNC_RECORD_MAGIC;
+    header.version = VNC_RECORD_VERSION;
+    header.tileSize = RECORD_TILE;
+    header.bitsPerPixel = pScrn->bitsPerPixel;
+    header.depth = pScrn->depth;
+    header.redMask = pScrn->mask.red;
+    header.greenMask = pScrn->mask.green;
+    header.blueMask = pScrn->mask.blue;
+    gettimeofday(&tv, NULL);
+    header.startTime = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    rec->start = record_monotonic();
+
+    if (!record_resize(rec) ||
+	!record_write_all(rec->fd, (unsigned char *)&header, sizeof(header))) {
+	close(rec->fd);
+	free(rec->dirty);
+	free(rec);
+	return FALSE;
+    }
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    if (pthread_create(&rec->thread, NULL, record_thread, rec) != 0) {
+	pthread_cond_destroy(&rec->cond);
+	pthread_mutex_destroy(&rec->lock);
+	close(rec->fd);
+	free(rec->dirty);
+	free(rec);
+	return FALSE;
+    }
+
+    dPtr->record = rec;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Recording the session to %s\n",
+	       dPtr->recordFile);
+    return TRUE;
+}
+
+/* Whether a frame is due even without damage */
+Bool
+VNCRecordPending(ScrnInfoPtr pScrn)
+{
+    VNCRecordPtr rec = VNCPTR(pScrn)->record;
+
+    return rec && rec->keyframe;
+}
+
+/* Record the tiles damaged in this frame */
+void
+VNCRecordUpdate(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCRecordPtr rec = dPtr->record;
+    CARD32 now = GetTimeInMillis();
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    vncRecordChunk *chunk;
+    int numTiles = 0;
+    int tx, ty;
+
+    if (rec->error) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to write recording %s: %s\n",
+		   dPtr->recordFile, strerror(rec->error));
+	VNCRecordClose(pScrn);
+	return;
+    }
+
+    if (rec->width != pScrn->virtualX || rec->height != pScrn->virtualY) {
+	if (!record_resize(rec)) {
+	    VNCRecordClose(pScrn);
+	    return;
+	}
+	rec->keyframe = TRUE;
+    }
+    if (dPtr->recordKeyframe > 0 && RegionNotEmpty(region) &&
+	now - rec->lastKeyframe >= (CARD32)dPtr->recordKeyframe * 1000)
+	rec->keyframe = TRUE;
+
+    if (rec->keyframe) {
+	vncRecordChunk *chunks[4];
+	vncRecordResize *resize;
+	int numChunks = 0;
+
+	rec->keyframe = FALSE;
+	rec->lastKeyframe = now;
+
+	/* Everything needed to start playing from here, queued as one */
+	chunk = record_chunk(rec, VNC_RECORD_RESIZE, sizeof(*resize));
+	if (chunk) {
+	    resize = record_payload(chunk);
+	    resize->width = rec->width;
+	    resize->height = rec->height;
+	}
+	chunks[numChunks++] = chunk;
+	if (!dPtr->swCursor) {
+	    if (rec->haveCursorImage)
+		chunks[numChunks++] = record_cursor_image(rec);
+	    chunks[numChunks++] = record_cursor(rec);
+	}
+
+	numTiles = rec->tilesX * rec->tilesY;
+	memset(rec->dirty, 1, numTiles);
+	chunks[numChunks++] = record_tiles(rec, numTiles, TRUE);
+	record_queue(rec, chunks, numChunks);
+	return;
+    }
+
+    for (; n--; box++) {
+	int x1 = box->x1 / RECORD_TILE;
+	int y1 = box->y1 / RECORD_TILE;
+	int x2 = min((box->x2 - 1) / RECORD_TILE, rec->tilesX - 1);
+	int y2 = min((box->y2 - 1) / RECORD_TILE, rec->tilesY - 1);
+
+	for (ty = y1; ty <= y2; ty++) {
+	    unsigned char *dirty = &rec->dirty[ty * rec->tilesX];
+
+	    for (tx = x1; tx <= x2; tx++) {
+		if (!dirty[tx]) {
+		    dirty[tx] = 1;
+		    numTiles++;
+		}
+	    }
+	}
+    }
+    if (numTiles) {
+	chunk = record_tiles(rec, numTiles, FALSE);
+	record_queue(rec, &chunk, 1);
+    }
+}
+
+/* Called by the hardware cursor as it moves, shows or hides */
+void
+VNCRecordCursor(ScrnInfoPtr pScrn)
+{
+    VNCRecordPtr rec = VNCPTR(pScrn)->record;
+    vncRecordChunk *chunk = record_cursor(rec);
+
+    record_queue(rec, &chunk, 1);
+}
+
+/* Called with a new realized cursor image, or NULL for new colours */
+void
+VNCRecordCursorImage(ScrnInfoPtr pScrn, const unsigned char *image)
+{
+    VNCRecordPtr rec = VNCPTR(pScrn)->record;
+    vncRecordChunk *chunk;
+
+    if (image) {
+	memcpy(rec->cursorImage, image, RECORD_CURSOR_BYTES);
+	rec->haveCursorImage = TRUE;
+    }
+    if (!rec->haveCursorImage)
+	return;
+    chunk = record_cursor_image(rec);
+    record_queue(rec, &chunk, 1);
+}
+
+/* Waits for what is queued to be written */
+void
+VNCRecordClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCRecordPtr rec = dPtr->record;
+
+    if (!rec)
+	return;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->stop = TRUE;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+
+    if (rec->dropped)
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Recording fell behind %llu times\n",
+		   (unsigned long long)rec->dropped);
+
+    pthread_cond_destroy(&rec->cond);
+    pthread_mutex_destroy(&rec->lock);
+    close(rec->fd);
+    free(rec->dirty);
+    free(rec);
+    dPtr->record = NULL;
+}
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Render acceleration for the VNC virtual framebuffer driver.
+ *
+ * Glyphs are copied once into a persistent a8 atlas, so compositing a run
+ * of text only touches the atlas and the framebuffer.  The common case of
+ * a solid source composited with PictOpOver onto a 32bpp picture is done
+ * here with the kernels in vnc_simd.c; anything else goes to fb.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "fb.h"
+#include "picturestr.h"
+#include "glyphstr.h"
+
+#include "vnc.h"
+#include "vnc_simd.h"
+#include "vnc_trace.h"
+
+/* Atlas dimensions and the largest glyph kept in it */
+#define VNC_ATLAS_SIZE 1024
+#define VNC_ATLAS_MAX_GLYPH 128
+
+/* Largest mask built for a run of glyphs with a mask format, in pixels */
+#define VNC_GLYPH_MASK_MAX (512 * 1024)
+
+typedef struct _vncGlyphAtlas {
+    CARD8 *bits;
+    CARD32 generation;
+    int shelfX, shelfY, shelfHeight;
+
+    CARD8 *mask;
+    size_t maskSize;
+} VNCGlyphAtlasRec;
+
+/* Where a glyph lives in the atlas, valid while generation matches */
+typedef struct {
+    CARD32 generation;
+    CARD16 x, y;
+} VNCGlyphRec, *VNCGlyphPtr;
+
+static DevPrivateKeyRec vncGlyphKeyRec;
+
+#if BITMAP_BIT_ORDER == MSBFirst
+#define A1_BIT(row, x) (((row)[(x) >> 3] >> (7 - ((x) & 7))) & 1)
+#else
+#define A1_BIT(row, x) (((row)[(x) >> 3] >> ((x) & 7)) & 1)
+#endif
+
+static void
+vncAtlasReset(VNCGlyphAtlasPtr atlas)
+{
+    if (++atlas->generation == 0)
+	atlas->generation = 1;
+    atlas->shelfX = atlas->shelfY = atlas->shelfHeight = 0;
+}
+
+static Bool
+vncGlyphSupported(ScreenPtr pScreen, GlyphPtr glyph)
+{
+    PicturePtr pPicture;
+
+    if (glyph->info.width > VNC_ATLAS_MAX_GLYPH ||
+        glyph->info.height > VNC_ATLAS_MAX_GLYPH)
+	return FALSE;
+
+    pPicture = GetGlyphPicture(glyph, pScreen);
+    if (!pPicture || pPicture->componentAlpha || !pPicture->pDrawable ||
+        pPicture->pDrawable->type != DRAWABLE_PIXMAP)
+	return FALSE;
+
+    switch (pPicture->format) {
+    case PICT_a1:
+    case PICT_a8:
+    case PICT_a8r8g8b8:
+	return TRUE;
+    default:
+	return FALSE;
+    }
+}
+
+/* Return the atlas slot for a glyph, uploading it first if needed */
+static VNCGlyphPtr
+vncAtlasGlyph(ScreenPtr pScreen, VNCGlyphAtlasPtr atlas, GlyphPtr glyph)
+{
+    VNCGlyphPtr priv = dixGetPrivateAddr(&glyph->devPrivates, &vncGlyphKeyRec);
+    int width = glyph->info.width;
+    int height = glyph->info.height;
+    PicturePtr pPicture;
+    PixmapPtr pPixmap;
+    CARD8 *src, *dst;
+    int x, y;
+
+    if (priv->generation == atlas->generation)
+	return priv;
+
+    /* Shelf packing; start over once the atlas is full */
+    if (atlas->shelfX + width > VNC_ATLAS_SIZE) {
+	atlas->shelfY += atlas->shelfHeight;
+	atlas->shelfX = 0;
+	atlas->shelfHeight = 0;
+    }
+    if (atlas->shelfY + height > VNC_ATLAS_SIZE)
+	vncAtlasReset(atlas);
+
+    priv->x = atlas->shelfX;
+    priv->y = atlas->shelfY;
+    priv->generation = atlas->generation;
+    atlas->shelfX += width;
+    if (height > atlas->shelfHeight)
+	atlas->shelfHeight = height;
+
+    pPicture = GetGlyphPicture(glyph, pScreen);
+    pPixmap = (PixmapPtr)pPicture->pDrawable;
+    src = pPixmap->devPrivate.ptr;
+    dst = atlas->bits + priv->y * VNC_ATLAS_SIZE + priv->x;
+
+    for (y = 0; y < height; y++) {
+	switch (pPicture->format) {
+	case PICT_a8:
+	    memcpy(dst, src, width);
+	    break;
+	case PICT_a1:
+	    for (x = 0; x < width; x++)
+		dst[x] = A1_BIT(src, x) ? 0xff : 0;
+	    break;
+	case PICT_a8r8g8b8:
+	    /* Without component alpha only the glyph's alpha is used */
+	    for (x = 0; x < width; x++)
+		dst[x] = ((CARD32 *)src)[x] >> 24;
+	    break;
+	}
+	src += pPixmap->devKind;
+	dst += VNC_ATLAS_SIZE;
+    }
+
+    return priv;
+}
+
+static Bool
+vncSolidColor(PicturePtr pSrc, CARD32 *color)
+{
+    PixmapPtr pPixmap;
+
+    if (pSrc->alphaMap)
+	return FALSE;
+
+    if (pSrc->pSourcePict) {
+	if (pSrc->pSourcePict->type != SourcePictTypeSolidFill)
+	    return FALSE;
+	*color = pSrc->pSourcePict->solidFill.color;
+	return TRUE;
+    }
+
+    if (!pSrc->pDrawable || !pSrc->repeat ||
+        pSrc->pDrawable->type != DRAWABLE_PIXMAP ||
+        pSrc->pDrawable->width != 1 || pSrc->pDrawable->height != 1)
+	return FALSE;
+
+    pPixmap = (PixmapPtr)pSrc->pDrawable;
+    switch (pSrc->format) {
+    case PICT_a8r8g8b8:
+	*color = *(CARD32 *)pPixmap->devPrivate.ptr;
+	return TRUE;
+    case PICT_x8r8g8b8:
+	*color = *(CARD32 *)pPixmap->devPrivate.ptr | 0xff000000;
+	return TRUE;
+    default:
+	return FALSE;
+    }
+}
+
+/* Composite a mask, placed at (x, y) in screen coordinates, through the clip */
+static void
+vncCompositeMask(PicturePtr pDst, CARD32 color, const CARD8 *mask,
+                 int maskStride, int x, int y, int width, int height)
+{
+    RegionPtr clip = pDst->pCompositeClip;
+    BoxPtr box = RegionRects(clip);
+    int nbox = RegionNumRects(clip);
+    FbBits *dstBits;
+    FbStride dstStride;
+    int dstBpp, dstXoff, dstYoff;
+
+    if (x >= clip->extents.x2 || y >= clip->extents.y2 ||
+        x + width <= clip->extents.x1 || y + height <= clip->extents.y1)
+	return;
+
+    fbGetDrawable(pDst->pDrawable, dstBits, dstStride, dstBpp,
+                  dstXoff, dstYoff);
+
+    for (; nbox--; box++) {
+	int x1 = max(x, box->x1);
+	int y1 = max(y, box->y1);
+	int x2 = min(x + width, box->x2);
+	int y2 = min(y + height, box->y2);
+
+	if (x1 >= x2 || y1 >= y2)
+	    continue;
+
+	vncOverSolidMask((uint32_t *)dstBits + (y1 + dstYoff) * dstStride +
+	                 x1 + dstXoff, dstStride,
+	                 mask + (y1 - y) * maskStride + (x1 - x), maskStride,
+	                 color, x2 - x1, y2 - y1);
+    }
+}
+
+static Bool
+vncGlyphsFast(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+              PictFormatPtr maskFormat, int nlist, GlyphListPtr list,
+              GlyphPtr *glyphs)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    VNCGlyphAtlasPtr atlas = VNCPTR(xf86ScreenToScrn(pScreen))->glyphAtlas;
+    BoxRec extents = { MAXSHORT, MAXSHORT, MINSHORT, MINSHORT };
+    GlyphListPtr l;
+    GlyphPtr *g;
+    CARD32 color;
+    int x, y, n, i;
+
+    if (op != PictOpOver || !vncSolidColor(pSrc, &color))
+	return FALSE;
+
+    if (pDst->alphaMap || pDst->pDrawable->bitsPerPixel != 32)
+	return FALSE;
+
+    /* The kernels need alpha in the top byte; swap red and blue to match
+     * a framebuffer laid out by the PixelFormat option */
+    switch (pDst->format) {
+    case PICT_a8r8g8b8:
+    case PICT_x8r8g8b8:
+	break;
+    case PICT_a8b8g8r8:
+    case PICT_x8b8g8r8:
+	color = (color & 0xff00ff00) | ((color >> 16) & 0xff) |
+	        ((color & 0xff) << 16);
+	break;
+    default:
+	return FALSE;
+    }
+
+    if (maskFormat && maskFormat->format != PICT_a8)
+	return FALSE;
+
+    /* Check every glyph before drawing anything, noting the run extents */
+    x = y = 0;
+    for (l = list, g = glyphs, i = nlist; i--; l++) {
+	x += l->xOff;
+	y += l->yOff;
+	for (n = l->len; n--; g++) {
+	    GlyphPtr glyph = *g;
+
+	    if (glyph->info.width && glyph->info.height) {
+		if (!vncGlyphSupported(pScreen, glyph))
+		    return FALSE;
+		extents.x1 = min(extents.x1, x - glyph->info.x);
+		extents.y1 = min(extents.y1, y - glyph->info.y);
+		extents.x2 = max(extents.x2, x - glyph->info.x + glyph->info.width);
+		extents.y2 = max(extents.y2, y - glyph->info.y + glyph->info.height);
+	    }
+	    x += glyph->info.xOff;
+	    y += glyph->info.yOff;
+	}
+    }
+
+    if (extents.x1 >= extents.x2 || extents.y1 >= extents.y2)
+	return TRUE;
+
+    if (maskFormat) {
+	/* Accumulate the whole run into one mask, then composite it once */
+	int width = extents.x2 - extents.x1;
+	int height = extents.y2 - extents.y1;
+	size_t size = (size_t)width * height;
+
+	if (size > VNC_GLYPH_MASK_MAX)
+	    return FALSE;
+	if (size > atlas->maskSize) {
+	    CARD8 *mask = realloc(atlas->mask, size);
+
+	    if (!mask)
+		return FALSE;
+	    atlas->mask = mask;
+	    atlas->maskSize = size;
+	}
+	memset(atlas->mask, 0, size);
+
+	x = y = 0;
+	for (l = list, g = glyphs, i = nlist; i--; l++) {
+	    x += l->xOff;
+	    y += l->yOff;
+	    for (n = l->len; n--; g++) {
+		GlyphPtr glyph = *g;
+
+		if (glyph->info.width && glyph->info.height) {
+		    VNCGlyphPtr priv = vncAtlasGlyph(pScreen, atlas, glyph);
+
+		    vncAddMask(atlas->mask +
+		               (y - glyph->info.y - extents.y1) * width +
+		               (x - glyph->info.x - extents.x1), width,
+		               atlas->bits + priv->y * VNC_ATLAS_SIZE + priv->x,
+		               VNC_ATLAS_SIZE,
+		               glyph->info.width, glyph->info.height);
+		}
+		x += glyph->info.xOff;
+		y += glyph->info.yOff;
+	    }
+	}
+
+	vncCompositeMask(pDst, color, atlas->mask, width,
+	                 pDst->pDrawable->x + extents.x1,
+	                 pDst->pDrawable->y + extents.y1, width, height);
+    } else {
+	x = pDst->pDrawable->x;
+	y = pDst->pDrawable->y;
+	for (l = list, g = glyphs, i = nlist; i--; l++) {
+	    x += l->xOff;
+	    y += l->yOff;
+	    for (n = l->len; n--; g++) {
+		GlyphPtr glyph = *g;
+
+		if (glyph->info.width && glyph->info.height) {
+		    VNCGlyphPtr priv = vncAtlasGlyph(pScreen, atlas, glyph);
+
+		    vncCompositeMask(pDst, color,
+		                     atlas->bits + priv->y * VNC_ATLAS_SIZE +
+		                     priv->x, VNC_ATLAS_SIZE,
+		                     x - glyph->info.x, y - glyph->info.y,
+		                     glyph->info.width, glyph->info.height);
+		}
+		x += glyph->info.xOff;
+		y += glyph->info.yOff;
+	    }
+	}
+    }
+
+    return TRUE;
+}
+
+static void
+vncGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+          PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+          int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+
+    VNC_PROBE2(glyphs_entry, op, nlist);
+
+    if (vncGlyphsFast(op, pSrc, pDst, maskFormat, nlist, list, glyphs)) {
+	VNC_PROBE1(glyphs_return, 1);
+	return;
+    }
+
+    ps->Glyphs = dPtr->Glyphs;
+    ps->Glyphs(op, pSrc, pDst, maskFormat, xSrc, ySrc, nlist, list, glyphs);
+    dPtr->Glyphs = ps->Glyphs;
+    ps->Glyphs = vncGlyphs;
+
+    VNC_PROBE1(glyphs_return, 0);
+}
+
+/*
+ * Must be called after fbPictureInit() and before anything that sets up
+ * Damage on the screen, so that Damage sees what is drawn here.
+ */
+Bool
+VNCRenderInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    VNCGlyphAtlasPtr atlas;
+
+    if (!ps)
+	return FALSE;
+
+    if (!dixRegisterPrivateKey(&vncGlyphKeyRec, PRIVATE_GLYPH,
+                               sizeof(VNCGlyphRec)))
+	return FALSE;
+
+    atlas = calloc(1, sizeof(VNCGlyphAtlasRec));
+    if (!atlas)
+	return FALSE;
+    atlas->bits = malloc(VNC_ATLAS_SIZE * VNC_ATLAS_SIZE);
+    if (!atlas->bits) {
+	free(atlas);
+	return FALSE;
+    }
+    vncAtlasReset(atlas);
+
+    vncSimdInit();
+
+    dPtr->glyphAtlas = atlas;
+    dPtr->Glyphs = ps->Glyphs;
+    ps->Glyphs = vncGlyphs;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Glyph atlas enabled (%s kernels)\n", vncSimdName());
+    return TRUE;
+}
+
+void
+VNCRenderClose(ScreenPtr pScreen)
+{
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+
+    if (!dPtr->glyphAtlas)
+	return;
+
+    if (ps && ps->Glyphs == vncGlyphs)
+	ps->Glyphs = dPtr->Glyphs;
+
+    free(dPtr->glyphAtlas->mask);
+    free(dPtr->glyphAtlas->bits);
+    free(dPtr->glyphAtlas);
+    dPtr->glyphAtlas = NULL;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Content-based scroll detection.
+ *
+ * Toolkits and browsers often scroll by drawing fresh pixels with PutImage
+ * rather than copying, which leaves the encoder to re-encode content it
+ * has already sent.  With the ScrollDetect option the driver keeps a hash
+ * of every row of each 64 pixel wide column strip of the screen, and of
+ * every column of each 64 pixel high row band.  When a strip or band is
+ * damaged its hashes are recomputed and matched against the previous ones
+ * at different offsets; runs that match are exported as copy hints (see
+ * vncScrollExport in vnc_export.h) that the encoder can send as CopyRect.
+ *
+ * Only whole strips and bands are matched, so a scrolling area is found
+ * where it covers them entirely.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_simd.h"
+#include "vnc_trace.h"
+
+#define SCROLL_STRIP VNC_TILE_SIZE
+#define SCROLL_MAX_SHIFT 1024   /* furthest shift looked for */
+#define SCROLL_MIN_RUN 16       /* shortest match worth a hint */
+#define SCROLL_MIN_DISTINCT 4   /* distinct hashes in a run, to skip flat areas */
+#define SCROLL_ANCHORS 4        /* places sampled for candidate shifts */
+
+typedef struct _vncScrollState {
+    VNCExportRec export;
+    int width, height;
+    int strips, bands;
+    uint32_t *rowHashes;        /* height per strip */
+    uint32_t *columnHashes;     /* width per band */
+    uint32_t *scratch;
+} VNCScrollRec;
+
+/*
+ * Length of the run starting at i where cur matches old moved by shift,
+ * counting the distinct values in it.
+ */
+static int
+scroll_run(const uint32_t *old, const uint32_t *cur, int size, int i, int end,
+	   int shift, int *distinct)
+{
+    int j;
+
+    *distinct = 0;
+    for (j = i; j < end && j - shift >= 0 && j - shift < size; j++) {
+	if (cur[j] != old[j - shift])
+	    break;
+	if (j == i || cur[j] != cur[j - 1])
+	    (*distinct)++;
+    }
+    return j - i;
+}
+
+/*
+ * Find the longest run in [start, end) of cur, the new hashes, matching
+ * old, the previous ones, moved by the same non-zero shift.  Both arrays
+ * hold size hashes.
+ */
+static Bool
+scroll_find(const uint32_t *old, const uint32_t *cur, int size,
+	    int start, int end, int *shift, int *runStart, int *runEnd)
+{
+    int candidates[SCROLL_ANCHORS];
+    int step = (end - start) / (SCROLL_ANCHORS + 1);
+    int n = 0, best = 0;
+    int i, c, d;
+
+    if (end - start < SCROLL_MIN_RUN)
+	return FALSE;
+
+    /* Sample a few changed places and look for their old position nearby */
+    for (i = start + step; i < end && n < SCROLL_ANCHORS; i += step) {
+	if (cur[i] == old[i] || (i > 0 && cur[i] == cur[i - 1]))
+	    continue;
+	for (d = 1; d <= SCROLL_MAX_SHIFT; d++) {
+	    if (i - d >= 0 && old[i - d] == cur[i]) {
+		candidates[n++] = d;
+		break;
+	    }
+	    if (i + d < size && old[i + d] == cur[i]) {
+		candidates[n++] = -d;
+		break;
+	    }
+	    if (i - d < 0 && i + d >= size)
+		break;
+	}
+    }
+
+    for (c = 0; c < n; c++) {
+	for (i = start; i < end; ) {
+	    int distinct;
+	    int len = scroll_run(old, cur, size, i, end, candidates[c],
+				 &distinct);
+
+	    if (len > best && len >= SCROLL_MIN_RUN &&
+		distinct >= SCROLL_MIN_DISTINCT) {
+		best = len;
+		*shift = candidates[c];
+		*runStart = i;
+		*runEnd = i + len;
+	    }
+	    i += len ? len : 1;
+	}
+    }
+    return best > 0;
+}
+
+static Bool
+scroll_overlaps(int x1, int y1, int w1, int h1, int x2, int y2, int w2, int h2)
+{
+    return x1 < x2 + w2 && x2 < x1 + w1 && y1 < y2 + h2 && y2 < y1 + h1;
+}
+
+/* Add a hint unless it overlaps one already found, merging with the last */
+static void
+scroll_add_hint(vncScrollExport *ex, int srcX, int srcY, int dstX, int dstY,
+		int width, int height)
+{
+    vncCopyHint *last = ex->numHints ? &ex->hints[ex->numHints - 1] : NULL;
+    uint32_t i;
+
+    for (i = 0; i < ex->numHints; i++) {
+	const vncCopyHint *hint = &ex->hints[i];
+
+	if (scroll_overlaps(hint->srcX, hint->srcY, hint->width, hint->height,
+			    srcX, srcY, width, height) ||
+	    scroll_overlaps(hint->srcX, hint->srcY, hint->width, hint->height,
+			    dstX, dstY, width, height) ||
+	    scroll_overlaps(hint->dstX, hint->dstY, hint->width, hint->height,
+			    srcX, srcY, width, height) ||
+	    scroll_overlaps(hint->dstX, hint->dstY, hint->width, hint->height,
+			    dstX, dstY, width, height))
+	    return;
+    }
+
+    if (last && last->dstY == dstY && last->height == height &&
+	last->srcY == srcY && last->dstX + (int)last->width == dstX &&
+	last->srcX + (int)last->width == srcX) {
+	last->width += width;
+	return;
+    }
+    if (last && last->dstX == dstX && last->width == width &&
+	last->srcX == srcX && last->dstY + (int)last->height == dstY &&
+	last->srcY + (int)last->height == srcY) {
+	last->height += height;
+	return;
+    }
+
+    if (ex->numHints < VNC_SCROLL_MAX_HINTS) {
+	vncCopyHint *hint = &ex->hints[ex->numHints++];
+
+	hint->srcX = srcX;
+	hint->srcY = srcY;
+	hint->dstX = dstX;
+	hint->dstY = dstY;
+	hint->width = width;
+	hint->height = height;
+    }
+}
+
+/* Hash the whole screen, for a new size */
+static Bool
+scroll_resize(ScrnInfoPtr pScrn, VNCScrollPtr sc, const uint32_t *pixels,
+	      int stride, uint32_t mask)
+{
+    int width = pScrn->virtualX, height = pScrn->virtualY;
+    int strips = (width + SCROLL_STRIP - 1) / SCROLL_STRIP;
+    int bands = (height + SCROLL_STRIP - 1) / SCROLL_STRIP;
+    uint32_t *rowHashes, *columnHashes, *scratch;
+    int i;
+
+    rowHashes = malloc((size_t)strips * height * sizeof(uint32_t));
+    columnHashes = malloc((size_t)bands * width * sizeof(uint32_t));
+    scratch = malloc(max(width, height) * sizeof(uint32_t));
+    if (!rowHashes || !columnHashes || !scratch) {
+	free(rowHashes);
+	free(columnHashes);
+	free(scratch);
+	return FALSE;
+    }
+
+    free(sc->rowHashes);
+    free(sc->columnHashes);
+    free(sc->scratch);
+    sc->rowHashes = rowHashes;
+    sc->columnHashes = columnHashes;
+    sc->scratch = scratch;
+    sc->width = width;
+    sc->height = height;
+    sc->strips = strips;
+    sc->bands = bands;
+
+    if (pixels) {
+	for (i = 0; i < strips; i++) {
+	    int x = i * SCROLL_STRIP;
+
+	    vncRowHash(pixels + x, stride, min(SCROLL_STRIP, width - x), height,
+		       mask, rowHashes + (size_t)i * height);
+	}
+	for (i = 0; i < bands; i++) {
+	    int y = i * SCROLL_STRIP;
+
+	    vncColumnHash(pixels + (size_t)y * stride, stride, width,
+			  min(SCROLL_STRIP, height - y), mask,
+			  columnHashes + (size_t)i * width);
+	}
+    }
+    return TRUE;
+}
+
+Bool
+VNCScrollInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    PixmapPtr pPixmap = pScrn->pScreen->GetScreenPixmap(pScrn->pScreen);
+    VNCScrollPtr sc;
+
+    if (pScrn->bitsPerPixel != 32) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Scroll detection needs a 32bpp framebuffer\n");
+	return FALSE;
+    }
+
+    sc = calloc(1, sizeof(*sc));
+    if (!sc)
+	return FALSE;
+
+    vncSimdInit();
+
+    if (!VNCExportMap(pScrn, &sc->export, "scroll", sizeof(vncScrollExport)) ||
+	!scroll_resize(pScrn, sc, pPixmap->devPrivate.ptr,
+		       pPixmap->devKind / sizeof(uint32_t),
+		       pScrn->mask.red | pScrn->mask.green | pScrn->mask.blue)) {
+	VNCExportUnmap(&sc->export);
+	free(sc);
+	return FALSE;
+    }
+    ((vncScrollExport *)sc->export.map)->magic = VNC_SCROLL_MAGIC;
+    ((vncScrollExport *)sc->export.map)->version = VNC_SCROLL_VERSION;
+
+    dPtr->scroll = sc;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Exporting scroll hints to %s (%s)\n",
+	       sc->export.path, vncSimdName());
+    return TRUE;
+}
+
+/* Look for moved content in the damaged strips and bands */
+void
+VNCScrollUpdate(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCScrollPtr sc = dPtr->scroll;
+    PixmapPtr pPixmap = pScrn->pScreen->GetScreenPixmap(pScrn->pScreen);
+    const uint32_t *pixels = pPixmap->devPrivate.ptr;
+    int stride = pPixmap->devKind / sizeof(uint32_t);
+    uint32_t mask = pScrn->mask.red | pScrn->mask.green | pScrn->mask.blue;
+    vncScrollExport *ex = sc->export.map;
+    RegionRec part;
+    int i;
+
+    vncExportBeginWrite(&ex->sequence);
+    ex->numHints = 0;
+    ex->frame = dPtr->frame;
+
+    if (sc->width != pScrn->virtualX || sc->height != pScrn->virtualY) {
+	if (!scroll_resize(pScrn, sc, pixels, stride, mask)) {
+	    vncExportEndWrite(&ex->sequence);
+	    VNCScrollClose(pScrn);
+	    return;
+	}
+	vncExportEndWrite(&ex->sequence);
+	return;
+    }
+
+    RegionNull(&part);
+
+    /* Vertical movement, one column strip at a time */
+    for (i = 0; i < sc->strips; i++) {
+	uint32_t *old = sc->rowHashes + (size_t)i * sc->height;
+	BoxRec strip, *ext;
+	int shift, start, end;
+
+	strip.x1 = i * SCROLL_STRIP;
+	strip.x2 = min(strip.x1 + SCROLL_STRIP, sc->width);
+	strip.y1 = 0;
+	strip.y2 = sc->height;
+	RegionReset(&part, &strip);
+	RegionIntersect(&part, &part, region);
+	if (!RegionNotEmpty(&part))
+	    continue;
+	ext = RegionExtents(&part);
+
+	memcpy(sc->scratch, old, sc->height * sizeof(uint32_t));
+	vncRowHash(pixels + (size_t)ext->y1 * stride + strip.x1, stride,
+		   strip.x2 - strip.x1, ext->y2 - ext->y1, mask,
+		   sc->scratch + ext->y1);
+	if (scroll_find(old, sc->scratch, sc->height, ext->y1, ext->y2,
+			&shift, &start, &end))
+	    scroll_add_hint(ex, strip.x1, start - shift, strip.x1, start,
+			    strip.x2 - strip.x1, end - start);
+	memcpy(old + ext->y1, sc->scratch + ext->y1,
+	       (ext->y2 - ext->y1) * sizeof(uint32_t));
+    }
+
+    /* Horizontal movement, one row band at a time */
+    for (i = 0; i < sc->bands; i++) {
+	uint32_t *old = sc->columnHashes + (size_t)i * sc->width;
+	BoxRec band, *ext;
+	int shift, start, end;
+
+	band.x1 = 0;
+	band.x2 = sc->width;
+	band.y1 = i * SCROLL_STRIP;
+	band.y2 = min(band.y1 + SCROLL_STRIP, sc->height);
+	RegionReset(&part, &band);
+	RegionIntersect(&part, &part, region);
+	if (!RegionNotEmpty(&part))
+	    continue;
+	ext = RegionExtents(&part);
+
+	memcpy(sc->scratch, old, sc->width * sizeof(uint32_t));
+	vncColumnHash(pixels + (size_t)band.y1 * stride + ext->x1, stride,
+		      ext->x2 - ext->x1, band.y2 - band.y1, mask,
+		      sc->scratch + ext->x1);
+	if (scroll_find(old, sc->scratch, sc->width, ext->x1, ext->x2,
+			&shift, &start, &end))
+	    scroll_add_hint(ex, start - shift, band.y1, start, band.y1,
+			    end - start, band.y2 - band.y1);
+	memcpy(old + ext->x1, sc->scratch + ext->x1,
+	       (ext->x2 - ext->x1) * sizeof(uint32_t));
+    }
+
+    RegionUninit(&part);
+    vncExportEndWrite(&ex->sequence);
+
+    VNC_PROBE2(scroll_hints, dPtr->frame, ex->numHints);
+}
+
+void
+VNCScrollClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCScrollPtr sc = dPtr->scroll;
+
+    if (!sc)
+	return;
+
+    VNCExportUnmap(&sc->export);
+    free(sc->rowHashes);
+    free(sc->columnHashes);
+    free(sc->scratch);
+    free(sc);
+    dPtr->scroll = NULL;
+}
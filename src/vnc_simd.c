@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Pixel kernels with generic C versions and, where the compiler supports
+ * it, AVX2 versions selected at run time.  Both produce identical results.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "vnc_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VNC_HAVE_AVX2 1
+#include <immintrin.h>
+#define VNC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define RB_MASK 0x00ff00ffU
+#define RB_ONE_HALF 0x00800080U
+#define RB_MASK_PLUS_ONE 0x10000100U
+
+/* x * a / 255 for each of the four channels of x */
+static inline uint32_t
+un8x4_mul_un8(uint32_t x, uint32_t a)
+{
+    uint32_t rb = (x & RB_MASK) * a + RB_ONE_HALF;
+    uint32_t ag = ((x >> 8) & RB_MASK) * a + RB_ONE_HALF;
+
+    rb = ((rb + ((rb >> 8) & RB_MASK)) >> 8) & RB_MASK;
+    ag = (ag + ((ag >> 8) & RB_MASK)) & ~RB_MASK;
+    return rb | ag;
+}
+
+/* Saturating x + y for each of the four channels */
+static inline uint32_t
+un8x4_add_un8x4(uint32_t x, uint32_t y)
+{
+    uint32_t rb = (x & RB_MASK) + (y & RB_MASK);
+    uint32_t ag = ((x >> 8) & RB_MASK) + ((y >> 8) & RB_MASK);
+
+    rb |= RB_MASK_PLUS_ONE - ((rb >> 8) & RB_MASK);
+    ag |= RB_MASK_PLUS_ONE - ((ag >> 8) & RB_MASK);
+    return (rb & RB_MASK) | ((ag & RB_MASK) << 8);
+}
+
+static inline uint32_t
+over_solid(uint32_t dst, uint32_t src, uint8_t mask)
+{
+    uint32_t s = un8x4_mul_un8(src, mask);
+
+    return un8x4_add_un8x4(s, un8x4_mul_un8(dst, 255 - (s >> 24)));
+}
+
+static void
+over_solid_mask_c(uint32_t *dst, int dstStride,
+                  const uint8_t *mask, int maskStride,
+                  uint32_t src, int width, int height)
+{
+    int opaque = (src >> 24) == 0xff;
+    int x;
+
+    while (height--) {
+        for (x = 0; x < width; x++) {
+            uint8_t m = mask[x];
+
+            if (m == 0)
+                continue;
+            if (m == 0xff && opaque)
+                dst[x] = src;
+            else
+                dst[x] = over_solid(dst[x], src, m);
+        }
+        dst += dstStride;
+        mask += maskStride;
+    }
+}
+
+static void
+add_mask_c(uint8_t *dst, int dstStride, const uint8_t *src, int srcStride,
+           int width, int height)
+{
+    int x;
+
+    while (height--) {
+        for (x = 0; x < width; x++) {
+            unsigned int sum = dst[x] + src[x];
+
+            dst[x] = sum > 0xff ? 0xff : sum;
+        }
+        dst += dstStride;
+        src += srcStride;
+    }
+}
+
+/* Largest per-channel difference of neighbouring pixels in a gradient */
+#define GRADIENT_STEP 16
+
+typedef struct {
+    uint32_t colours[VNC_SIMD_MAX_COLOURS + 1];
+    unsigned int n, max;
+    uint32_t last;
+} palette_t;
+
+static inline void
+palette_add(palette_t *pal, uint32_t p)
+{
+    unsigned int i;
+
+    if (p == pal->last || pal->n > pal->max)
+        return;
+    pal->last = p;
+    for (i = 0; i < pal->n; i++) {
+        if (pal->colours[i] == p)
+            return;
+    }
+    pal->colours[pal->n++] = p;
+}
+
+static inline int
+is_gradient(uint32_t a, uint32_t b)
+{
+    int shift;
+
+    if (a == b)
+        return 0;
+    for (shift = 0; shift < 32; shift += 8) {
+        int d = (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+
+        if (d > GRADIENT_STEP || d < -GRADIENT_STEP)
+            return 0;
+    }
+    return 1;
+}
+
+static void
+palette_init(palette_t *pal, uint32_t first, unsigned int maxColours)
+{
+    pal->max = maxColours < VNC_SIMD_MAX_COLOURS ? maxColours
+                                                 : VNC_SIMD_MAX_COLOURS;
+    pal->colours[0] = first;
+    pal->last = first;
+    pal->n = 1;
+}
+
+static void
+analyse_tile_c(const uint32_t *pixels, int stride, int width, int height,
+               uint32_t mask, unsigned int maxColours, vncTileInfo *info)
+{
+    palette_t pal;
+    unsigned int gradient = 0;
+    int x;
+
+    palette_init(&pal, pixels[0] & mask, maxColours);
+    info->pairs = (unsigned int)(width - 1) * height;
+
+    while (height--) {
+        for (x = 0; x < width; x++) {
+            uint32_t p = pixels[x] & mask;
+
+            palette_add(&pal, p);
+            if (x + 1 < width)
+                gradient += is_gradient(p, pixels[x + 1] & mask);
+        }
+        pixels += stride;
+    }
+
+    info->colour = pal.colours[0];
+    info->colours = pal.n;
+    info->gradientPairs = gradient;
+}
+
+#define HASH_SEED 0x811c9dc5U
+#define HASH_PRIME 0x9e3779b1U
+
+static inline uint32_t
+hash_step(uint32_t h, uint32_t p)
+{
+    return (h ^ p) * HASH_PRIME;
+}
+
+static inline uint32_t
+hash_final(uint32_t h)
+{
+    return h ^ (h >> 15);
+}
+
+/* Each row is hashed as eight interleaved lanes, folded together */
+static inline uint32_t
+hash_fold(const uint32_t *lanes)
+{
+    uint32_t h = HASH_SEED;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        h = hash_step(h, lanes[i]);
+    return hash_final(h);
+}
+
+static void
+row_hash_c(const uint32_t *pixels, int stride, int width, int height,
+           uint32_t mask, uint32_t *hashes)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        uint32_t lanes[8];
+
+        for (x = 0; x < 8; x++)
+            lanes[x] = HASH_SEED;
+        for (x = 0; x < width; x++)
+            lanes[x & 7] = hash_step(lanes[x & 7], pixels[x] & mask);
+        hashes[y] = hash_fold(lanes);
+        pixels += stride;
+    }
+}
+
+static void
+column_hash_c(const uint32_t *pixels, int stride, int width, int height,
+              uint32_t mask, uint32_t *hashes)
+{
+    int x, y;
+
+    for (x = 0; x < width; x++)
+        hashes[x] = HASH_SEED;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++)
+            hashes[x] = hash_step(hashes[x], pixels[x] & mask);
+        pixels += stride;
+    }
+    for (x = 0; x < width; x++)
+        hashes[x] = hash_final(hashes[x]);
+}
+
+#ifdef VNC_HAVE_AVX2
+
+/* a * b / 255 for each 16-bit lane holding an 8-bit value */
+static inline VNC_TARGET_AVX2 __m256i
+mul_un8_avx2(__m256i a, __m256i b)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(a, b),
+                                 _mm256_set1_epi16(0x80));
+
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+/* Four pixels of over_solid(); s16 is the source widened to 16 bits */
+static inline VNC_TARGET_AVX2 void
+over_solid4_avx2(uint32_t *dst, uint32_t mask4, __m256i s16)
+{
+    const __m128i expand = _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1,
+                                         2, 2, 2, 2, 3, 3, 3, 3);
+    __m256i m16, s, a, d16, r;
+
+    m16 = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(_mm_cvtsi32_si128((int)mask4),
+                                                expand));
+    s = mul_un8_avx2(s16, m16);
+    a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+    d16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)dst));
+    r = _mm256_add_epi16(s, mul_un8_avx2(d16,
+                                         _mm256_sub_epi16(_mm256_set1_epi16(0xff),
+                                                          a)));
+    r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0xd8);
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(r));
+}
+
+static VNC_TARGET_AVX2 void
+over_solid_mask_avx2(uint32_t *dst, int dstStride,
+                     const uint8_t *mask, int maskStride,
+                     uint32_t src, int width, int height)
+{
+    const __m256i s16 = _mm256_cvtepu8_epi16(_mm_set1_epi32((int)src));
+    const __m256i solid = _mm256_set1_epi32((int)src);
+    int opaque = (src >> 24) == 0xff;
+
+    while (height--) {
+        uint32_t *d = dst;
+        const uint8_t *m = mask;
+        int w = width;
+
+        for (; w >= 8; w -= 8, d += 8, m += 8) {
+            uint64_t m8;
+
+            memcpy(&m8, m, sizeof(m8));
+            if (m8 == 0)
+                continue;
+            if (m8 == ~(uint64_t)0 && opaque) {
+                _mm256_storeu_si256((__m256i *)d, solid);
+                continue;
+            }
+            over_solid4_avx2(d, (uint32_t)m8, s16);
+            over_solid4_avx2(d + 4, (uint32_t)(m8 >> 32), s16);
+        }
+        for (; w > 0; w--, d++, m++) {
+            if (*m == 0)
+                continue;
+            if (*m == 0xff && opaque)
+                *d = src;
+            else
+                *d = over_solid(*d, src, *m);
+        }
+        dst += dstStride;
+        mask += maskStride;
+    }
+}
+
+static VNC_TARGET_AVX2 void
+add_mask_avx2(uint8_t *dst, int dstStride, const uint8_t *src, int srcStride,
+              int width, int height)
+{
+    while (height--) {
+        int x = 0;
+
+        for (; x + 32 <= width; x += 32) {
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + x));
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + x));
+
+            _mm256_storeu_si256((__m256i *)(dst + x), _mm256_adds_epu8(d, s));
+        }
+        for (; x < width; x++) {
+            unsigned int sum = dst[x] + src[x];
+
+            dst[x] = sum > 0xff ? 0xff : sum;
+        }
+        dst += dstStride;
+        src += srcStride;
+    }
+}
+
+static VNC_TARGET_AVX2 void
+analyse_tile_avx2(const uint32_t *pixels, int stride, int width, int height,
+                  uint32_t mask, unsigned int maxColours, vncTileInfo *info)
+{
+    const __m256i vmask = _mm256_set1_epi32((int)mask);
+    const __m256i step = _mm256_set1_epi8(GRADIENT_STEP);
+    const __m256i ones = _mm256_set1_epi32(-1);
+    palette_t pal;
+    unsigned int gradient = 0;
+
+    palette_init(&pal, pixels[0] & mask, maxColours);
+    info->pairs = (unsigned int)(width - 1) * height;
+
+    while (height--) {
+        int x = 0;
+
+        /* Eight pixels and their right-hand neighbours at a time */
+        for (; x + 9 <= width; x += 8) {
+            __m256i a = _mm256_and_si256(
+                _mm256_loadu_si256((const __m256i *)(pixels + x)), vmask);
+            __m256i b = _mm256_and_si256(
+                _mm256_loadu_si256((const __m256i *)(pixels + x + 1)), vmask);
+            __m256i d = _mm256_or_si256(_mm256_subs_epu8(a, b),
+                                        _mm256_subs_epu8(b, a));
+            __m256i small = _mm256_cmpeq_epi8(_mm256_min_epu8(d, step), d);
+            __m256i g = _mm256_andnot_si256(
+                _mm256_cmpeq_epi32(d, _mm256_setzero_si256()),
+                _mm256_cmpeq_epi32(small, ones));
+
+            gradient += __builtin_popcount(
+                _mm256_movemask_ps(_mm256_castsi256_ps(g)));
+
+            if (pal.n <= pal.max) {
+                __m256i same = _mm256_cmpeq_epi32(
+                    a, _mm256_set1_epi32((int)pal.last));
+
+                if (_mm256_movemask_ps(_mm256_castsi256_ps(same)) != 0xff) {
+                    uint32_t p[8];
+                    int i;
+
+                    _mm256_storeu_si256((__m256i *)p, a);
+                    for (i = 0; i < 8; i++)
+                        palette_add(&pal, p[i]);
+                }
+            }
+        }
+        for (; x < width; x++) {
+            uint32_t p = pixels[x] & mask;
+
+            palette_add(&pal, p);
+            if (x + 1 < width)
+                gradient += is_gradient(p, pixels[x + 1] & mask);
+        }
+        pixels += stride;
+    }
+
+    info->colour = pal.colours[0];
+    info->colours = pal.n;
+    info->gradientPairs = gradient;
+}
+
+static VNC_TARGET_AVX2 void
+row_hash_avx2(const uint32_t *pixels, int stride, int width, int height,
+              uint32_t mask, uint32_t *hashes)
+{
+    const __m256i vmask = _mm256_set1_epi32((int)mask);
+    const __m256i prime = _mm256_set1_epi32((int)HASH_PRIME);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        __m256i h = _mm256_set1_epi32((int)HASH_SEED);
+        uint32_t lanes[8];
+
+        for (x = 0; x + 8 <= width; x += 8) {
+            __m256i p = _mm256_and_si256(
+                _mm256_loadu_si256((const __m256i *)(pixels + x)), vmask);
+
+            h = _mm256_mullo_epi32(_mm256_xor_si256(h, p), prime);
+        }
+        _mm256_storeu_si256((__m256i *)lanes, h);
+        for (; x < width; x++)
+            lanes[x & 7] = hash_step(lanes[x & 7], pixels[x] & mask);
+        hashes[y] = hash_fold(lanes);
+        pixels += stride;
+    }
+}
+
+static VNC_TARGET_AVX2 void
+column_hash_avx2(const uint32_t *pixels, int stride, int width, int height,
+                 uint32_t mask, uint32_t *hashes)
+{
+    const __m256i vmask = _mm256_set1_epi32((int)mask);
+    const __m256i prime = _mm256_set1_epi32((int)HASH_PRIME);
+    int x = 0, y;
+
+    /* Eight columns at a time, walking down the rows */
+    for (; x + 8 <= width; x += 8) {
+        const uint32_t *p = pixels + x;
+        __m256i h = _mm256_set1_epi32((int)HASH_SEED);
+
+        for (y = 0; y < height; y++, p += stride)
+            h = _mm256_mullo_epi32(
+                _mm256_xor_si256(h, _mm256_and_si256(
+                    _mm256_loadu_si256((const __m256i *)p), vmask)),
+                prime);
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+        _mm256_storeu_si256((__m256i *)(hashes + x), h);
+    }
+    if (x < width)
+        column_hash_c(pixels + x, stride, width - x, height, mask, hashes + x);
+}
+
+#endif /* VNC_HAVE_AVX2 */
+
+vncOverSolidMaskProc vncOverSolidMask = over_solid_mask_c;
+vncAddMaskProc vncAddMask = add_mask_c;
+vncAnalyseTileProc vncAnalyseTile = analyse_tile_c;
+vncHashProc vncRowHash = row_hash_c;
+vncHashProc vncColumnHash = column_hash_c;
+
+static const char *vncSimdImpl = "generic";
+
+void
+vncSimdInit(void)
+{
+#ifdef VNC_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vncOverSolidMask = over_solid_mask_avx2;
+        vncAddMask = add_mask_avx2;
+        vncAnalyseTile = analyse_tile_avx2;
+        vncRowHash = row_hash_avx2;
+        vncColumnHash = column_hash_avx2;
+        vncSimdImpl = "AVX2";
+    }
+#endif
+}
+
+const char *
+vncSimdName(void)
+{
+    return vncSimdImpl;
+}
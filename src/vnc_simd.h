@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Pixel kernels used by the driver's fast paths.  These have no X server
+ * dependencies; vncSimdInit() picks the best implementation for the CPU.
+ */
+
+#ifndef VNC_SIMD_H
+#define VNC_SIMD_H
+
+#include <stdint.h>
+
+/*
+ * PictOpOver of a solid premultiplied a8r8g8b8 colour through an a8 mask
+ * onto 32bpp pixels.  dstStride is in pixels, maskStride in bytes.
+ */
+typedef void (*vncOverSolidMaskProc)(uint32_t *dst, int dstStride,
+                                     const uint8_t *mask, int maskStride,
+                                     uint32_t src, int width, int height);
+
+/* PictOpAdd of one a8 mask onto another (saturating) */
+typedef void (*vncAddMaskProc)(uint8_t *dst, int dstStride,
+                               const uint8_t *src, int srcStride,
+                               int width, int height);
+
+/* Content statistics of a block of pixels */
+typedef struct {
+    uint32_t colour;            /* the first pixel */
+    unsigned int colours;       /* distinct colours, at most maxColours + 1 */
+    unsigned int gradientPairs; /* neighbouring pixels differing slightly */
+    unsigned int pairs;
+} vncTileInfo;
+
+#define VNC_SIMD_MAX_COLOURS 63
+
+/*
+ * Count the distinct colours of 32bpp pixels, stopping at maxColours + 1
+ * (at most VNC_SIMD_MAX_COLOURS), and the horizontally neighbouring pairs
+ * that differ by a small step in each channel.  Only the bits set in mask
+ * are compared.  stride is in pixels.
+ */
+typedef void (*vncAnalyseTileProc)(const uint32_t *pixels, int stride,
+                                   int width, int height, uint32_t mask,
+                                   unsigned int maxColours, vncTileInfo *info);
+
+/*
+ * 32-bit hashes of each row (vncRowHash) or each column (vncColumnHash)
+ * of a block of 32bpp pixels, for matching content that has moved.  Only
+ * the bits set in mask are hashed.  stride is in pixels.
+ */
+typedef void (*vncHashProc)(const uint32_t *pixels, int stride,
+                            int width, int height, uint32_t mask,
+                            uint32_t *hashes);
+
+extern vncOverSolidMaskProc vncOverSolidMask;
+extern vncAddMaskProc vncAddMask;
+extern vncAnalyseTileProc vncAnalyseTile;
+extern vncHashProc vncRowHash;
+extern vncHashProc vncColumnHash;
+
+extern void vncSimdInit(void);
+extern const char *vncSimdName(void);
+
+#endif
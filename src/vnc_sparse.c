@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Sparse framebuffer for the VNC virtual framebuffer driver.
+ *
+ * With several outputs of different sizes the screen is the bounding box
+ * of every CRTC, much of which no output shows.  With the
+ * SparseFramebuffer option the framebuffer is an anonymous mapping
+ * reserved for the whole screen, and after each layout change the pages
+ * lying entirely outside the CRTCs (plus SparseMargin pixels around them)
+ * are handed back to the kernel.  VideoRam then limits the memory the
+ * CRTCs need rather than the size of the screen.
+ *
+ * Released pages read as the shared zero page, but the server still
+ * believes the windows there are painted.  When a CRTC moves or grows
+ * onto them, the area is exposed so that it is painted again.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "xf86.h"
+#include "xf86Crtc.h"
+#include "windowstr.h"
+
+#include "vnc.h"
+#include "vnc_trace.h"
+
+static uint32_t
+sparse_stride(ScrnInfoPtr pScrn, int width)
+{
+    return ((width * pScrn->bitsPerPixel + 31) / 32) * 4;
+}
+
+/*
+ * Mark in keep the pages of a width x height framebuffer under the
+ * enabled CRTCs and their margin, returning how many there are.  If
+ * replace is a CRTC index, box stands in for that CRTC (NULL if it is
+ * being switched off).  If kept is not NULL, the area under the CRTCs and
+ * their margin is left in it.
+ */
+static size_t
+sparse_mark(ScrnInfoPtr pScrn, int width, int height, int replace,
+            const BoxRec *box, unsigned char *keep, size_t pages,
+            RegionPtr kept)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+    size_t stride = sparse_stride(pScrn, width);
+    size_t pageSize = getpagesize();
+    size_t count = 0;
+    RegionRec area;
+    BoxPtr b;
+    int i, n, y;
+
+    RegionNull(&area);
+    for (i = 0; i < config->num_crtc; i++) {
+	xf86CrtcPtr crtc = config->crtc[i];
+	RegionRec r;
+	BoxRec c;
+
+	if (i == replace) {
+	    if (!box)
+		continue;
+	    c = *box;
+	} else {
+	    if (!crtc->enabled)
+		continue;
+	    c.x1 = crtc->x;
+	    c.y1 = crtc->y;
+	    if (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+		c.x2 = crtc->x + crtc->mode.VDisplay;
+		c.y2 = crtc->y + crtc->mode.HDisplay;
+	    } else {
+		c.x2 = crtc->x + crtc->mode.HDisplay;
+		c.y2 = crtc->y + crtc->mode.VDisplay;
+	    }
+	}
+
+	c.x1 = max(c.x1 - dPtr->sparseMargin, 0);
+	c.y1 = max(c.y1 - dPtr->sparseMargin, 0);
+	c.x2 = min(c.x2 + dPtr->sparseMargin, width);
+	c.y2 = min(c.y2 + dPtr->sparseMargin, height);
+	if (c.x1 >= c.x2 || c.y1 >= c.y2)
+	    continue;
+
+	RegionInit(&r, &c, 1);
+	RegionUnion(&area, &area, &r);
+	RegionUninit(&r);
+    }
+
+    /* The boxes of a region never overlap, so each page is counted once */
+    b = RegionRects(&area);
+    n = RegionNumRects(&area);
+    for (; n--; b++) {
+	for (y = b->y1; y < b->y2; y++) {
+	    size_t start = y * stride + b->x1 * pScrn->bitsPerPixel / 8;
+	    size_t end = y * stride + b->x2 * pScrn->bitsPerPixel / 8;
+	    size_t p;
+
+	    for (p = start / pageSize; p <= (end - 1) / pageSize; p++) {
+		if (p >= pages || keep[p / 8] & (1 << (p % 8)))
+		    continue;
+		keep[p / 8] |= 1 << (p % 8);
+		count++;
+	    }
+	}
+    }
+
+    if (kept)
+	RegionCopy(kept, &area);
+    RegionUninit(&area);
+    return count;
+}
+
+/*
+ * Bytes of a width x height framebuffer that stay committed for the
+ * current layout, or for the layout with CRTC replace moved to box.
+ */
+size_t
+VNCSparseCommitted(ScrnInfoPtr pScrn, int width, int height, int replace,
+                   const BoxRec *box)
+{
+    size_t pageSize = getpagesize();
+    size_t pages = ((size_t)sparse_stride(pScrn, width) * height +
+                    pageSize - 1) / pageSize;
+    unsigned char *keep;
+    size_t count;
+
+    keep = calloc((pages + 7) / 8, 1);
+    if (!keep)
+	return (size_t)-1;
+    count = sparse_mark(pScrn, width, height, replace, box, keep, pages,
+                        NULL);
+    free(keep);
+    return count * pageSize;
+}
+
+/* (Re)reserve the framebuffer for the current virtual size */
+void *
+VNCSparseMap(ScrnInfoPtr pScrn, size_t bytes)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    void *map;
+
+    if (dPtr->sparseMap)
+	map = mremap(dPtr->sparseMap, dPtr->sparseMapSize, bytes,
+	             MREMAP_MAYMOVE);
+    else
+	map = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		   "Failed to map sparse framebuffer: %s\n", strerror(errno));
+	return NULL;
+    }
+
+    /* A resized screen is exposed as a whole by the server */
+    if (dPtr->sparseMap) {
+	RegionEmpty(&dPtr->sparseReleased);
+	RegionEmpty(&dPtr->sparseExpose);
+    } else {
+	RegionNull(&dPtr->sparseReleased);
+	RegionNull(&dPtr->sparseExpose);
+    }
+
+    dPtr->sparseMap = map;
+    dPtr->sparseMapSize = bytes;
+    dPtr->sparseTrim = TRUE;
+    return map;
+}
+
+/*
+ * Note that a CRTC is being set to show box, so that any of it released
+ * by an earlier trim is exposed before the next.
+ */
+void
+VNCSparseCover(ScrnInfoPtr pScrn, const BoxRec *box)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    RegionRec covered;
+
+    if (!dPtr->sparseMap || RegionNil(&dPtr->sparseReleased))
+	return;
+
+    RegionInit(&covered, (BoxPtr)box, 1);
+    RegionIntersect(&covered, &covered, &dPtr->sparseReleased);
+    RegionSubtract(&dPtr->sparseReleased, &dPtr->sparseReleased, &covered);
+    RegionUnion(&dPtr->sparseExpose, &dPtr->sparseExpose, &covered);
+    RegionUninit(&covered);
+}
+
+/* Expose the part of each window visible in the region given as data */
+static int
+sparse_expose_window(WindowPtr pWin, void *data)
+{
+    RegionRec exposed;
+
+    if (!pWin->viewable)
+	return WT_DONTWALKCHILDREN;
+
+    RegionNull(&exposed);
+    RegionIntersect(&exposed, &pWin->clipList, (RegionPtr)data);
+    if (RegionNotEmpty(&exposed))
+	(*pWin->drawable.pScreen->WindowExposures)
+	    (WINDOW_EXPOSURES_ARGS(pWin, &exposed));
+    RegionUninit(&exposed);
+    return WT_WALKCHILDREN;
+}
+
+/*
+ * Release the pages outside the CRTCs and their margin, after exposing
+ * what CRTCs have moved onto since the last time.  Called from the block
+ * handler after a layout change, once the server has finished repainting
+ * the screen for it.
+ */
+void
+VNCSparseTrim(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    char *map = dPtr->sparseMap;
+    size_t pageSize = getpagesize();
+    size_t pages = (dPtr->sparseMapSize + pageSize - 1) / pageSize;
+    size_t committed, released = 0;
+    size_t p, run;
+    unsigned char *keep;
+    RegionRec kept;
+    BoxRec screen;
+
+    dPtr->sparseTrim = FALSE;
+    if (!map)
+	return;
+
+    if (RegionNotEmpty(&dPtr->sparseExpose)) {
+	VNC_PROBE1(sparse_expose, RegionNumRects(&dPtr->sparseExpose));
+	WalkTree(pScrn->pScreen, sparse_expose_window, &dPtr->sparseExpose);
+	RegionEmpty(&dPtr->sparseExpose);
+    }
+
+    keep = calloc((pages + 7) / 8, 1);
+    if (!keep)
+	return;
+    RegionNull(&kept);
+    committed = sparse_mark(pScrn, pScrn->virtualX, pScrn->virtualY, -1, NULL,
+                            keep, pages, &kept);
+
+    for (p = 0; p < pages; p = run) {
+	if (keep[p / 8] & (1 << (p % 8))) {
+	    run = p + 1;
+	    continue;
+	}
+	for (run = p + 1; run < pages && !(keep[run / 8] & (1 << (run % 8)));
+	     run++)
+	    ;
+	if (madvise(map + p * pageSize,
+	            min((run - p) * pageSize, dPtr->sparseMapSize - p * pageSize),
+	            MADV_DONTNEED) == 0)
+	    released += run - p;
+    }
+    free(keep);
+
+    /* Everything outside the kept area may now read as zero */
+    screen.x1 = screen.y1 = 0;
+    screen.x2 = pScrn->virtualX;
+    screen.y2 = pScrn->virtualY;
+    RegionReset(&dPtr->sparseReleased, &screen);
+    RegionSubtract(&dPtr->sparseReleased, &dPtr->sparseReleased, &kept);
+    RegionUninit(&kept);
+
+    VNC_PROBE2(sparse_trim, committed * pageSize, released * pageSize);
+}
+
+void
+VNCSparseUnmap(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+
+    if (dPtr->sparseMap) {
+	munmap(dPtr->sparseMap, dPtr->sparseMapSize);
+	RegionUninit(&dPtr->sparseReleased);
+	RegionUninit(&dPtr->sparseExpose);
+    }
+    dPtr->sparseMap = NULL;
+    dPtr->sparseMapSize = 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Per-tile content statistics for encoder selection.
+ *
+ * With the TileStats option the framebuffer is divided into tiles and,
+ * for every tile damaged in a frame, the driver exports its distinct
+ * colour count, whether it is solid, and how much of it is a smooth
+ * gradient (see vncTileStats in vnc_export.h).  The encoder can choose
+ * solid, palette or lossy encoding per tile from these without reading
+ * the pixels again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_simd.h"
+#include "vnc_trace.h"
+
+#define TILE_STATS_HEADER_SIZE 64
+
+typedef struct _vncTileStatsState {
+    VNCExportRec export;
+    int width, height;
+    int tilesX, tilesY;
+    CARD8 *dirty;               /* per tile, for the frame being published */
+} VNCTileStatsRec;
+
+static vncTileStatsHeader *
+tilestats_header(VNCTileStatsPtr ts)
+{
+    return ts->export.map;
+}
+
+static vncTileStats *
+tilestats_tiles(VNCTileStatsPtr ts)
+{
+    return (vncTileStats *)((char *)ts->export.map + TILE_STATS_HEADER_SIZE);
+}
+
+/* Lay the file out for the current screen size, clearing every tile */
+static Bool
+tilestats_resize(ScrnInfoPtr pScrn, VNCTileStatsPtr ts)
+{
+    int tilesX = (pScrn->virtualX + VNC_TILE_SIZE - 1) / VNC_TILE_SIZE;
+    int tilesY = (pScrn->virtualY + VNC_TILE_SIZE - 1) / VNC_TILE_SIZE;
+    size_t count = (size_t)tilesX * tilesY;
+    vncTileStatsHeader *header;
+    CARD8 *dirty;
+
+    if (ts->export.map)
+	vncExportBeginWrite(&tilestats_header(ts)->sequence);
+
+    dirty = realloc(ts->dirty, count);
+    if (!dirty)
+	return FALSE;
+    ts->dirty = dirty;
+
+    if (!VNCExportMap(pScrn, &ts->export, "tilestats",
+		      TILE_STATS_HEADER_SIZE + count * sizeof(vncTileStats)))
+	return FALSE;
+    ts->width = pScrn->virtualX;
+    ts->height = pScrn->virtualY;
+    ts->tilesX = tilesX;
+    ts->tilesY = tilesY;
+
+    header = tilestats_header(ts);
+    vncExportBeginWrite(&header->sequence);
+    header->magic = VNC_TILE_STATS_MAGIC;
+    header->version = VNC_TILE_STATS_VERSION;
+    header->headerSize = TILE_STATS_HEADER_SIZE;
+    header->tileSize = VNC_TILE_SIZE;
+    header->tilesX = tilesX;
+    header->tilesY = tilesY;
+    header->width = ts->width;
+    header->height = ts->height;
+    memset(tilestats_tiles(ts), 0, count * sizeof(vncTileStats));
+    vncExportEndWrite(&header->sequence);
+
+    return TRUE;
+}
+
+Bool
+VNCTileStatsInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCTileStatsPtr ts;
+
+    if (pScrn->bitsPerPixel != 32) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Tile statistics need a 32bpp framebuffer\n");
+	return FALSE;
+    }
+
+    ts = calloc(1, sizeof(*ts));
+    if (!ts)
+	return FALSE;
+
+    vncSimdInit();
+
+    if (!tilestats_resize(pScrn, ts)) {
+	VNCExportUnmap(&ts->export);
+	free(ts->dirty);
+	free(ts);
+	return FALSE;
+    }
+
+    dPtr->tileStatsState = ts;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Exporting tile statistics to %s (%s)\n",
+	       ts->export.path, vncSimdName());
+    return TRUE;
+}
+
+/* Recompute the statistics of every tile touched by region */
+void
+VNCTileStatsUpdate(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCTileStatsPtr ts = dPtr->tileStatsState;
+    PixmapPtr pPixmap = pScrn->pScreen->GetScreenPixmap(pScrn->pScreen);
+    const uint32_t *pixels = pPixmap->devPrivate.ptr;
+    int stride = pPixmap->devKind / sizeof(uint32_t);
+    uint32_t mask = pScrn->mask.red | pScrn->mask.green | pScrn->mask.blue;
+    vncTileStatsHeader *header;
+    vncTileStats *tiles;
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    int updated = 0;
+    int tx, ty;
+
+    if (ts->width != pScrn->virtualX || ts->height != pScrn->virtualY) {
+	if (!tilestats_resize(pScrn, ts)) {
+	    VNCTileStatsClose(pScrn);
+	    return;
+	}
+	memset(ts->dirty, 1, (size_t)ts->tilesX * ts->tilesY);
+    } else {
+	memset(ts->dirty, 0, (size_t)ts->tilesX * ts->tilesY);
+	for (; n--; box++) {
+	    for (ty = box->y1 / VNC_TILE_SIZE;
+		 ty <= (box->y2 - 1) / VNC_TILE_SIZE; ty++)
+		memset(ts->dirty + ty * ts->tilesX + box->x1 / VNC_TILE_SIZE,
+		       1, (box->x2 - 1) / VNC_TILE_SIZE -
+		          box->x1 / VNC_TILE_SIZE + 1);
+	}
+    }
+
+    header = tilestats_header(ts);
+    tiles = tilestats_tiles(ts);
+    vncExportBeginWrite(&header->sequence);
+
+    for (ty = 0; ty < ts->tilesY; ty++) {
+	int y = ty * VNC_TILE_SIZE;
+	int h = min(VNC_TILE_SIZE, ts->height - y);
+
+	for (tx = 0; tx < ts->tilesX; tx++) {
+	    vncTileStats *tile = &tiles[ty * ts->tilesX + tx];
+	    int x = tx * VNC_TILE_SIZE;
+	    int w = min(VNC_TILE_SIZE, ts->width - x);
+	    vncTileInfo info;
+
+	    if (!ts->dirty[ty * ts->tilesX + tx])
+		continue;
+
+	    vncAnalyseTile(pixels + y * stride + x, stride, w, h, mask,
+			   VNC_TILE_MAX_COLOURS, &info);
+	    tile->colour = info.colour;
+	    tile->colours = info.colours;
+	    tile->solid = info.colours == 1;
+	    tile->gradient = info.pairs ?
+		(uint16_t)((uint64_t)info.gradientPairs * 65535 / info.pairs) : 0;
+	    tile->frame = dPtr->frame;
+	    updated++;
+	}
+    }
+
+    header->frame = dPtr->frame;
+    vncExportEndWrite(&header->sequence);
+
+    VNC_PROBE2(tile_stats, dPtr->frame, updated);
+}
+
+void
+VNCTileStatsClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCTileStatsPtr ts = dPtr->tileStatsState;
+
+    if (!ts)
+	return;
+
+    VNCExportUnmap(&ts->export);
+    free(ts->dirty);
+    free(ts);
+    dPtr->tileStatsState = NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * USDT static tracepoints for the VNC virtual framebuffer driver, under
+ * the "vnc_drv" provider.  They are usable from perf and bpftrace (see
+ * tools/bpftrace) and are a single nop when not being traced.
+ */
+
+#ifndef VNC_TRACE_H
+#define VNC_TRACE_H
+
+#ifdef ENABLE_PROBES
+#include <sys/sdt.h>
+
+#define VNC_PROBE(name) DTRACE_PROBE(vnc_drv, name)
+#define VNC_PROBE1(name, a) DTRACE_PROBE1(vnc_drv, name, a)
+#define VNC_PROBE2(name, a, b) DTRACE_PROBE2(vnc_drv, name, a, b)
+#define VNC_PROBE3(name, a, b, c) DTRACE_PROBE3(vnc_drv, name, a, b, c)
+#define VNC_PROBE4(name, a, b, c, d) DTRACE_PROBE4(vnc_drv, name, a, b, c, d)
+#define VNC_PROBE5(name, a, b, c, d, e) \
+    DTRACE_PROBE5(vnc_drv, name, a, b, c, d, e)
+#else
+#define VNC_PROBE(name) do { } while (0)
+#define VNC_PROBE1(name, a) do { } while (0)
+#define VNC_PROBE2(name, a, b) do { } while (0)
+#define VNC_PROBE3(name, a, b, c) do { } while (0)
+#define VNC_PROBE4(name, a, b, c, d) do { } while (0)
+#define VNC_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Xv adaptor for the VNC virtual framebuffer driver.
+ *
+ * Video players otherwise convert YUV to RGB themselves, only for the
+ * encoder to convert the framebuffer back to YUV.  The adaptor takes
+ * I420, YV12, YUY2 and UYVY images and keeps each frame, unconverted, in
+ * a shared file together with its destination rectangle and clip list
+ * (see vncXvExport in vnc_export.h).  While a consumer shows the frames
+ * itself they go no further; otherwise they are converted, scaled and
+ * drawn into the framebuffer as a fallback.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+#ifdef XvExtension
+
+#include "fourcc.h"
+
+#define VIDEO_MAX_WIDTH 4096
+#define VIDEO_MAX_HEIGHT 4096
+#define VIDEO_NUM_PORTS 4
+#define VIDEO_HEARTBEAT_MS 1000
+
+typedef struct {
+    int index;
+    VNCExportRec export;
+    Bool exportFailed;          /* frames are only composited from now on */
+    uint64_t frame;
+} VNCPortPrivRec, *VNCPortPrivPtr;
+
+static XF86VideoEncodingRec VNCVideoEncodings[] = {
+    { 0, "XV_IMAGE", VIDEO_MAX_WIDTH, VIDEO_MAX_HEIGHT, { 1, 1 } }
+};
+
+static XF86VideoFormatRec VNCVideoFormats[] = {
+    { 16, TrueColor }, { 24, TrueColor }
+};
+
+static XF86ImageRec VNCVideoImages[] = {
+    XVIMAGE_YUY2,
+    XVIMAGE_YV12,
+    XVIMAGE_I420,
+    XVIMAGE_UYVY
+};
+
+static void
+VNCStopVideo(ScrnInfoPtr pScrn, pointer data, Bool shutdown)
+{
+    VNCPortPrivPtr pPriv = data;
+    vncXvExport *ex = pPriv->export.map;
+
+    if (ex && ex->active) {
+	vncExportBeginWrite(&ex->sequence);
+	ex->active = 0;
+	vncExportEndWrite(&ex->sequence);
+    }
+}
+
+static int
+VNCSetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 value,
+		    pointer data)
+{
+    return BadMatch;
+}
+
+static int
+VNCGetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 *value,
+		    pointer data)
+{
+    return BadMatch;
+}
+
+static void
+VNCQueryBestSize(ScrnInfoPtr pScrn, Bool motion,
+		 short vid_w, short vid_h, short drw_w, short drw_h,
+		 unsigned int *p_w, unsigned int *p_h, pointer data)
+{
+    *p_w = drw_w;
+    *p_h = drw_h;
+}
+
+static int
+VNCQueryImageAttributes(ScrnInfoPtr pScrn, int id,
+			unsigned short *w, unsigned short *h,
+			int *pitches, int *offsets)
+{
+    int size, tmp;
+
+    if (*w > VIDEO_MAX_WIDTH)
+	*w = VIDEO_MAX_WIDTH;
+    if (*h > VIDEO_MAX_HEIGHT)
+	*h = VIDEO_MAX_HEIGHT;
+
+    *w = (*w + 1) & ~1;
+    if (offsets)
+	offsets[0] = 0;
+
+    switch (id) {
+    case FOURCC_YV12:
+    case FOURCC_I420:
+	*h = (*h + 1) & ~1;
+	size = (*w + 3) & ~3;
+	if (pitches)
+	    pitches[0] = size;
+	size *= *h;
+	if (offsets)
+	    offsets[1] = size;
+	tmp = ((*w >> 1) + 3) & ~3;
+	if (pitches)
+	    pitches[1] = pitches[2] = tmp;
+	tmp *= (*h >> 1);
+	size += tmp;
+	if (offsets)
+	    offsets[2] = size;
+	size += tmp;
+	break;
+    case FOURCC_UYVY:
+    case FOURCC_YUY2:
+    default:
+	size = *w << 1;
+	if (pitches)
+	    pitches[0] = size;
+	size *= *h;
+	break;
+    }
+
+    return size;
+}
+
+static inline int
+video_clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Each 8-bit channel value in its place in a framebuffer pixel */
+typedef struct {
+    CARD32 red[256], green[256], blue[256];
+} VideoChannelLut;
+
+static void
+video_channel_lut(CARD32 *lut, CARD32 mask, int offset, int weight)
+{
+    int v;
+
+    for (v = 0; v < 256; v++) {
+	/* Depth 30 has 10-bit channels: widen rather than shift by < 0 */
+	CARD32 c = weight <= 8 ? (CARD32)v >> (8 - weight) :
+		   (CARD32)v << (weight - 8) | (CARD32)v >> (16 - weight);
+
+	lut[v] = (c << offset) & mask;
+    }
+}
+
+static inline CARD32
+video_pixel(const VideoChannelLut *lut, int Y, int U, int V)
+{
+    int c = 298 * (Y - 16) + 128, d = U - 128, e = V - 128;
+
+    return lut->red[video_clamp((c + 409 * e) >> 8)] |
+	   lut->green[video_clamp((c - 100 * d - 208 * e) >> 8)] |
+	   lut->blue[video_clamp((c + 516 * d) >> 8)];
+}
+
+/*
+ * Nearest-neighbour sampling without a division per pixel: the source
+ * position is kept as pos + frac / dst and advanced by src / dst.
+ */
+typedef struct {
+    int pos, frac;
+    int whole, rem, dst;
+} VideoStep;
+
+static void
+video_step_init(VideoStep *step, int srcStart, int src, int dst, int at)
+{
+    step->pos = srcStart + (int)((int64_t)at * src / dst);
+    step->frac = (int)((int64_t)at * src % dst);
+    step->whole = src / dst;
+    step->rem = src % dst;
+    step->dst = dst;
+}
+
+static inline void
+video_step(VideoStep *step)
+{
+    step->pos += step->whole;
+    step->frac += step->rem;
+    if (step->frac >= step->dst) {
+	step->frac -= step->dst;
+	step->pos++;
+    }
+}
+
+/*
+ * Convert n pixels of one source row, sampled from sx on.  Planar images
+ * have separate Y, U and V rows with half-width chroma; packed ones have
+ * two pixels in each four bytes, with the given offsets of Y, U and V.
+ */
+static void
+video_row_planar(CARD32 *out, int n, const CARD8 *yRow, const CARD8 *uRow,
+		 const CARD8 *vRow, VideoStep *sx, const VideoChannelLut *lut)
+{
+    for (; n--; video_step(sx)) {
+	int x = sx->pos;
+
+	*out++ = video_pixel(lut, yRow[x], uRow[x >> 1], vRow[x >> 1]);
+    }
+}
+
+static void
+video_row_packed(CARD32 *out, int n, const CARD8 *row, int yOff, int uOff,
+		 int vOff, VideoStep *sx, const VideoChannelLut *lut)
+{
+    for (; n--; video_step(sx)) {
+	int x = sx->pos;
+	const CARD8 *p = row + (x & ~1) * 2;
+
+	*out++ = video_pixel(lut, p[yOff + (x & 1) * 2], p[uOff], p[vOff]);
+    }
+}
+
+/*
+ * Fallback: convert the part of the image at src to RGB (BT.601), scaling
+ * it to dst with nearest-neighbour sampling, and write it into the
+ * pixmap behind pDraw within clipBoxes.
+ */
+static void
+video_composite(ScrnInfoPtr pScrn, DrawablePtr pDraw, int id,
+		const unsigned char *buf, const int *pitches,
+		const int *offsets, BoxPtr src, BoxPtr dst, RegionPtr clipBoxes)
+{
+    ScreenPtr pScreen = pScrn->pScreen;
+    PixmapPtr pPixmap;
+    BoxPtr box = RegionRects(clipBoxes);
+    int n = RegionNumRects(clipBoxes);
+    int srcW = src->x2 - src->x1, srcH = src->y2 - src->y1;
+    int dstW = dst->x2 - dst->x1, dstH = dst->y2 - dst->y1;
+    int xoff = 0, yoff = 0;
+    int bpp = pScrn->bitsPerPixel;
+    Bool planar = id == FOURCC_YV12 || id == FOURCC_I420;
+    int u = id == FOURCC_YV12 ? 2 : 1, v = id == FOURCC_YV12 ? 1 : 2;
+    int yOff = id == FOURCC_UYVY, uOff = id == FOURCC_UYVY ? 0 : 1;
+    int vOff = id == FOURCC_UYVY ? 2 : 3;
+    VideoChannelLut lut;
+    CARD32 tmp[256];
+
+    if (bpp != 32 && bpp != 16)
+	return;
+
+    if (pDraw->type == DRAWABLE_WINDOW)
+	pPixmap = pScreen->GetWindowPixmap((WindowPtr)pDraw);
+    else
+	pPixmap = (PixmapPtr)pDraw;
+#ifdef COMPOSITE
+    xoff = -pPixmap->screen_x;
+    yoff = -pPixmap->screen_y;
+#endif
+
+    video_channel_lut(lut.red, pScrn->mask.red, pScrn->offset.red,
+		      pScrn->weight.red);
+    video_channel_lut(lut.green, pScrn->mask.green, pScrn->offset.green,
+		      pScrn->weight.green);
+    video_channel_lut(lut.blue, pScrn->mask.blue, pScrn->offset.blue,
+		      pScrn->weight.blue);
+
+    for (; n--; box++) {
+	int x1 = max(box->x1, dst->x1), x2 = min(box->x2, dst->x2);
+	int y1 = max(box->y1, dst->y1), y2 = min(box->y2, dst->y2);
+	VideoStep sy;
+	int y;
+
+	if (x1 >= x2 || y1 >= y2)
+	    continue;
+
+	video_step_init(&sy, src->y1, srcH, dstH, y1 - dst->y1);
+	for (y = y1; y < y2; y++, video_step(&sy)) {
+	    int row = sy.pos;
+	    CARD8 *line = (CARD8 *)pPixmap->devPrivate.ptr +
+			  (y + yoff) * pPixmap->devKind;
+	    const CARD8 *yRow = buf + offsets[0] + row * pitches[0];
+	    const CARD8 *uRow = buf + offsets[u] + (row >> 1) * pitches[u];
+	    const CARD8 *vRow = buf + offsets[v] + (row >> 1) * pitches[v];
+	    VideoStep sx;
+	    int x = x1;
+
+	    video_step_init(&sx, src->x1, srcW, dstW, x1 - dst->x1);
+
+	    if (bpp == 32) {
+		CARD32 *out = (CARD32 *)line + x1 + xoff;
+
+		if (planar)
+		    video_row_planar(out, x2 - x1, yRow, uRow, vRow, &sx,
+				     &lut);
+		else
+		    video_row_packed(out, x2 - x1, buf + row * pitches[0],
+				     yOff, uOff, vOff, &sx, &lut);
+		continue;
+	    }
+
+	    /* At 16bpp convert a chunk at a time and narrow it */
+	    while (x < x2) {
+		CARD16 *out = (CARD16 *)line + x + xoff;
+		int i, count = min(x2 - x, 256);
+
+		if (planar)
+		    video_row_planar(tmp, count, yRow, uRow, vRow, &sx, &lut);
+		else
+		    video_row_packed(tmp, count, buf + row * pitches[0],
+				     yOff, uOff, vOff, &sx, &lut);
+		for (i = 0; i < count; i++)
+		    out[i] = tmp[i];
+		x += count;
+	    }
+	}
+    }
+
+    DamageDamageRegion(pDraw, clipBoxes);
+}
+
+/* Keep the frame and where it goes in the port's shared file */
+static Bool
+video_export(ScrnInfoPtr pScrn, VNCPortPrivPtr pPriv, int id,
+	     const unsigned char *buf, short width, short height,
+	     const int *pitches, const int *offsets, int size,
+	     BoxPtr src, BoxPtr dst, RegionPtr clipBoxes, Bool *composite)
+{
+    vncXvExport *ex;
+    BoxPtr box = RegionRects(clipBoxes);
+    int n = RegionNumRects(clipBoxes);
+    int i;
+
+    /* The error has been logged once; a retry every frame would flood */
+    if (pPriv->exportFailed)
+	return FALSE;
+
+    if (!pPriv->export.map || pPriv->export.size < VNC_XV_HEADER_SIZE + size) {
+	char name[16];
+
+	snprintf(name, sizeof(name), "xv-%d", pPriv->index);
+	if (!VNCExportMap(pScrn, &pPriv->export, name,
+			  VNC_XV_HEADER_SIZE + size)) {
+	    VNCExportUnmap(&pPriv->export);
+	    pPriv->exportFailed = TRUE;
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		       "Not exporting frames from Xv port %d\n", pPriv->index);
+	    return FALSE;
+	}
+    }
+    ex = pPriv->export.map;
+
+    vncExportBeginWrite(&ex->sequence);
+    ex->magic = VNC_XV_MAGIC;
+    ex->version = VNC_XV_VERSION;
+    ex->headerSize = VNC_XV_HEADER_SIZE;
+    ex->active = 1;
+    ex->frame = ++pPriv->frame;
+    ex->fourcc = id;
+    ex->width = width;
+    ex->height = height;
+    ex->dataSize = size;
+    for (i = 0; i < 3; i++) {
+	ex->pitches[i] = pitches[i];
+	ex->offsets[i] = offsets[i];
+    }
+    ex->srcX = src->x1;
+    ex->srcY = src->y1;
+    ex->srcWidth = src->x2 - src->x1;
+    ex->srcHeight = src->y2 - src->y1;
+    ex->dstX = dst->x1;
+    ex->dstY = dst->y1;
+    ex->dstWidth = dst->x2 - dst->x1;
+    ex->dstHeight = dst->y2 - dst->y1;
+
+    if (n > VNC_XV_MAX_CLIP) {
+	box = RegionExtents(clipBoxes);
+	n = 1;
+	*composite = TRUE;
+    }
+    for (i = 0; i < n; i++) {
+	ex->clip[i].x1 = box[i].x1;
+	ex->clip[i].y1 = box[i].y1;
+	ex->clip[i].x2 = box[i].x2;
+	ex->clip[i].y2 = box[i].y2;
+    }
+    ex->numClip = n;
+    memcpy((char *)ex + VNC_XV_HEADER_SIZE, buf, size);
+
+    /* Only a consumer heard from recently shows the frames itself */
+    if (GetTimeInMillis() - (CARD32)ex->consumerHeartbeat > VIDEO_HEARTBEAT_MS)
+	*composite = TRUE;
+    ex->composited = *composite;
+    vncExportEndWrite(&ex->sequence);
+    return TRUE;
+}
+
+static int
+VNCPutImage(ScrnInfoPtr pScrn,
+	    short src_x, short src_y, short drw_x, short drw_y,
+	    short src_w, short src_h, short drw_w, short drw_h,
+	    int id, unsigned char *buf, short width, short height,
+	    Bool sync, RegionPtr clipBoxes, pointer data, DrawablePtr pDraw)
+{
+    VNCPortPrivPtr pPriv = data;
+    unsigned short w = width, h = height;
+    int pitches[3] = { 0 }, offsets[3] = { 0 };
+    Bool composite = FALSE;
+    BoxRec src, dst;
+    int size;
+
+    if (src_w <= 0 || src_h <= 0 || drw_w <= 0 || drw_h <= 0)
+	return Success;
+
+    /* The image is padded to the size the client was told */
+    size = VNCQueryImageAttributes(pScrn, id, &w, &h, pitches, offsets);
+
+    src.x1 = src_x;
+    src.y1 = src_y;
+    src.x2 = min(src_x + src_w, width);
+    src.y2 = min(src_y + src_h, height);
+    dst.x1 = drw_x;
+    dst.y1 = drw_y;
+    dst.x2 = drw_x + drw_w;
+    dst.y2 = drw_y + drw_h;
+    if (src.x1 < 0 || src.y1 < 0 || src.x2 <= src.x1 || src.y2 <= src.y1)
+	return BadValue;
+
+    VNC_PROBE5(xv_put_image, id, width, height, drw_w, drw_h);
+
+    if (!video_export(pScrn, pPriv, id, buf, w, h, pitches, offsets,
+		      size, &src, &dst, clipBoxes, &composite))
+	composite = TRUE;
+
+    if (composite)
+	video_composite(pScrn, pDraw, id, buf, pitches, offsets, &src, &dst,
+			clipBoxes);
+
+    return Success;
+}
+
+static XF86VideoAdaptorPtr
+video_setup_adaptor(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    XF86VideoAdaptorPtr adapt;
+    VNCPortPrivPtr pPriv;
+    DevUnion *pPortPrivates;
+    int i;
+
+    adapt = xf86XVAllocateVideoAdaptorRec(pScrn);
+    pPortPrivates = calloc(VIDEO_NUM_PORTS, sizeof(DevUnion));
+    pPriv = calloc(VIDEO_NUM_PORTS, sizeof(VNCPortPrivRec));
+    if (!adapt || !pPortPrivates || !pPriv) {
+	if (adapt)
+	    xf86XVFreeVideoAdaptorRec(adapt);
+	free(pPortPrivates);
+	free(pPriv);
+	return NULL;
+    }
+
+    adapt->type = XvWindowMask | XvInputMask | XvImageMask;
+    adapt->flags = 0;
+    adapt->name = "VNC Video";
+    adapt->nEncodings = sizeof(VNCVideoEncodings) / sizeof(VNCVideoEncodings[0]);
+    adapt->pEncodings = VNCVideoEncodings;
+    adapt->nFormats = sizeof(VNCVideoFormats) / sizeof(VNCVideoFormats[0]);
+    adapt->pFormats = VNCVideoFormats;
+    adapt->nPorts = VIDEO_NUM_PORTS;
+    adapt->pPortPrivates = pPortPrivates;
+    for (i = 0; i < VIDEO_NUM_PORTS; i++) {
+	pPriv[i].index = i;
+	pPortPrivates[i].ptr = &pPriv[i];
+    }
+    adapt->nAttributes = 0;
+    adapt->pAttributes = NULL;
+    adapt->nImages = sizeof(VNCVideoImages) / sizeof(VNCVideoImages[0]);
+    adapt->pImages = VNCVideoImages;
+    adapt->StopVideo = VNCStopVideo;
+    adapt->SetPortAttribute = VNCSetPortAttribute;
+    adapt->GetPortAttribute = VNCGetPortAttribute;
+    adapt->QueryBestSize = VNCQueryBestSize;
+    adapt->PutImage = VNCPutImage;
+    adapt->QueryImageAttributes = VNCQueryImageAttributes;
+
+    return adapt;
+}
+
+static void
+video_free_adaptor(XF86VideoAdaptorPtr adapt)
+{
+    free(adapt->pPortPrivates[0].ptr);
+    free(adapt->pPortPrivates);
+    xf86XVFreeVideoAdaptorRec(adapt);
+}
+
+Bool
+VNCVideoInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VNCPtr dPtr = VNCPTR(pScrn);
+    XF86VideoAdaptorPtr adapt;
+
+    /* Xv of the previous server generation has finished with its ports */
+    if (dPtr->videoAdaptor) {
+	video_free_adaptor(dPtr->videoAdaptor);
+	dPtr->videoAdaptor = NULL;
+    }
+
+    adapt = video_setup_adaptor(pScreen);
+    if (!adapt)
+	return FALSE;
+
+    if (!xf86XVScreenInit(pScreen, &adapt, 1)) {
+	video_free_adaptor(adapt);
+	return FALSE;
+    }
+
+    dPtr->videoAdaptor = adapt;
+    return TRUE;
+}
+
+/*
+ * Remove the shared files.  The ports stay allocated, as Xv still stops
+ * them while it closes down after the driver.
+ */
+void
+VNCVideoClose(ScreenPtr pScreen)
+{
+    VNCPtr dPtr = VNCPTR(xf86ScreenToScrn(pScreen));
+    XF86VideoAdaptorPtr adapt = dPtr->videoAdaptor;
+    VNCPortPrivPtr pPriv;
+    int i;
+
+    if (!adapt)
+	return;
+
+    pPriv = adapt->pPortPrivates[0].ptr;
+    for (i = 0; i < adapt->nPorts; i++)
+	VNCExportUnmap(&pPriv[i].export);
+}
+
+#else
+
+Bool
+VNCVideoInit(ScreenPtr pScreen)
+{
+    return FALSE;
+}
+
+void
+VNCVideoClose(ScreenPtr pScreen)
+{
+}
+
+#endif /* XvExtension */
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Video region detection.
+ *
+ * A video playing in a browser updates one rectangle of the screen 25-60
+ * times a second, which the encoder would otherwise treat like any other
+ * content.  With the VideoDetect option the driver keeps, for each 64x64
+ * tile, a moving average of its update rate which decays once updates
+ * stop.  A few times a second connected areas of tiles updating at video
+ * rates are collected into rectangles, tracked from one pass to the next,
+ * and exported with a frame rate and confidence (see vncVideoExport in
+ * vnc_export.h) so that the encoder can use a video codec there.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+
+#include "vnc.h"
+#include "vnc_export.h"
+#include "vnc_trace.h"
+
+#define VIDEO_TILE VNC_TILE_SIZE
+#define VIDEO_EVAL_MS 200       /* interval between passes */
+#define VIDEO_MIN_FPS 10        /* slowest update rate counted as video */
+#define VIDEO_MIN_TILES 4       /* smallest region */
+#define VIDEO_STABLE_MS 2000    /* age at which a region is fully trusted */
+#define VIDEO_RATE_WEIGHT 0.25f /* weight of the newest interval in the average */
+
+typedef struct {
+    float rate;                 /* updates per second */
+    CARD32 last;                /* time of the last update */
+    CARD32 frame;               /* frame of the last update */
+} vncVideoTile;
+
+typedef struct _vncVideoDetectState {
+    VNCExportRec export;
+    int width, height;
+    int tilesX, tilesY;
+    vncVideoTile *tiles;
+    int *labels;                /* scratch for a pass */
+    int *stack;
+    CARD32 lastPass;
+    CARD32 updates;             /* damage reports seen */
+    uint32_t nextId;
+    int numRegions;
+    vncVideoRegion regions[VNC_VIDEO_MAX_REGIONS];
+    CARD32 firstSeen[VNC_VIDEO_MAX_REGIONS];
+} VNCVideoDetectRec;
+
+static Bool
+video_resize(ScrnInfoPtr pScrn, VNCVideoDetectPtr vd)
+{
+    int tilesX = (pScrn->virtualX + VIDEO_TILE - 1) / VIDEO_TILE;
+    int tilesY = (pScrn->virtualY + VIDEO_TILE - 1) / VIDEO_TILE;
+    size_t count = (size_t)tilesX * tilesY;
+    vncVideoTile *tiles;
+    int *labels, *stack;
+
+    tiles = calloc(count, sizeof(*tiles));
+    labels = malloc(count * sizeof(*labels));
+    stack = malloc(count * sizeof(*stack));
+    if (!tiles || !labels || !stack) {
+	free(tiles);
+	free(labels);
+	free(stack);
+	return FALSE;
+    }
+
+    free(vd->tiles);
+    free(vd->labels);
+    free(vd->stack);
+    vd->tiles = tiles;
+    vd->labels = labels;
+    vd->stack = stack;
+    vd->width = pScrn->virtualX;
+    vd->height = pScrn->virtualY;
+    vd->tilesX = tilesX;
+    vd->tilesY = tilesY;
+    vd->numRegions = 0;
+    return TRUE;
+}
+
+/* Fold an update of every tile touched by region into the heatmap */
+static void
+video_record(VNCVideoDetectPtr vd, RegionPtr region, CARD32 now)
+{
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    int tx, ty;
+
+    vd->updates++;
+    for (; n--; box++) {
+	int x1 = max(box->x1, 0) / VIDEO_TILE;
+	int y1 = max(box->y1, 0) / VIDEO_TILE;
+	int x2 = min((box->x2 - 1) / VIDEO_TILE, vd->tilesX - 1);
+	int y2 = min((box->y2 - 1) / VIDEO_TILE, vd->tilesY - 1);
+
+	for (ty = y1; ty <= y2; ty++) {
+	    for (tx = x1; tx <= x2; tx++) {
+		vncVideoTile *tile = &vd->tiles[ty * vd->tilesX + tx];
+		CARD32 dt;
+
+		/* Once per damage report */
+		if (tile->frame == vd->updates)
+		    continue;
+		tile->frame = vd->updates;
+
+		dt = max(now - tile->last, 1);
+		if (tile->last && dt < 1000)
+		    tile->rate += VIDEO_RATE_WEIGHT * (1000.0f / dt - tile->rate);
+		else
+		    tile->rate = 0;
+		tile->last = now;
+	    }
+	}
+    }
+}
+
+/* Update rate of a tile, decayed by the time since its last update */
+static float
+video_tile_rate(const vncVideoTile *tile, CARD32 now)
+{
+    CARD32 since = now - tile->last;
+
+    if (!tile->last || since >= 1000)
+	return 0;
+    return since > 0 ? min(tile->rate, 1000.0f / since) : tile->rate;
+}
+
+static uint32_t
+video_overlap(const vncVideoRegion *a, const vncVideoRegion *b)
+{
+    int w = min(a->x + (int)a->width, b->x + (int)b->width) - max(a->x, b->x);
+    int h = min(a->y + (int)a->height, b->y + (int)b->height) - max(a->y, b->y);
+
+    return w > 0 && h > 0 ? (uint32_t)w * h : 0;
+}
+
+/* Collect the hot tiles into regions and match them with the last pass */
+static void
+video_pass(VNCVideoDetectPtr vd, CARD32 now)
+{
+    vncVideoRegion found[VNC_VIDEO_MAX_REGIONS];
+    CARD32 firstSeen[VNC_VIDEO_MAX_REGIONS];
+    int count = vd->tilesX * vd->tilesY;
+    int numFound = 0;
+    int i, j;
+
+    for (i = 0; i < count; i++)
+	vd->labels[i] = video_tile_rate(&vd->tiles[i], now) >= VIDEO_MIN_FPS ?
+			0 : -1;
+
+    /* Flood fill each connected area of hot tiles */
+    for (i = 0; i < count; i++) {
+	int x1, y1, x2, y2, tiles = 0, sp = 0;
+	float rate = 0;
+
+	if (vd->labels[i] != 0)
+	    continue;
+
+	x1 = x2 = i % vd->tilesX;
+	y1 = y2 = i / vd->tilesX;
+	vd->labels[i] = 1;
+	vd->stack[sp++] = i;
+	while (sp) {
+	    int t = vd->stack[--sp];
+	    int tx = t % vd->tilesX, ty = t / vd->tilesX;
+
+	    tiles++;
+	    rate += video_tile_rate(&vd->tiles[t], now);
+	    x1 = min(x1, tx);
+	    x2 = max(x2, tx);
+	    y1 = min(y1, ty);
+	    y2 = max(y2, ty);
+
+	    if (tx > 0 && vd->labels[t - 1] == 0) {
+		vd->labels[t - 1] = 1;
+		vd->stack[sp++] = t - 1;
+	    }
+	    if (tx < vd->tilesX - 1 && vd->labels[t + 1] == 0) {
+		vd->labels[t + 1] = 1;
+		vd->stack[sp++] = t + 1;
+	    }
+	    if (ty > 0 && vd->labels[t - vd->tilesX] == 0) {
+		vd->labels[t - vd->tilesX] = 1;
+		vd->stack[sp++] = t - vd->tilesX;
+	    }
+	    if (ty < vd->tilesY - 1 && vd->labels[t + vd->tilesX] == 0) {
+		vd->labels[t + vd->tilesX] = 1;
+		vd->stack[sp++] = t + vd->tilesX;
+	    }
+	}
+
+	/* Skip small areas, and sparse ones such as a blinking cursor trail */
+	if (tiles < VIDEO_MIN_TILES ||
+	    tiles * 2 < (x2 - x1 + 1) * (y2 - y1 + 1) ||
+	    numFound == VNC_VIDEO_MAX_REGIONS)
+	    continue;
+
+	found[numFound].x = x1 * VIDEO_TILE;
+	found[numFound].y = y1 * VIDEO_TILE;
+	found[numFound].width = min((x2 + 1) * VIDEO_TILE, vd->width) -
+				found[numFound].x;
+	found[numFound].height = min((y2 + 1) * VIDEO_TILE, vd->height) -
+				 found[numFound].y;
+	found[numFound].fps = (uint32_t)(rate / tiles * 65536.0f);
+	/* Fill for now, scaled by age below */
+	found[numFound].confidence = tiles * 65535 /
+				     ((x2 - x1 + 1) * (y2 - y1 + 1));
+	numFound++;
+    }
+
+    /* Keep the id and age of regions overlapping one from the last pass */
+    for (i = 0; i < numFound; i++) {
+	vncVideoRegion *r = &found[i];
+	uint32_t area = r->width * r->height;
+	CARD32 age;
+
+	firstSeen[i] = now;
+	r->id = 0;
+	for (j = 0; j < vd->numRegions; j++) {
+	    vncVideoRegion *old = &vd->regions[j];
+
+	    if (old->id &&
+		video_overlap(r, old) * 2 >= min(area, old->width * old->height)) {
+		r->id = old->id;
+		firstSeen[i] = vd->firstSeen[j];
+		old->id = 0;
+		break;
+	    }
+	}
+	if (!r->id)
+	    r->id = ++vd->nextId;
+
+	age = now - firstSeen[i];
+	r->age = age;
+	if (age < VIDEO_STABLE_MS)
+	    r->confidence = (uint64_t)r->confidence * age / VIDEO_STABLE_MS;
+    }
+
+    memcpy(vd->regions, found, numFound * sizeof(*found));
+    memcpy(vd->firstSeen, firstSeen, numFound * sizeof(*firstSeen));
+    vd->numRegions = numFound;
+    vd->lastPass = now;
+}
+
+static void
+video_export(VNCVideoDetectPtr vd, CARD32 now)
+{
+    vncVideoExport *ex = vd->export.map;
+
+    vncExportBeginWrite(&ex->sequence);
+    ex->magic = VNC_VIDEO_MAGIC;
+    ex->version = VNC_VIDEO_VERSION;
+    ex->numRegions = vd->numRegions;
+    ex->time = now;
+    memcpy(ex->regions, vd->regions, vd->numRegions * sizeof(vncVideoRegion));
+    vncExportEndWrite(&ex->sequence);
+}
+
+Bool
+VNCVideoDetectInit(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCVideoDetectPtr vd;
+
+    vd = calloc(1, sizeof(*vd));
+    if (!vd)
+	return FALSE;
+
+    if (!VNCExportMap(pScrn, &vd->export, "video", sizeof(vncVideoExport)) ||
+	!video_resize(pScrn, vd)) {
+	VNCExportUnmap(&vd->export);
+	free(vd);
+	return FALSE;
+    }
+    video_export(vd, GetTimeInMillis());
+
+    dPtr->videoDetect = vd;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	       "Exporting video regions to %s\n", vd->export.path);
+    return TRUE;
+}
+
+/*
+ * Called from the block handler with the damage accumulated since the
+ * last call, which may be empty.  Regions are re-evaluated every
+ * VIDEO_EVAL_MS while there is damage or any region remains.
+ */
+void
+VNCVideoDetectUpdate(ScrnInfoPtr pScrn, RegionPtr damage, pointer pTimeout)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCVideoDetectPtr vd = dPtr->videoDetect;
+    CARD32 now = GetTimeInMillis();
+    int before = vd->numRegions;
+
+    if (vd->width != pScrn->virtualX || vd->height != pScrn->virtualY) {
+	if (!video_resize(pScrn, vd)) {
+	    VNCVideoDetectClose(pScrn);
+	    return;
+	}
+    }
+
+    if (RegionNotEmpty(damage))
+	video_record(vd, damage, now);
+    else if (!vd->numRegions)
+	return;
+
+    if (now - vd->lastPass >= VIDEO_EVAL_MS) {
+	video_pass(vd, now);
+	if (vd->numRegions || before)
+	    video_export(vd, now);
+	VNC_PROBE2(video_regions, vd->numRegions, vd->updates);
+    }
+
+    /* Come back to let regions decay once the damage stops */
+    if (vd->numRegions)
+	AdjustWaitForDelay(pTimeout,
+			   VIDEO_EVAL_MS - min(now - vd->lastPass, VIDEO_EVAL_MS));
+}
+
+void
+VNCVideoDetectClose(ScrnInfoPtr pScrn)
+{
+    VNCPtr dPtr = VNCPTR(pScrn);
+    VNCVideoDetectPtr vd = dPtr->videoDetect;
+
+    if (!vd)
+	return;
+
+    VNCExportUnmap(&vd->export);
+    free(vd->tiles);
+    free(vd->labels);
+    free(vd->stack);
+    free(vd);
+    dPtr->videoDetect = NULL;
+}
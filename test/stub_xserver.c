@@ -0,0 +1,548 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Stubs for the X server symbols used by vnc_driver.c and vnc_cursor.c,
+ * and for the driver modules the tests leave out.  Everything succeeds
+ * and does nothing unless a test depends on it doing more.  Declarations
+ * come from the server's own headers, so a stub that drifts from the
+ * real signature fails to compile rather than misbehaving.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "xf86.h"
+#include "xf86_OSproc.h"
+#include "mipointer.h"
+#include "micmap.h"
+#include "dixstruct.h"
+#include "property.h"
+#include "opaque.h"
+#include "xf86cmap.h"
+#include "fb.h"
+#include "picturestr.h"
+#include "servermd.h"
+#include "xf86Crtc.h"
+#include "xf86Cursor.h"
+
+#include "vnc.h"
+#include "stub_xserver.h"
+
+ScrnInfoPtr stubScrn;
+int stubVerbose;
+
+/* Server globals */
+unsigned long serverGeneration = 1;
+const char *display = "0";
+ClientPtr serverClient;
+int xf86CrtcConfigPrivateIndex = 0;
+PaddingInfo PixmapWidthPaddingInfo[33];
+
+/* Row padding for pixmaps of a depth, as the server sets it up at start */
+void
+stubSetPixmapFormat(int depth, int bpp)
+{
+    PaddingInfo *info = &PixmapWidthPaddingInfo[depth];
+    int log2 = 0;
+
+    while ((1 << log2) < BITMAP_SCANLINE_PAD / bpp)
+	log2++;
+    info->padRoundUp = BITMAP_SCANLINE_PAD / bpp - 1;
+    info->padPixelsLog2 = log2;
+    info->padBytesLog2 = 2;         /* BITMAP_SCANLINE_PAD / 8 == 4 */
+    info->notPower2 = bpp == 24;
+    info->bytesPerPixel = bpp / 8;
+    info->bitsPerPixel = bpp;
+}
+
+/* Messages and allocation */
+
+void
+xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...)
+{
+    va_list args;
+
+    if (!stubVerbose)
+	return;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void
+ErrorF(const char *format, ...)
+{
+    va_list args;
+
+    if (!stubVerbose)
+	return;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void *
+XNFcallocarray(size_t nmemb, size_t size)
+{
+    void *p = calloc(nmemb, size);
+
+    if (!p)
+	abort();
+    return p;
+}
+
+char *
+XNFstrdup(const char *s)
+{
+    char *p = strdup(s);
+
+    if (!p)
+	abort();
+    return p;
+}
+
+char *
+XNFprintf(const char *format, ...)
+{
+    va_list args;
+    char *p;
+
+    va_start(args, format);
+    if (vasprintf(&p, format, args) < 0)
+	abort();
+    va_end(args);
+    return p;
+}
+
+/* Screens */
+
+#ifdef XF86_HAS_SCRN_CONV
+ScrnInfoPtr
+xf86ScreenToScrn(ScreenPtr pScreen)
+{
+    return stubScrn;
+}
+
+ScreenPtr
+xf86ScrnToScreen(ScrnInfoPtr pScrn)
+{
+    return pScrn->pScreen;
+}
+#endif
+
+void
+xf86AddDriver(DriverPtr driver, void *module, int flags)
+{
+}
+
+ScrnInfoPtr
+xf86AllocateScreen(DriverPtr drv, int flags)
+{
+    return NULL;
+}
+
+void
+xf86AddEntityToScreen(ScrnInfoPtr pScrn, int entityIndex)
+{
+}
+
+int
+xf86ClaimNoSlot(DriverPtr drvp, int chipset, GDevPtr dev, Bool active)
+{
+    return -1;
+}
+
+int
+xf86MatchDevice(const char *drivername, GDevPtr **driversectlist)
+{
+    *driversectlist = NULL;
+    return 0;
+}
+
+EntityInfoPtr
+xf86GetEntityInfo(int entityIndex)
+{
+    return NULL;
+}
+
+void
+xf86PrintChipsets(const char *drvname, const char *drvmsg, SymTabPtr chips)
+{
+}
+
+const char *
+xf86TokenToString(SymTabPtr table, int token)
+{
+    for (; table->token >= 0; table++) {
+	if (table->token == token)
+	    return table->name;
+    }
+    return NULL;
+}
+
+int
+xf86NameCmp(const char *s1, const char *s2)
+{
+    return strcasecmp(s1, s2);
+}
+
+void *
+xf86LoadSubModule(ScrnInfoPtr pScrn, const char *name)
+{
+    return (void *)1;
+}
+
+Bool
+xf86SetDepthBpp(ScrnInfoPtr scrp, int depth, int bpp, int fbbpp,
+                int depth24flags)
+{
+    return TRUE;
+}
+
+void
+xf86PrintDepthBpp(ScrnInfoPtr scrp)
+{
+}
+
+Bool
+xf86SetWeight(ScrnInfoPtr scrp, rgb weight, rgb mask)
+{
+    return TRUE;
+}
+
+Bool
+xf86SetDefaultVisual(ScrnInfoPtr scrp, int visual)
+{
+    return TRUE;
+}
+
+Bool
+xf86SetGamma(ScrnInfoPtr scrp, Gamma newGamma)
+{
+    return TRUE;
+}
+
+void
+xf86SetDpi(ScrnInfoPtr pScrn, int x, int y)
+{
+}
+
+void
+xf86SetBlackWhitePixels(ScreenPtr pScreen)
+{
+}
+
+void
+xf86SetBackingStore(ScreenPtr pScreen)
+{
+}
+
+void
+xf86SetSilkenMouse(ScreenPtr pScreen)
+{
+}
+
+/* Options: nothing is configured */
+
+void
+xf86CollectOptions(ScrnInfoPtr pScrn, XF86OptionPtr extraOpts)
+{
+}
+
+void
+xf86ProcessOptions(int scrnIndex, XF86OptionPtr options, OptionInfoPtr optinfo)
+{
+}
+
+void
+xf86ShowUnusedOptions(int scrnIndex, XF86OptionPtr options)
+{
+}
+
+const char *
+xf86FindOptionValue(XF86OptionPtr options, const char *name)
+{
+    return NULL;
+}
+
+Bool
+xf86GetOptValBool(const OptionInfoRec *table, int token, Bool *value)
+{
+    return FALSE;
+}
+
+Bool
+xf86GetOptValInteger(const OptionInfoRec *table, int token, int *value)
+{
+    return FALSE;
+}
+
+const char *
+xf86GetOptValString(const OptionInfoRec *table, int token)
+{
+    return NULL;
+}
+
+/* fb, mi and colormaps */
+
+Bool
+fbScreenInit(ScreenPtr pScreen, void *pbits, int xsize, int ysize,
+             int dpix, int dpiy, int width, int bpp)
+{
+    return TRUE;
+}
+
+Bool
+fbPictureInit(ScreenPtr pScreen, PictFormatPtr formats, int nformats)
+{
+    return TRUE;
+}
+
+void
+miClearVisualTypes(void)
+{
+}
+
+Bool
+miSetVisualTypes(int depth, int visuals, int bitsPerRGB, int preferredVisual)
+{
+    return TRUE;
+}
+
+int
+miGetDefaultVisualMask(int depth)
+{
+    return 0;
+}
+
+Bool
+miSetPixmapDepths(void)
+{
+    return TRUE;
+}
+
+Bool
+miCreateDefColormap(ScreenPtr pScreen)
+{
+    return TRUE;
+}
+
+Bool
+miDCInitialize(ScreenPtr pScreen, miPointerScreenFuncPtr screenFuncs)
+{
+    return TRUE;
+}
+
+void *
+xf86GetPointerScreenFuncs(void)
+{
+    return NULL;
+}
+
+Bool
+xf86HandleColormaps(ScreenPtr pScreen, int maxCol, int sigRGBbits,
+                    xf86LoadPaletteProc *loadPalette,
+                    xf86SetOverscanProc *setOverscan, unsigned int flags)
+{
+    return TRUE;
+}
+
+/* Cursor: the driver's callbacks are kept for the tests to call */
+
+xf86CursorInfoPtr
+xf86CreateCursorInfoRec(void)
+{
+    return calloc(1, sizeof(xf86CursorInfoRec));
+}
+
+void
+xf86DestroyCursorInfoRec(xf86CursorInfoPtr infoPtr)
+{
+    free(infoPtr);
+}
+
+Bool
+xf86InitCursor(ScreenPtr pScreen, xf86CursorInfoPtr infoPtr)
+{
+    return TRUE;
+}
+
+/* Atoms, properties and work procs */
+
+Atom
+MakeAtom(const char *string, unsigned len, Bool makeit)
+{
+    return None;
+}
+
+const char *
+NameForAtom(Atom atom)
+{
+    return NULL;
+}
+
+Bool
+ValidAtom(Atom atom)
+{
+    return FALSE;
+}
+
+int
+dixChangeWindowProperty(ClientPtr pClient, WindowPtr pWin, Atom property,
+                        Atom type, int format, int mode, unsigned long len,
+                        const void *value, Bool sendevent)
+{
+    return Success;
+}
+
+Bool
+QueueWorkProc(Bool (*function)(ClientPtr clientUnused, void *closure),
+              ClientPtr client, void *closure)
+{
+    return TRUE;
+}
+
+/* CRTCs, outputs and RandR */
+
+void
+xf86CrtcConfigInit(ScrnInfoPtr scrn, const xf86CrtcConfigFuncsRec *funcs)
+{
+}
+
+xf86CrtcPtr
+xf86CrtcCreate(ScrnInfoPtr scrn, const xf86CrtcFuncsRec *funcs)
+{
+    return NULL;
+}
+
+xf86OutputPtr
+xf86OutputCreate(ScrnInfoPtr scrn, const xf86OutputFuncsRec *funcs,
+                 const char *name)
+{
+    return NULL;
+}
+
+void
+xf86OutputUseScreenMonitor(xf86OutputPtr output, Bool use_screen_monitor)
+{
+}
+
+Bool
+xf86CrtcInUse(xf86CrtcPtr crtc)
+{
+    return FALSE;
+}
+
+void
+xf86CrtcSetSizeRange(ScrnInfoPtr scrn, int minWidth, int minHeight,
+                     int maxWidth, int maxHeight)
+{
+}
+
+Bool
+xf86InitialConfiguration(ScrnInfoPtr pScrn, Bool canGrow)
+{
+    return TRUE;
+}
+
+Bool
+xf86CrtcScreenInit(ScreenPtr pScreen)
+{
+    return TRUE;
+}
+
+Bool
+xf86SetDesiredModes(ScrnInfoPtr pScrn)
+{
+    return TRUE;
+}
+
+RRModePtr
+RRModeGet(xRRModeInfo *modeInfo, const char *name)
+{
+    return NULL;
+}
+
+void
+RRModeDestroy(RRModePtr mode)
+{
+}
+
+Bool
+RRCrtcSet(RRCrtcPtr crtc, RRModePtr mode, int x, int y, Rotation rotation,
+          int numOutput, RROutputPtr *outputs)
+{
+    return TRUE;
+}
+
+Bool
+RRScreenSizeSet(ScreenPtr pScreen, CARD16 width, CARD16 height,
+                CARD32 mmWidth, CARD32 mmHeight)
+{
+    return TRUE;
+}
+
+Bool
+RRGetInfo(ScreenPtr pScreen, Bool force_query)
+{
+    return TRUE;
+}
+
+void
+RRTellChanged(ScreenPtr pScreen)
+{
+}
+
+int
+RRConfigureOutputProperty(RROutputPtr output, Atom property, Bool pending,
+                          Bool range, Bool immutable, int num_values,
+                          const INT32 *values)
+{
+    return Success;
+}
+
+int
+RRChangeOutputProperty(RROutputPtr output, Atom property, Atom type,
+                       int format, int mode, unsigned long len,
+                       const void *value, Bool sendevent, Bool pending)
+{
+    return Success;
+}
+
+/* Driver modules the tests leave out, all switched off by their options */
+
+Bool VNCDamageStart(ScreenPtr pScreen) { return TRUE; }
+void VNCDamagePublish(ScreenPtr pScreen, pointer pTimeout) { }
+void VNCDamageResize(ScrnInfoPtr pScrn) { }
+void VNCDamageClose(ScreenPtr pScreen) { }
+void VNCCaptureWindowDestroyed(ScrnInfoPtr pScrn, WindowPtr pWin) { }
+Bool VNCFbFileProbe(ScrnInfoPtr pScrn, int *width, int *height) { return FALSE; }
+void *VNCFbFileMap(ScrnInfoPtr pScrn, size_t bytes) { return NULL; }
+void VNCFbFileUnmap(ScrnInfoPtr pScrn) { }
+size_t VNCSparseCommitted(ScrnInfoPtr pScrn, int width, int height,
+                          int replace, const BoxRec *box) { return 0; }
+void *VNCSparseMap(ScrnInfoPtr pScrn, size_t bytes) { return NULL; }
+void VNCSparseCover(ScrnInfoPtr pScrn, const BoxRec *box) { }
+void VNCSparseTrim(ScrnInfoPtr pScrn) { }
+void VNCSparseUnmap(ScrnInfoPtr pScrn) { }
+Bool VNCLayoutInit(ScrnInfoPtr pScrn) { return FALSE; }
+void VNCLayoutUpdate(ScrnInfoPtr pScrn) { }
+void VNCLayoutClose(ScrnInfoPtr pScrn) { }
+Bool VNCProfileInit(ScreenPtr pScreen) { return FALSE; }
+void VNCProfileCheck(ScrnInfoPtr pScrn) { }
+void VNCProfileClose(ScreenPtr pScreen) { }
+void VNCRecordCursor(ScrnInfoPtr pScrn) { }
+void VNCRecordCursorImage(ScrnInfoPtr pScrn, const unsigned char *image) { }
+Bool VNCRenderInit(ScreenPtr pScreen) { return FALSE; }
+void VNCRenderClose(ScreenPtr pScreen) { }
+Bool VNCVideoInit(ScreenPtr pScreen) { return FALSE; }
+void VNCVideoClose(ScreenPtr pScreen) { }
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * A minimal stand-in for the X server, so that driver code can be run
+ * without starting Xorg.  Only what the driver sources linked into the
+ * tests call is provided, and only as much of it as they rely on.
+ */
+
+#ifndef STUB_XSERVER_H
+#define STUB_XSERVER_H
+
+#include "xf86.h"
+
+/* The screen xf86ScreenToScrn and xf86ScrnToScreen map between */
+extern ScrnInfoPtr stubScrn;
+
+/* Print driver messages, as with VNC_TEST_VERBOSE=1 */
+extern int stubVerbose;
+
+/* Set up PixmapBytePad for depth at bpp */
+extern void stubSetPixmapFormat(int depth, int bpp);
+
+#endif
@@ -0,0 +1,588 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Tests and microbenchmarks for driver internals, run against the stub X
+ * server in stub_xserver.c rather than a real one.  vnc_driver.c is
+ * included here so that its static functions can be called directly.
+ *
+ *   vnc_test                   run the tests (make check)
+ *   vnc_test --bench [name]    run the benchmarks, or those matching name
+ *
+ * Set VNC_TEST_VERBOSE=1 to see the driver's log messages.
+ */
+
+#include "vnc_driver.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stub_xserver.h"
+
+static int failures;
+
+#define CHECK(cond)							\
+    do {								\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: %s: check failed: %s\n",		\
+		    __FILE__, __LINE__, __func__, #cond);		\
+	    failures++;							\
+	}								\
+    } while (0)
+
+/*
+ * A screen with just enough in it for the driver: one 32bpp screen pixmap
+ * whose header the driver can modify, and an empty CRTC configuration.
+ */
+static ScrnInfoRec testScrn;
+static ScreenRec testScreen;
+static PixmapRec testPixmap;
+static VNCRec testVnc;
+static xf86CrtcConfigRec testConfig;
+static DevUnion testPrivates[1];
+
+static PixmapPtr
+test_get_screen_pixmap(ScreenPtr pScreen)
+{
+    return &testPixmap;
+}
+
+/* As miModifyPixmapHeader, which pads rows when devKind is -1 */
+static Bool
+test_modify_pixmap_header(PixmapPtr pPixmap, int width, int height, int depth,
+                          int bitsPerPixel, int devKind, void *pPixData)
+{
+    if (width > 0)
+	pPixmap->drawable.width = width;
+    if (height > 0)
+	pPixmap->drawable.height = height;
+    if (depth > 0)
+	pPixmap->drawable.depth = depth;
+    if (bitsPerPixel > 0)
+	pPixmap->drawable.bitsPerPixel = bitsPerPixel;
+    if (devKind > 0)
+	pPixmap->devKind = devKind;
+    else if (devKind == -1)
+	pPixmap->devKind = PixmapBytePad(pPixmap->drawable.width,
+	                                 pPixmap->drawable.depth);
+    if (pPixData)
+	pPixmap->devPrivate.ptr = pPixData;
+    return TRUE;
+}
+
+/* Draw over the whole screen pixmap, as fb would */
+static void
+test_fill_pixmap(void)
+{
+    memset(testPixmap.devPrivate.ptr, 0x55,
+           (size_t)testPixmap.devKind * testPixmap.drawable.height);
+}
+
+static void
+test_setup_depth(int depth, int bpp)
+{
+    free(testPixmap.devPrivate.ptr);
+    memset(&testScrn, 0, sizeof(testScrn));
+    memset(&testScreen, 0, sizeof(testScreen));
+    memset(&testPixmap, 0, sizeof(testPixmap));
+    memset(&testVnc, 0, sizeof(testVnc));
+    memset(&testConfig, 0, sizeof(testConfig));
+
+    testPrivates[xf86CrtcConfigPrivateIndex].ptr = &testConfig;
+    testScrn.privates = testPrivates;
+    testScrn.driverPrivate = &testVnc;
+    testScrn.pScreen = &testScreen;
+    testScrn.depth = depth;
+    testScrn.bitsPerPixel = bpp;
+    testScrn.videoRam = 65536;
+    testScrn.virtualX = 1024;
+    testScrn.virtualY = 768;
+    testScreen.GetScreenPixmap = test_get_screen_pixmap;
+    testScreen.ModifyPixmapHeader = test_modify_pixmap_header;
+    stubScrn = &testScrn;
+
+    stubSetPixmapFormat(depth, bpp);
+    testPixmap.devPrivate.ptr = realloc_fb(&testScrn, NULL);
+    test_modify_pixmap_header(&testPixmap, testScrn.virtualX,
+                              testScrn.virtualY, depth, bpp, -1, NULL);
+}
+
+static void
+test_setup(void)
+{
+    test_setup_depth(24, 32);
+}
+
+static void
+free_modes(DisplayModePtr modes)
+{
+    while (modes) {
+	DisplayModePtr next = modes->next;
+
+	free((void *)modes->name);
+	free(modes);
+	modes = next;
+    }
+}
+
+static int
+count_modes(DisplayModePtr modes)
+{
+    int n = 0;
+
+    for (; modes; modes = modes->next)
+	n++;
+    return n;
+}
+
+/* Tests */
+
+static void
+test_size_valid(void)
+{
+    test_setup();
+    testScrn.videoRam = 4096;
+
+    CHECK(size_valid(&testScrn, 1024, 768));
+    CHECK(size_valid(&testScrn, 1024, 1024));
+    CHECK(!size_valid(&testScrn, 1024, 1025));
+    CHECK(!size_valid(&testScrn, 0, 768));
+    CHECK(!size_valid(&testScrn, 1024, 0));
+
+    testScrn.videoRam = 8 * 1024 * 1024;
+    CHECK(size_valid(&testScrn, VNC_MAX_WIDTH, VNC_MAX_HEIGHT));
+    CHECK(!size_valid(&testScrn, VNC_MAX_WIDTH + 1, 16));
+    CHECK(!size_valid(&testScrn, 16, VNC_MAX_HEIGHT + 1));
+
+    /* A 16bpp framebuffer fits twice the pixels */
+    testScrn.videoRam = 4096;
+    testScrn.bitsPerPixel = 16;
+    CHECK(size_valid(&testScrn, 2048, 1024));
+    CHECK(!size_valid(&testScrn, 2048, 1025));
+}
+
+static void
+test_add_mode(void)
+{
+    DisplayModePtr modes = NULL, m;
+
+    modes = add_mode(modes, 640, 480);
+    modes = add_mode(modes, 800, 600);
+    modes = add_mode(modes, 1920, 1080);
+
+    CHECK(count_modes(modes) == 3);
+    CHECK(strcmp(modes->name, "640x480") == 0);
+    CHECK(modes->prev == NULL);
+
+    m = modes->next->next;
+    CHECK(strcmp(m->name, "1920x1080") == 0);
+    CHECK(m->prev == modes->next);
+    CHECK(m->HDisplay == 1920 && m->VDisplay == 1080);
+    CHECK(m->HSyncStart > m->HDisplay && m->HSyncEnd > m->HSyncStart &&
+          m->HTotal > m->HSyncEnd);
+    CHECK(m->VSyncStart > m->VDisplay && m->VSyncEnd > m->VSyncStart &&
+          m->VTotal > m->VSyncEnd);
+    CHECK(m->Clock == m->HTotal * m->VTotal * 60 / 1000);
+    CHECK(m->status == MODE_OK);
+
+    free_modes(modes);
+}
+
+static void
+test_get_modes(void)
+{
+    xf86OutputRec output;
+    DisplayModePtr modes;
+    int i;
+
+    test_setup();
+    memset(&output, 0, sizeof(output));
+    output.scrn = &testScrn;
+    output.driver_private = (void *)(uintptr_t)1;
+
+    /* Only the default mode until a size is requested */
+    modes = vnc_output_get_modes(&output);
+    CHECK(count_modes(modes) == 1);
+    CHECK(modes->HDisplay == 1024 && modes->VDisplay == 768);
+    free_modes(modes);
+
+    /* The list stays bounded however often the size changes */
+    for (i = 0; i < 100; i++) {
+	testVnc.outputWidth[1] = 800 + i;
+	testVnc.outputHeight[1] = 600 + i;
+	modes = vnc_output_get_modes(&output);
+	CHECK(count_modes(modes) == 2);
+	CHECK(modes->next->HDisplay == 800 + i);
+	CHECK(modes->next->type & M_T_PREFERRED);
+	free_modes(modes);
+    }
+
+    /* Asking for the default size does not list it twice */
+    testVnc.outputWidth[1] = 1024;
+    testVnc.outputHeight[1] = 768;
+    modes = vnc_output_get_modes(&output);
+    CHECK(count_modes(modes) == 1);
+    free_modes(modes);
+}
+
+static void
+test_realloc_fb(void)
+{
+    unsigned char *pixels;
+    size_t i, size;
+
+    test_setup();
+    testScrn.virtualX = 64;
+    testScrn.virtualY = 64;
+    size = 64 * 64 * 4;
+
+    /* A new framebuffer starts black */
+    pixels = realloc_fb(&testScrn, NULL);
+    CHECK(pixels != NULL);
+    for (i = 0; i < size && !pixels[i]; i++)
+	;
+    CHECK(i == size);
+
+    /* Growing keeps what was there */
+    for (i = 0; i < size; i++)
+	pixels[i] = i;
+    testScrn.virtualX = 128;
+    testScrn.virtualY = 128;
+    pixels = realloc_fb(&testScrn, pixels);
+    CHECK(pixels != NULL);
+    for (i = 0; i < size && pixels[i] == (unsigned char)i; i++)
+	;
+    CHECK(i == size);
+
+    free_fb(&testScrn, pixels);
+}
+
+static void
+test_resize(void)
+{
+    test_setup();
+
+    CHECK(vnc_xf86crtc_resize(&testScrn, 1920, 1080));
+    CHECK(testScrn.virtualX == 1920 && testScrn.virtualY == 1080);
+    CHECK(testPixmap.drawable.width == 1920 &&
+          testPixmap.drawable.height == 1080);
+    CHECK(testPixmap.devPrivate.ptr != NULL);
+    CHECK(testVnc.layoutChanged);
+
+    /* Failed resizes leave the screen as it was */
+    CHECK(!vnc_xf86crtc_resize(&testScrn, VNC_MAX_WIDTH + 1, 1080));
+    CHECK(!vnc_xf86crtc_resize(&testScrn, 0, 0));
+    testScrn.videoRam = 4096;
+    CHECK(!vnc_xf86crtc_resize(&testScrn, 4096, 4096));
+    CHECK(testScrn.virtualX == 1920 && testScrn.virtualY == 1080);
+    CHECK(testPixmap.drawable.width == 1920);
+
+    CHECK(vnc_xf86crtc_resize(&testScrn, 800, 600));
+    CHECK(testPixmap.drawable.width == 800 &&
+          testPixmap.drawable.height == 600);
+    test_fill_pixmap();
+}
+
+/* Odd widths at 16bpp have padded rows, which must fit the allocation */
+static void
+test_resize_padded(void)
+{
+    int width;
+
+    test_setup_depth(16, 16);
+    for (width = 256; width < 264; width++) {
+	CHECK(fb_stride(&testScrn, width) == PixmapBytePad(width, 16));
+	CHECK(vnc_xf86crtc_resize(&testScrn, width, 257));
+	CHECK(testPixmap.devKind == PixmapBytePad(width, 16));
+	test_fill_pixmap();
+    }
+
+    test_setup_depth(8, 8);
+    for (width = 256; width < 264; width++)
+	CHECK(fb_stride(&testScrn, width) == PixmapBytePad(width, 8));
+}
+
+/* RRScreenSizeSet does not check the advertised range, so the driver must */
+static void
+test_desktop_size_range(void)
+{
+    xf86CrtcRec crtc;
+    xf86CrtcPtr crtcs[1] = { &crtc };
+    xf86OutputRec output;
+
+    test_setup();
+    memset(&crtc, 0, sizeof(crtc));
+    memset(&output, 0, sizeof(output));
+    output.scrn = &testScrn;
+    testConfig.crtc = crtcs;
+    testConfig.num_crtc = 1;
+    testConfig.minWidth = 256;
+    testConfig.minHeight = 256;
+
+    CHECK(!vnc_output_set_desktop_size(&output, 10, 10));
+    CHECK(!vnc_output_set_desktop_size(&output, 1024, 255));
+    CHECK(testVnc.outputWidth[0] == 0);
+
+    /* A disconnected output keeps the size for when it is plugged in */
+    CHECK(vnc_output_set_desktop_size(&output, 256, 256));
+    CHECK(testVnc.outputWidth[0] == 256 && testVnc.outputHeight[0] == 256);
+}
+
+static void
+test_palette(void)
+{
+    LOCO colors[256];
+    int indices[3] = { 0, 7, 255 };
+    int i;
+
+    test_setup();
+    for (i = 0; i < 256; i++) {
+	colors[i].red = i;
+	colors[i].green = 255 - i;
+	colors[i].blue = i / 2;
+    }
+
+    testScrn.depth = 16;
+    VNCLoadPalette(&testScrn, 3, indices, colors, NULL);
+    CHECK(testVnc.colors[7].red == 7);
+    CHECK(testVnc.colors[7].green == 248);
+    CHECK(testVnc.colors[255].blue == 127);
+    CHECK(testVnc.colors[1].red == 0);      /* not in indices */
+
+    /* Depth 15 has one bit less per channel */
+    testScrn.depth = 15;
+    VNCLoadPalette(&testScrn, 3, indices, colors, NULL);
+    CHECK(testVnc.colors[7].red == 14);
+    CHECK(testVnc.colors[7].green == 496);
+    CHECK(testVnc.colors[0].green == 510);
+}
+
+static void
+test_cursor(void)
+{
+    xf86CursorInfoPtr info;
+    unsigned char image[1024];
+
+    test_setup();
+    CHECK(VNCCursorInit(&testScreen));
+    info = testVnc.CursorInfo;
+    CHECK(info != NULL);
+    if (!info)
+	return;
+    CHECK(info->MaxWidth == 64 && info->MaxHeight == 64);
+
+    info->SetCursorPosition(&testScrn, 10, -5);
+    CHECK(testVnc.cursorX == 10 && testVnc.cursorY == -5);
+
+    info->ShowCursor(&testScrn);
+    CHECK(testVnc.VncHWCursorShown);
+    info->HideCursor(&testScrn);
+    CHECK(!testVnc.VncHWCursorShown);
+
+    info->SetCursorColors(&testScrn, 0x000000, 0xffffff);
+    CHECK(testVnc.cursorBG == 0x000000 && testVnc.cursorFG == 0xffffff);
+
+    memset(image, 0xaa, sizeof(image));
+    info->LoadCursorImage(&testScrn, image);
+
+    CHECK(info->UseHWCursor(&testScreen, NULL));
+    testVnc.swCursor = TRUE;
+    CHECK(!info->UseHWCursor(&testScreen, NULL));
+
+    xf86DestroyCursorInfoRec(info);
+    testVnc.CursorInfo = NULL;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "size_valid", test_size_valid },
+    { "add_mode", test_add_mode },
+    { "get_modes", test_get_modes },
+    { "realloc_fb", test_realloc_fb },
+    { "resize", test_resize },
+    { "resize_padded", test_resize_padded },
+    { "desktop_size_range", test_desktop_size_range },
+    { "palette", test_palette },
+    { "cursor", test_cursor },
+};
+
+/* Benchmarks, each running its operation iterations times */
+
+static void
+bench_resize_churn(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+	if (i & 1)
+	    vnc_xf86crtc_resize(&testScrn, 1280, 720);
+	else
+	    vnc_xf86crtc_resize(&testScrn, 1920, 1080);
+    }
+}
+
+static void
+bench_palette_load(long iterations)
+{
+    static LOCO colors[256];
+    static int indices[256];
+    long i;
+
+    for (i = 0; i < 256; i++)
+	indices[i] = i;
+    testScrn.depth = 16;
+    for (i = 0; i < iterations; i++)
+	VNCLoadPalette(&testScrn, 256, indices, colors, NULL);
+    testScrn.depth = 24;
+}
+
+static void
+bench_cursor_update(long iterations)
+{
+    xf86CursorInfoPtr info;
+    long i;
+
+    if (!VNCCursorInit(&testScreen))
+	return;
+    info = testVnc.CursorInfo;
+    for (i = 0; i < iterations; i++) {
+	info->SetCursorPosition(&testScrn, i & 1023, (i >> 10) & 767);
+	if (!(i & 63)) {
+	    info->HideCursor(&testScrn);
+	    info->ShowCursor(&testScrn);
+	}
+    }
+    xf86DestroyCursorInfoRec(info);
+    testVnc.CursorInfo = NULL;
+}
+
+static void
+bench_mode_list_growth(long iterations)
+{
+    xf86OutputRec output;
+    long i;
+
+    memset(&output, 0, sizeof(output));
+    output.scrn = &testScrn;
+    for (i = 0; i < iterations; i++) {
+	testVnc.outputWidth[0] = 640 + (i & 1023);
+	testVnc.outputHeight[0] = 480 + (i & 511);
+	free_modes(vnc_output_get_modes(&output));
+    }
+}
+
+static void
+bench_add_mode_64(long iterations)
+{
+    long i;
+    int j;
+
+    for (i = 0; i < iterations; i++) {
+	DisplayModePtr modes = NULL;
+
+	for (j = 0; j < 64; j++)
+	    modes = add_mode(modes, 640 + j, 480 + j);
+	free_modes(modes);
+    }
+}
+
+static void
+bench_size_valid(long iterations)
+{
+    volatile Bool valid;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+	valid = size_valid(&testScrn, 640 + (i & 4095), 480 + (i & 2047));
+    (void)valid;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(long iterations);
+} benchmarks[] = {
+    { "BM_resize_churn", bench_resize_churn },
+    { "BM_palette_load", bench_palette_load },
+    { "BM_cursor_update", bench_cursor_update },
+    { "BM_mode_list_growth", bench_mode_list_growth },
+    { "BM_add_mode_64", bench_add_mode_64 },
+    { "BM_size_valid", bench_size_valid },
+};
+
+static double
+bench_clock(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Run a benchmark for at least minTime seconds, growing the iteration
+ * count as Google Benchmark does, and report the time per iteration.
+ */
+static void
+bench_run(const char *name, void (*run)(long), double minTime)
+{
+    long iterations = 1;
+    double wall, cpu;
+
+    for (;;) {
+	test_setup();
+	wall = bench_clock(CLOCK_MONOTONIC);
+	cpu = bench_clock(CLOCK_PROCESS_CPUTIME_ID);
+	run(iterations);
+	wall = bench_clock(CLOCK_MONOTONIC) - wall;
+	cpu = bench_clock(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+	if (wall >= minTime * 1e9 || iterations >= 1000000000L)
+	    break;
+	/* Aim a little past the target, but at most ten times further */
+	if (wall < minTime * 1e8)
+	    iterations *= 10;
+	else
+	    iterations = iterations * (minTime * 1.4e9 / wall) + 1;
+    }
+
+    printf("%-24s %10.1f ns %10.1f ns %12ld\n", name, wall / iterations,
+           cpu / iterations, iterations);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *verbose = getenv("VNC_TEST_VERBOSE");
+    size_t i;
+
+    stubVerbose = verbose && atoi(verbose);
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+	const char *filter = argc > 2 ? argv[2] : NULL;
+
+	printf("%-24s %13s %13s %12s\n", "Benchmark", "Time", "CPU",
+	       "Iterations");
+	printf("-----------------------------------------------------------------\n");
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+	    if (filter && !strstr(benchmarks[i].name, filter))
+		continue;
+	    bench_run(benchmarks[i].name, benchmarks[i].run, 0.1);
+	}
+	return 0;
+    }
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+	int before = failures;
+
+	tests[i].run();
+	printf("%s %s\n", failures == before ? "PASS" : "FAIL", tests[i].name);
+    }
+    free(testPixmap.devPrivate.ptr);
+
+    if (failures)
+	fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Print the damage latency histograms exported by the driver with the
+ * LatencyStats option.  With -i, print what changed every interval
+ * seconds instead of the totals since the server started.
+ *
+ * Build: cc -O2 -Isrc -o vnc-latency tools/vnc-latency.c
+ * Usage: vnc-latency [-i interval] /dev/shm/vnc_drv.<display>/latency
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vnc_export.h"
+
+/* Take a consistent copy of the file */
+static int
+snapshot(const vncLatencyExport *map, vncLatencyExport *copy)
+{
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+	uint64_t seq = __atomic_load_n(&map->sequence, __ATOMIC_ACQUIRE);
+
+	if (seq & 1) {
+	    usleep(100);
+	    continue;
+	}
+	memcpy(copy, map, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&map->sequence, __ATOMIC_RELAXED) == seq)
+	    return 1;
+    }
+    return 0;
+}
+
+static void
+print_histogram(const char *name, const vncLatencyHistogram *h,
+                const vncLatencyHistogram *base)
+{
+    uint64_t count = h->count - (base ? base->count : 0);
+    uint64_t sum = h->sum - (base ? base->sum : 0);
+    uint64_t peak = 0;
+    int first = -1, last = -1;
+    int i;
+
+    printf("%s: %llu", name, (unsigned long long)count);
+    if (count)
+	printf(", mean %lluus", (unsigned long long)(sum / count));
+    if (!base)
+	printf(", max %lluus", (unsigned long long)h->max);
+    printf("\n");
+
+    for (i = 0; i < VNC_LATENCY_BUCKETS; i++) {
+	uint64_t n = h->buckets[i] - (base ? base->buckets[i] : 0);
+
+	if (!n)
+	    continue;
+	if (first < 0)
+	    first = i;
+	last = i;
+	if (n > peak)
+	    peak = n;
+    }
+
+    for (i = first; i >= 0 && i <= last; i++) {
+	uint64_t n = h->buckets[i] - (base ? base->buckets[i] : 0);
+	char bar[51];
+	int len = (int)(n * 50 / peak);
+
+	memset(bar, '@', len);
+	bar[len] = '\0';
+	if (i == VNC_LATENCY_BUCKETS - 1)
+	    printf("  [%10llu, ...) ", 1ULL << i);
+	else
+	    printf("  [%10llu, %10llu) ", i ? 1ULL << i : 0ULL, 1ULL << (i + 1));
+	printf("%10llu |%-50s|\n", (unsigned long long)n, bar);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const vncLatencyExport *map;
+    vncLatencyExport now, last;
+    int interval = 0;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+	switch (opt) {
+	case 'i':
+	    interval = atoi(optarg);
+	    break;
+	default:
+	    goto usage;
+	}
+    }
+    if (optind != argc - 1)
+	goto usage;
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+	perror(argv[optind]);
+	return 1;
+    }
+    map = mmap(NULL, sizeof(*map), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	perror("mmap");
+	return 1;
+    }
+
+    if (!snapshot(map, &now) || now.magic != VNC_LATENCY_MAGIC ||
+	now.version != VNC_LATENCY_VERSION) {
+	fprintf(stderr, "%s: not a latency file\n", argv[optind]);
+	return 1;
+    }
+
+    if (!interval) {
+	printf("frame %llu: oldest damage %lluus before publication in the "
+	       "last frame counted\n", (unsigned long long)now.frame,
+	       (unsigned long long)(now.published - now.firstDamage));
+	print_histogram("tiles", &now.tiles, NULL);
+	print_histogram("frames", &now.frames, NULL);
+	return 0;
+    }
+
+    for (;;) {
+	last = now;
+	sleep(interval);
+	if (!snapshot(map, &now))
+	    continue;
+	printf("frames %llu-%llu\n", (unsigned long long)last.frame,
+	       (unsigned long long)now.frame);
+	print_histogram("tiles", &now.tiles, &last.tiles);
+	print_histogram("frames", &now.frames, &last.frames);
+	fflush(stdout);
+    }
+
+usage:
+    fprintf(stderr, "Usage: %s [-i interval] latency-file\n", argv[0]);
+    return 2;
+}
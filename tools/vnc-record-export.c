@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2018, RealVNC Ltd.
+ *
+ * Export a recording made with the RecordFile option as a YUV4MPEG2
+ * stream, at a fixed frame rate, for any encoder to turn into video.  The
+ * output is as large as the largest screen in the recording, and the
+ * hardware cursor is drawn in.  With -s, playing starts from the last
+ * keyframe before the given time.
+ *
+ * Build: cc -O2 -Isrc -o vnc-record-export tools/vnc-record-export.c
+ * Usage: vnc-record-export [-r fps] [-s start] [-t duration] recording \
+ *            | ffmpeg -i - session.mp4
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vnc_export.h"
+
+typedef struct {
+    FILE *in;
+    vncRecordFileHeader file;
+    uint64_t base;          /* microseconds from the first header to file */
+    uint64_t first;         /* startTime of the first header */
+
+    int width, height;      /* of the screen being played */
+    int outWidth, outHeight;
+    uint32_t *fb;           /* outWidth x outHeight, in the file's format */
+
+    int cursorX, cursorY, cursorVisible, haveCursor;
+    uint32_t cursor[64 * 64];   /* 0xAARRGGBB, premultiplied 0 or 255 */
+
+    unsigned char *y;
+    int *u, *v;             /* chroma sums over 2x2 blocks */
+} player;
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "vnc-record-export: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * Read the next record header, taking in any file header in its place.
+ * Returns 0 at the end of the file.
+ */
+static int
+next_record(player *p, vncRecordHeader *h)
+{
+    for (;;) {
+	if (fread(h, sizeof(*h), 1, p->in) != 1)
+	    return 0;
+	if (h->sync == VNC_RECORD_SYNC)
+	    return 1;
+	if (h->sync != VNC_RECORD_MAGIC)
+	    die("corrupt recording");
+
+	/* A new file header, after a server restart */
+	if (fseek(p->in, -(long)sizeof(*h), SEEK_CUR) < 0 ||
+	    fread(&p->file, sizeof(p->file), 1, p->in) != 1)
+	    return 0;
+	if (p->file.version != VNC_RECORD_VERSION)
+	    die("unsupported recording version");
+	if (!p->first)
+	    p->first = p->file.startTime;
+	p->base = p->file.startTime - p->first;
+    }
+}
+
+static void
+skip_payload(player *p, const vncRecordHeader *h)
+{
+    if (fseek(p->in, h->size, SEEK_CUR) < 0)
+	die("truncated recording");
+}
+
+/* 8-bit component of a pixel in the file's format */
+static unsigned
+component(uint32_t pixel, uint32_t mask)
+{
+    int shift = 0, bits = 0;
+
+    if (!mask)
+	return 0;
+    while (!(mask & 1)) {
+	mask >>= 1;
+	shift++;
+    }
+    while (mask & (1u << bits))
+	bits++;
+    pixel = (pixel >> shift) & mask;
+    return bits >= 8 ? pixel >> (bits - 8) : pixel * 255 / mask;
+}
+
+static void
+apply_tiles(player *p, const vncRecordHeader *h)
+{
+    int bpp = p->file.bitsPerPixel;
+    unsigned char *data = malloc(h->size);
+    unsigned char *in = data;
+    vncRecordTiles tiles;
+    uint32_t i;
+    int x, y;
+
+    if (!data || fread(data, h->size, 1, p->in) != 1)
+	die("truncated recording");
+    memcpy(&tiles, in, sizeof(tiles));
+    in += sizeof(tiles);
+
+    for (i = 0; i < tiles.numTiles; i++) {
+	vncRecordTile tile;
+	size_t row;
+
+	memcpy(&tile, in, sizeof(tile));
+	in += sizeof(tile);
+	row = ((tile.width * bpp + 31) / 32) * 4;
+
+	for (y = 0; y < tile.height; y++) {
+	    uint32_t *dst = p->fb + (size_t)(tile.y + y) * p->outWidth + tile.x;
+	    const unsigned char *src = in + (tile.encoding ? 0 : y * row);
+
+	    if (tile.y + y >= p->outHeight)
+		break;
+	    for (x = 0; x < tile.width && tile.x + x < p->outWidth; x++) {
+		const unsigned char *s = src + (tile.encoding ? 0 : x * bpp / 8);
+
+		switch (bpp) {
+		case 32: dst[x] = *(const uint32_t *)s; break;
+		case 16: dst[x] = *(const uint16_t *)s; break;
+		default: dst[x] = *s; break;
+		}
+	    }
+	}
+	in += tile.encoding == VNC_RECORD_SOLID ? 4 : row * tile.height;
+    }
+    free(data);
+}
+
+static void
+apply_cursor_image(player *p, const vncRecordHeader *h)
+{
+    unsigned char *data = malloc(h->size);
+    vncRecordCursorImage image;
+    const unsigned char *source, *mask;
+    int x, y, pitch;
+
+    if (!data || fread(data, h->size, 1, p->in) != 1)
+	die("truncated recording");
+    memcpy(&image, data, sizeof(image));
+    if (image.width > 64 || image.height > 64)
+	die("unsupported cursor size");
+
+    pitch = (image.width + 31) / 32 * 4;
+    source = data + sizeof(image);
+    mask = source + pitch * image.height;
+    memset(p->cursor, 0, sizeof(p->cursor));
+    for (y = 0; y < (int)image.height; y++) {
+	for (x = 0; x < (int)image.width; x++) {
+	    int bit = 1 << (x & 7);
+
+	    if (!(mask[y * pitch + x / 8] & bit))
+		continue;
+	    p->cursor[y * 64 + x] = 0xff000000 |
+		(source[y * pitch + x / 8] & bit ? image.fg : image.bg);
+	}
+    }
+    p->haveCursor = 1;
+    free(data);
+}
+
+/* Write the current screen, with the cursor, as one YUV4MPEG2 frame */
+static void
+emit_frame(player *p, FILE *out)
+{
+    int w = p->outWidth, h = p->outHeight;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    int x, y;
+
+    memset(p->u, 0, (size_t)cw * ch * sizeof(*p->u));
+    memset(p->v, 0, (size_t)cw * ch * sizeof(*p->v));
+    for (y = 0; y < h; y++) {
+	for (x = 0; x < w; x++) {
+	    uint32_t px = p->fb[(size_t)y * w + x];
+	    int r = component(px, p->file.redMask);
+	    int g = component(px, p->file.greenMask);
+	    int b = component(px, p->file.blueMask);
+	    int cx = x - p->cursorX, cy = y - p->cursorY;
+	    int *u = p->u + (y / 2) * cw + x / 2;
+	    int *v = p->v + (y / 2) * cw + x / 2;
+
+	    if (p->haveCursor && p->cursorVisible &&
+		cx >= 0 && cx < 64 && cy >= 0 && cy < 64 &&
+		p->cursor[cy * 64 + cx]) {
+		uint32_t c = p->cursor[cy * 64 + cx];
+
+		r = (c >> 16) & 0xff;
+		g = (c >> 8) & 0xff;
+		b = c & 0xff;
+	    }
+
+	    /* BT.601, limited range */
+	    p->y[(size_t)y * w + x] = (66 * r + 129 * g + 25 * b + 128) / 256 + 16;
+	    *u += (-38 * r - 74 * g + 112 * b + 128) / 256 + 128;
+	    *v += (112 * r - 94 * g - 18 * b + 128) / 256 + 128;
+	}
+    }
+
+    fputs("FRAME\n", out);
+    fwrite(p->y, 1, (size_t)w * h, out);
+    for (y = 0; y < ch; y++) {
+	for (x = 0; x < cw; x++) {
+	    int n = (x * 2 + 1 < w ? 2 : 1) * (y * 2 + 1 < h ? 2 : 1);
+
+	    fputc(p->u[y * cw + x] / n, out);
+	}
+    }
+    for (y = 0; y < ch; y++) {
+	for (x = 0; x < cw; x++) {
+	    int n = (x * 2 + 1 < w ? 2 : 1) * (y * 2 + 1 < h ? 2 : 1);
+
+	    fputc(p->v[y * cw + x] / n, out);
+	}
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    player p;
+    vncRecordHeader h;
+    double fps = 10, start = 0, duration = -1;
+    uint64_t next, end, seek = 0, seekBase = 0;
+    vncRecordFileHeader seekFile;
+    long pos;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:s:t:")) != -1) {
+	switch (opt) {
+	case 'r': fps = atof(optarg); break;
+	case 's': start = atof(optarg); break;
+	case 't': duration = atof(optarg); break;
+	default: goto usage;
+	}
+    }
+    if (optind != argc - 1 || fps <= 0 || start < 0)
+	goto usage;
+
+    memset(&p, 0, sizeof(p));
+    p.in = fopen(argv[optind], "rb");
+    if (!p.in) {
+	perror(argv[optind]);
+	return 1;
+    }
+    if (fread(&p.file, sizeof(p.file), 1, p.in) != 1 ||
+	p.file.magic != VNC_RECORD_MAGIC ||
+	p.file.version != VNC_RECORD_VERSION)
+	die("not a recording");
+    p.first = p.file.startTime;
+
+    /* First pass: the output size, and the keyframe to start from */
+    next = (uint64_t)(start * 1e6);
+    while ((pos = ftell(p.in)), next_record(&p, &h)) {
+	if (h.type == VNC_RECORD_RESIZE) {
+	    vncRecordResize r;
+
+	    if (fread(&r, sizeof(r), 1, p.in) != 1)
+		break;
+	    p.outWidth = r.width > (uint32_t)p.outWidth ? (int)r.width
+							 : p.outWidth;
+	    p.outHeight = r.height > (uint32_t)p.outHeight ? (int)r.height
+							   : p.outHeight;
+	    /* With the header of the server that wrote it */
+	    if (p.base + h.time <= next) {
+		seek = pos;
+		seekBase = p.base;
+		seekFile = p.file;
+	    }
+	    skip_payload(&p, &(vncRecordHeader){ .size = h.size - sizeof(r) });
+	} else {
+	    skip_payload(&p, &h);
+	}
+    }
+    if (!p.outWidth || !p.outHeight)
+	die("no frames in the recording");
+    /* 4:2:0 wants even dimensions */
+    p.outWidth += p.outWidth & 1;
+    p.outHeight += p.outHeight & 1;
+
+    p.fb = calloc((size_t)p.outWidth * p.outHeight, sizeof(uint32_t));
+    p.y = malloc((size_t)p.outWidth * p.outHeight);
+    p.u = malloc((size_t)(p.outWidth / 2) * (p.outHeight / 2) * sizeof(int));
+    p.v = malloc((size_t)(p.outWidth / 2) * (p.outHeight / 2) * sizeof(int));
+    if (!p.fb || !p.y || !p.u || !p.v)
+	die("out of memory");
+
+    /* Second pass: play from there, a frame every 1/fps seconds */
+    if (seek) {
+	if (fseek(p.in, seek, SEEK_SET) < 0)
+	    die(strerror(errno));
+	p.file = seekFile;
+	p.base = seekBase;
+    } else {
+	rewind(p.in);
+	if (fread(&p.file, sizeof(p.file), 1, p.in) != 1)
+	    die("not a recording");
+	p.base = 0;
+    }
+
+    printf("YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C420jpeg\n",
+	   p.outWidth, p.outHeight, (int)(fps * 1000));
+    next = (uint64_t)(start * 1e6);
+    end = duration >= 0 ? next + (uint64_t)(duration * 1e6) : UINT64_MAX;
+
+    while (next_record(&p, &h)) {
+	uint64_t t = p.base + h.time;
+
+	if (t >= end)
+	    break;
+	while (t > next) {
+	    emit_frame(&p, stdout);
+	    next += (uint64_t)(1e6 / fps);
+	}
+
+	switch (h.type) {
+	case VNC_RECORD_RESIZE: {
+	    vncRecordResize r;
+
+	    if (fread(&r, sizeof(r), 1, p.in) != 1)
+		die("truncated recording");
+	    skip_payload(&p, &(vncRecordHeader){ .size = h.size - sizeof(r) });
+	    p.width = r.width;
+	    p.height = r.height;
+	    memset(p.fb, 0, (size_t)p.outWidth * p.outHeight * sizeof(uint32_t));
+	    break;
+	}
+	case VNC_RECORD_TILES:
+	    apply_tiles(&p, &h);
+	    break;
+	case VNC_RECORD_CURSOR: {
+	    vncRecordCursor c;
+
+	    if (fread(&c, sizeof(c), 1, p.in) != 1)
+		die("truncated recording");
+	    skip_payload(&p, &(vncRecordHeader){ .size = h.size - sizeof(c) });
+	    p.cursorX = c.x;
+	    p.cursorY = c.y;
+	    p.cursorVisible = c.visible;
+	    break;
+	}
+	case VNC_RECORD_CURSOR_IMAGE:
+	    apply_cursor_image(&p, &h);
+	    break;
+	default:
+	    skip_payload(&p, &h);
+	    break;
+	}
+    }
+
+    /* The last frame, if nothing has been written for it yet */
+    if (end == UINT64_MAX || next < end)
+	emit_frame(&p, stdout);
+    return fflush(stdout) == 0 ? 0 : 1;
+
+usage:
+    fprintf(stderr,
+	    "Usage: %s [-r fps] [-s start] [-t duration] recording\n",
+	    argv[0]);
+    return 2;
+}